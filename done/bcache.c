@@ -0,0 +1,575 @@
+/**
+ * @file bcache.c
+ * @brief write-back sector buffer cache (hash table + LRU list)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/uio.h>
+#include "bcache.h"
+#include "mount.h"
+#include "sector.h"
+#include "ioq.h"
+#include "error.h"
+
+/**
+ * @brief allocate a new (empty) buffer cache
+ * @param nbufs the number of sectors it can hold (>0)
+ * @return a pointer to the new cache or NULL on failure
+ */
+struct bcache *bcache_alloc(size_t nbufs)
+{
+    if (nbufs == 0) {
+        return NULL;
+    }
+
+    struct bcache *c = calloc(1, sizeof(struct bcache));
+    if (c == NULL) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&c->lock, NULL) != 0) {
+        free(c);
+        return NULL;
+    }
+
+    c->bufs = calloc(nbufs, sizeof(struct bcache_buf));
+    c->buckets = calloc(nbufs, sizeof(struct bcache_buf *));
+    if (c->bufs == NULL || c->buckets == NULL) {
+        bcache_free(c);
+        return NULL;
+    }
+    c->nbufs = nbufs;
+
+    // All the buffers start (invalid) in the LRU list, none in the hash table.
+    for (size_t i = 0; i < nbufs; ++i) {
+        c->bufs[i].lru_prev = i > 0 ? &c->bufs[i - 1] : NULL;
+        c->bufs[i].lru_next = i + 1 < nbufs ? &c->bufs[i + 1] : NULL;
+    }
+    c->mru = &c->bufs[0];
+    c->lru = &c->bufs[nbufs - 1];
+
+    return c;
+}
+
+/**
+ * @brief release a buffer cache (dirty buffers are lost: see bcache_flush)
+ * @param c the cache
+ */
+void bcache_free(struct bcache *c)
+{
+    if (c != NULL) {
+        pthread_mutex_destroy(&c->lock);
+        free(c->bufs);
+        free(c->buckets);
+        free(c);
+    }
+}
+
+/**
+ * @brief the hash bucket of a given sector
+ */
+static struct bcache_buf **bcache_bucket(struct bcache *c, uint32_t sector)
+{
+    return &c->buckets[sector % c->nbufs];
+}
+
+/**
+ * @brief remove a buffer from its hash bucket (if any)
+ */
+static void bcache_unhash(struct bcache *c, struct bcache_buf *b)
+{
+    if (b->valid) {
+        struct bcache_buf **p = bcache_bucket(c, b->sector);
+        while (*p != NULL && *p != b) {
+            p = &(*p)->hash_next;
+        }
+        if (*p == b) {
+            *p = b->hash_next;
+        }
+    }
+    b->hash_next = NULL;
+    b->valid = 0;
+    b->dirty = 0;
+    b->ahead = 0;
+}
+
+/**
+ * @brief move a buffer at the given end of the LRU list
+ * @param mru 1 to make it the most recently used, 0 the next victim
+ */
+static void bcache_touch(struct bcache *c, struct bcache_buf *b, int mru)
+{
+    // Unlink...
+    if (b->lru_prev != NULL) {
+        b->lru_prev->lru_next = b->lru_next;
+    } else {
+        c->mru = b->lru_next;
+    }
+    if (b->lru_next != NULL) {
+        b->lru_next->lru_prev = b->lru_prev;
+    } else {
+        c->lru = b->lru_prev;
+    }
+
+    // ...and relink.
+    if (mru) {
+        b->lru_prev = NULL;
+        b->lru_next = c->mru;
+        if (c->mru != NULL) {
+            c->mru->lru_prev = b;
+        }
+        c->mru = b;
+        if (c->lru == NULL) {
+            c->lru = b;
+        }
+    } else {
+        b->lru_next = NULL;
+        b->lru_prev = c->lru;
+        if (c->lru != NULL) {
+            c->lru->lru_next = b;
+        }
+        c->lru = b;
+        if (c->mru == NULL) {
+            c->mru = b;
+        }
+    }
+}
+
+/**
+ * @brief recycle the least recently used buffer for the given sector
+ *        (written back first if dirty); its data is left to the caller
+ * @param u the filesystem
+ * @param sector the sector it will hold
+ * @param b the buffer, now the most recently used (OUT)
+ * @return 0 on success; <0 on error, if no buffer could be written back (the
+ *         lock of the cache is held by the caller)
+ */
+static int bcache_recycle(const struct unix_filesystem *u, uint32_t sector, struct bcache_buf **b)
+{
+    struct bcache *c = u->cache;
+
+    // A dirty buffer that cannot be written back stays cached, out of the way
+    // of the next misses: bcache_flush() reports it.
+    int err = 0;
+    for (size_t tries = 0; c->lru->valid && c->lru->dirty && tries < c->nbufs; ++tries) {
+        err = sector_dev_write(u, c->lru->sector, c->lru->data);
+        if (err == 0) {
+            c->lru->dirty = 0;
+            c->writebacks += 1;
+        } else {
+            bcache_touch(c, c->lru, 1);
+        }
+    }
+
+    struct bcache_buf *victim = c->lru;
+    if (victim->valid && victim->dirty) {
+        return err;
+    }
+    if (victim->valid) {
+        c->evictions += 1;
+        c->prefetch_unused += victim->ahead ? 1 : 0;
+        bcache_unhash(c, victim);
+    }
+
+    victim->sector = sector;
+    victim->valid = 1;
+    victim->hash_next = *bcache_bucket(c, sector);
+    *bcache_bucket(c, sector) = victim;
+    bcache_touch(c, victim, 1);
+    *b = victim;
+
+    return 0;
+}
+
+/**
+ * @brief the buffer holding the given sector, if cached
+ */
+static struct bcache_buf *bcache_lookup(struct bcache *c, uint32_t sector)
+{
+    for (struct bcache_buf *p = *bcache_bucket(c, sector); p != NULL; p = p->hash_next) {
+        if (p->sector == sector) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief note the use of a buffer (a hit on a sector read ahead counts once)
+ */
+static void bcache_used(struct bcache *c, struct bcache_buf *b)
+{
+    if (b->ahead) {
+        c->prefetch_hits += 1;
+        b->ahead = 0;
+    }
+}
+
+/**
+ * @brief find the buffer holding the given sector, recycling the least
+ *        recently used one on a miss
+ * @param u the filesystem
+ * @param sector the sector wanted
+ * @param load 1 to read the sector from the disk on a miss
+ * @param b the buffer, now the most recently used (OUT)
+ * @return 0 on success; <0 on error (the lock of the cache is held by the caller)
+ */
+static int bcache_get(const struct unix_filesystem *u, uint32_t sector, int load,
+                      struct bcache_buf **b)
+{
+    struct bcache *c = u->cache;
+
+    struct bcache_buf *p = bcache_lookup(c, sector);
+    if (p != NULL) {
+        c->hits += 1;
+        bcache_used(c, p);
+        bcache_touch(c, p, 1);
+        *b = p;
+
+        return 0;
+    }
+
+    c->misses += 1;
+
+    struct bcache_buf *victim = NULL;
+    int err = bcache_recycle(u, sector, &victim);
+    if (err != 0) {
+        return err;
+    }
+
+    if (load) {
+        err = sector_dev_read(u, sector, victim->data);
+        if (err != 0) {
+            bcache_unhash(c, victim);
+            bcache_touch(c, victim, 0);
+            return err;
+        }
+    }
+
+    *b = victim;
+
+    return 0;
+}
+
+/**
+ * @brief read one sector through the cache of u
+ * @param u the filesystem (u->cache non NULL)
+ * @param sector the location (in sector units) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int bcache_read(const struct unix_filesystem *u, uint32_t sector, void *data)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->cache);
+    M_REQUIRE_NON_NULL(data);
+
+    pthread_mutex_lock(&u->cache->lock);
+    struct bcache_buf *b = NULL;
+    int err = bcache_get(u, sector, 1, &b);
+    if (err == 0) {
+        memcpy(data, b->data, SECTOR_SIZE);
+    }
+    pthread_mutex_unlock(&u->cache->lock);
+
+    return err;
+}
+
+/**
+ * @brief write one sector into the cache of u; it reaches the disk when
+ *        evicted or on bcache_flush()
+ * @param u the filesystem (u->cache non NULL)
+ * @param sector the location (in sector units) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int bcache_write(const struct unix_filesystem *u, uint32_t sector, const void *data)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->cache);
+    M_REQUIRE_NON_NULL(data);
+
+    // The whole sector is overwritten: no need to read it first.
+    pthread_mutex_lock(&u->cache->lock);
+    struct bcache_buf *b = NULL;
+    int err = bcache_get(u, sector, 0, &b);
+    if (err == 0) {
+        memcpy(b->data, data, SECTOR_SIZE);
+        b->dirty = 1;
+    }
+    pthread_mutex_unlock(&u->cache->lock);
+
+    return err;
+}
+
+/**
+ * @brief zero-copy access to one sector through the cache of u
+ * @param u the filesystem (u->cache non NULL)
+ * @param sector the location (in sector units) within the virtual disk
+ * @return a pointer to the 512 bytes of the sector, valid until the next
+ *         access to the cache (by any thread); NULL on error
+ */
+const void *bcache_borrow(const struct unix_filesystem *u, uint32_t sector)
+{
+    if (u == NULL || u->cache == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&u->cache->lock);
+    struct bcache_buf *b = NULL;
+    int err = bcache_get(u, sector, 1, &b);
+    pthread_mutex_unlock(&u->cache->lock);
+
+    return err == 0 ? b->data : NULL;
+}
+
+/**
+ * @brief look for a sector in a cache without loading it nor changing the LRU order
+ * @param c the cache
+ * @param sector the location (in sector units) within the virtual disk
+ * @param data a pointer to 512-bytes of memory, filled if the sector is cached;
+ *        may be NULL to only test the presence of the sector (OUT)
+ * @return 1 if the sector is cached; 0 otherwise
+ */
+int bcache_peek(struct bcache *c, uint32_t sector, void *data)
+{
+    if (c == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    struct bcache_buf *p = bcache_lookup(c, sector);
+    if (p != NULL && data != NULL) {
+        memcpy(data, p->data, SECTOR_SIZE);
+        bcache_used(c, p);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return p != NULL;
+}
+
+/**
+ * @brief replace the content of a sector in a cache, if it is there, without
+ *        loading it nor changing the LRU order; the copy becomes clean (the
+ *        caller writes the same data to the disk)
+ * @param c the cache
+ * @param sector the location (in sector units) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (IN)
+ * @return 1 if the sector is cached; 0 otherwise
+ */
+int bcache_update(struct bcache *c, uint32_t sector, const void *data)
+{
+    if (c == NULL || data == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    struct bcache_buf *p = bcache_lookup(c, sector);
+    if (p != NULL) {
+        memcpy(p->data, data, SECTOR_SIZE);
+        p->dirty = 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return p != NULL;
+}
+
+/**
+ * @brief read ahead into the cache of u the sectors of a run that are not
+ *        cached yet, in as few requests as possible
+ * @param u the filesystem (u->cache non NULL)
+ * @param sector the location of the first sector within the virtual disk
+ * @param count the number of sectors (at most BCACHE_PREFETCH_MAX are read)
+ * @return 0 on success; <0 on error
+ */
+int bcache_prefetch(const struct unix_filesystem *u, uint32_t sector, uint32_t count)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->cache);
+
+    struct bcache *c = u->cache;
+
+    // Never recycle more than half of the cache for sectors nobody asked for yet.
+    if (count > BCACHE_PREFETCH_MAX) {
+        count = BCACHE_PREFETCH_MAX;
+    }
+    if (count > c->nbufs / 2) {
+        count = (uint32_t) (c->nbufs / 2);
+    }
+
+    uint8_t run[BCACHE_PREFETCH_MAX * SECTOR_SIZE];
+    struct ioq_req gaps[BCACHE_PREFETCH_MAX];
+    size_t ngaps = 0;
+
+    pthread_mutex_lock(&c->lock);
+
+    // The pieces not cached yet are all read at once...
+    uint32_t i = 0;
+    while (i < count) {
+        if (bcache_lookup(c, sector + i) != NULL) {
+            i += 1;
+            continue;
+        }
+
+        uint32_t j = i + 1;
+        while (j < count && bcache_lookup(c, sector + j) == NULL) {
+            j += 1;
+        }
+
+        memset(&gaps[ngaps], 0, sizeof(struct ioq_req));
+        gaps[ngaps].sector = sector + i;
+        gaps[ngaps].count = j - i;
+        gaps[ngaps].data = run + (size_t) i * SECTOR_SIZE;
+        ngaps += 1;
+        i = j;
+    }
+    int err = sector_dev_batch(u, gaps, ngaps);
+
+    // ...then those read go to the cache.
+    for (size_t g = 0; g < ngaps; ++g) {
+        for (uint32_t k = 0; k < gaps[g].count && gaps[g].result == 0; ++k) {
+            struct bcache_buf *b = NULL;
+            int feedback = bcache_recycle(u, gaps[g].sector + k, &b);
+            if (feedback != 0) {
+                err = err != 0 ? err : feedback;
+                break;
+            }
+            memcpy(b->data, (uint8_t *) gaps[g].data + (size_t) k * SECTOR_SIZE, SECTOR_SIZE);
+            b->ahead = 1;
+            c->prefetched += 1;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return err;
+}
+
+/**
+ * @brief order buffers by sector (for qsort)
+ */
+static int bcache_cmp_sector(const void *a, const void *b)
+{
+    const struct bcache_buf *x = *(const struct bcache_buf * const *) a;
+    const struct bcache_buf *y = *(const struct bcache_buf * const *) b;
+
+    return x->sector < y->sector ? -1 : x->sector > y->sector;
+}
+
+/**
+ * @brief write all the dirty buffers of the cache of u to the disk
+ * @param u the filesystem
+ * @return 0 on success; <0 on error
+ */
+int bcache_flush(const struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+
+    struct bcache *c = u->cache;
+    if (c == NULL) {
+        return 0;
+    }
+
+    struct bcache_buf **dirty = calloc(c->nbufs, sizeof(struct bcache_buf *));
+    if (dirty == NULL) {
+        return ERR_NOMEM;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    size_t ndirty = 0;
+    for (size_t i = 0; i < c->nbufs; ++i) {
+        if (c->bufs[i].valid && c->bufs[i].dirty) {
+            dirty[ndirty] = &c->bufs[i];
+            ndirty += 1;
+        }
+    }
+    qsort(dirty, ndirty, sizeof(struct bcache_buf *), bcache_cmp_sector);
+
+    // The dirty buffers are written IOQ_DEFAULT_DEPTH at a time, all in flight
+    // together; those of consecutive sectors by one vectored request.
+    struct ioq_req batch[IOQ_DEFAULT_DEPTH];
+    struct iovec iov[IOQ_DEFAULT_DEPTH];
+    int err = 0;
+    for (size_t first = 0; first < ndirty; first += IOQ_DEFAULT_DEPTH) {
+        const size_t last = ndirty - first > IOQ_DEFAULT_DEPTH ? first + IOQ_DEFAULT_DEPTH : ndirty;
+        size_t n = 0;
+        for (size_t k = first; k < last; ++k) {
+            iov[k - first].iov_base = dirty[k]->data;
+            iov[k - first].iov_len = SECTOR_SIZE;
+
+            if (n > 0 && batch[n - 1].sector + batch[n - 1].count == dirty[k]->sector) {
+                batch[n - 1].count += 1;
+                batch[n - 1].iovcnt += 1;
+                continue;
+            }
+
+            struct ioq_req *r = &batch[n];
+            memset(r, 0, sizeof(struct ioq_req));
+            r->sector = dirty[k]->sector;
+            r->count = 1;
+            r->iov = &iov[k - first];
+            r->iovcnt = 1;
+            r->write = 1;
+            n += 1;
+        }
+
+        int feedback = sector_dev_batch(u, batch, n);
+        err = err != 0 ? err : feedback;
+
+        size_t k = first;
+        for (size_t i = 0; i < n; ++i) {
+            for (uint32_t j = 0; j < batch[i].count; ++j, ++k) {
+                if (batch[i].result == 0) {
+                    dirty[k]->dirty = 0;
+                    c->writebacks += 1;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    free(dirty);
+
+    return err;
+}
+
+/**
+ * @brief print the hit/miss/eviction and readahead counters of a cache
+ * @param c the cache
+ */
+void bcache_print(const struct bcache *c)
+{
+    printf("**********Buffer Cache START**********\n");
+
+    if (c != NULL) {
+        size_t used = 0;
+        size_t dirty = 0;
+        for (size_t i = 0; i < c->nbufs; ++i) {
+            used += c->bufs[i].valid ? 1 : 0;
+            dirty += c->bufs[i].dirty ? 1 : 0;
+        }
+
+        printf("%-20s: %zu\n", "buffers", c->nbufs);
+        printf("%-20s: %zu\n", "used", used);
+        printf("%-20s: %zu\n", "dirty", dirty);
+        printf("%-20s: %" PRIu64 "\n", "hits", c->hits);
+        printf("%-20s: %" PRIu64 "\n", "misses", c->misses);
+        printf("%-20s: %" PRIu64 "\n", "evictions", c->evictions);
+        printf("%-20s: %" PRIu64 "\n", "writebacks", c->writebacks);
+        printf("%-20s: %" PRIu64 "\n", "readahead", c->prefetched);
+        printf("%-20s: %" PRIu64 "\n", "readahead hits", c->prefetch_hits);
+        printf("%-20s: %" PRIu64 "\n", "readahead unused", c->prefetch_unused);
+        if (c->prefetched > 0) {
+            printf("%-20s: %.1f%%\n", "readahead hit rate",
+                   100.0 * (double) c->prefetch_hits / (double) c->prefetched);
+        }
+    } else {
+        printf("NULL ptr");
+    }
+
+    printf("**********Buffer Cache END************\n");
+
+    fflush(stdout);
+}
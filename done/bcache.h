@@ -0,0 +1,137 @@
+#pragma once
+
+/**
+ * @file bcache.h
+ * @brief write-back sector buffer cache (hash table + LRU list), sitting
+ *        between sector_read()/sector_write() and the disk backend.
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <pthread.h>
+#include "unixv6fs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BCACHE_DEFAULT_NBUFS (256)   // 128 KB of cached sectors per mount
+#define BCACHE_PREFETCH_MAX (32)     // sectors read ahead by one bcache_prefetch()
+
+struct unix_filesystem;
+
+struct bcache_buf {
+    uint32_t sector;                 // the sector held (if valid)
+    int valid;                       // 1 if data holds the content of sector
+    int dirty;                       // 1 if data is newer than the disk
+    int ahead;                       // 1 if read ahead and not used yet
+    struct bcache_buf *hash_next;    // next buffer in the same hash bucket
+    struct bcache_buf *lru_prev;     // more recently used neighbour
+    struct bcache_buf *lru_next;     // less recently used neighbour
+    uint8_t data[SECTOR_SIZE];
+};
+
+struct bcache {
+    pthread_mutex_t lock;            // held by every bcache_ function
+    size_t nbufs;
+    struct bcache_buf *bufs;         // the nbufs buffers
+    struct bcache_buf **buckets;     // nbufs hash buckets, keyed by sector
+    struct bcache_buf *mru;          // head of the LRU list
+    struct bcache_buf *lru;          // tail of the LRU list (next victim)
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;              // valid buffers reused for another sector
+    uint64_t writebacks;             // dirty buffers written to disk
+    uint64_t prefetched;             // sectors read ahead
+    uint64_t prefetch_hits;          // sectors read ahead, then used
+    uint64_t prefetch_unused;        // sectors read ahead, evicted before any use
+};
+
+/**
+ * @brief allocate a new (empty) buffer cache
+ * @param nbufs the number of sectors it can hold (>0)
+ * @return a pointer to the new cache or NULL on failure
+ */
+struct bcache *bcache_alloc(size_t nbufs);
+
+/**
+ * @brief release a buffer cache (dirty buffers are lost: see bcache_flush)
+ * @param c the cache
+ */
+void bcache_free(struct bcache *c);
+
+/**
+ * @brief read one sector through the cache of u
+ * @param u the filesystem (u->cache non NULL)
+ * @param sector the location (in sector units) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int bcache_read(const struct unix_filesystem *u, uint32_t sector, void *data);
+
+/**
+ * @brief write one sector into the cache of u; it reaches the disk when
+ *        evicted or on bcache_flush()
+ * @param u the filesystem (u->cache non NULL)
+ * @param sector the location (in sector units) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int bcache_write(const struct unix_filesystem *u, uint32_t sector, const void *data);
+
+/**
+ * @brief zero-copy access to one sector through the cache of u
+ * @param u the filesystem (u->cache non NULL)
+ * @param sector the location (in sector units) within the virtual disk
+ * @return a pointer to the 512 bytes of the sector, valid until the next
+ *         access to the cache (by any thread); NULL on error
+ */
+const void *bcache_borrow(const struct unix_filesystem *u, uint32_t sector);
+
+/**
+ * @brief look for a sector in a cache without loading it nor changing the LRU order
+ * @param c the cache
+ * @param sector the location (in sector units) within the virtual disk
+ * @param data a pointer to 512-bytes of memory, filled if the sector is cached;
+ *        may be NULL to only test the presence of the sector (OUT)
+ * @return 1 if the sector is cached; 0 otherwise
+ */
+int bcache_peek(struct bcache *c, uint32_t sector, void *data);
+
+/**
+ * @brief replace the content of a sector in a cache, if it is there, without
+ *        loading it nor changing the LRU order; the copy becomes clean (the
+ *        caller writes the same data to the disk)
+ * @param c the cache
+ * @param sector the location (in sector units) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (IN)
+ * @return 1 if the sector is cached; 0 otherwise
+ */
+int bcache_update(struct bcache *c, uint32_t sector, const void *data);
+
+/**
+ * @brief read ahead into the cache of u the sectors of a run that are not
+ *        cached yet, in as few requests as possible
+ * @param u the filesystem (u->cache non NULL)
+ * @param sector the location of the first sector within the virtual disk
+ * @param count the number of sectors (at most BCACHE_PREFETCH_MAX are read)
+ * @return 0 on success; <0 on error
+ */
+int bcache_prefetch(const struct unix_filesystem *u, uint32_t sector, uint32_t count);
+
+/**
+ * @brief write all the dirty buffers of the cache of u to the disk
+ * @param u the filesystem
+ * @return 0 on success; <0 on error
+ */
+int bcache_flush(const struct unix_filesystem *u);
+
+/**
+ * @brief print the hit/miss/eviction and readahead counters of a cache
+ * @param c the cache
+ */
+void bcache_print(const struct bcache *c);
+
+#ifdef __cplusplus
+}
+#endif
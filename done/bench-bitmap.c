@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "bmblock.h"
+#include "error.h"
+
+#define MIN (0)
+#define MAX (UINT16_MAX)      // a 64K-sector disk
+#define ROUNDS (200)
+
+/**
+ * @brief the search bm_find_next() used to do: one bm_get() per bit
+ */
+static int find_next_per_bit(struct bmblock_array *bm)
+{
+    uint64_t i = bm->min;
+    while (i <= bm->max && bm_get(bm, i)) {
+        i += 1;
+    }
+
+    return i <= bm->max ? (int) i : ERR_BITMAP_FULL;
+}
+
+/**
+ * @brief seconds elapsed since start
+ */
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief time both searches on a bitmap where only free is unused
+ */
+static int bench(struct bmblock_array *bm, uint64_t free)
+{
+    for (uint64_t i = MIN; i <= MAX; ++i) {
+        bm_set(bm, i);
+    }
+    bm_clear(bm, free);
+
+    struct timespec start;
+    int expected = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < ROUNDS; ++r) {
+        expected = find_next_per_bit(bm);
+    }
+    const double perBit = elapsed(&start) / ROUNDS;
+
+    int found = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int r = 0; r < ROUNDS; ++r) {
+        // Clearing and setting MIN brings the cursor back to the start.
+        bm_clear(bm, MIN);
+        bm_set(bm, MIN);
+        found = bm_find_next(bm);
+    }
+    const double perWord = elapsed(&start) / ROUNDS;
+
+    printf("free=%-6lu per bit: %10.0f ns  find_next: %8.0f ns  x%.0f\n",
+           (unsigned long) free, perBit * 1e9, perWord * 1e9, perBit / perWord);
+
+    bm_clear(bm, free);
+
+    return found == expected ? 0 : 1;
+}
+
+int main(void)
+{
+    struct bmblock_array* bm = bm_alloc(MIN, MAX);
+    if (bm == NULL) {
+        return 1;
+    }
+
+    int err = 0;
+    err |= bench(bm, MAX / 4);
+    err |= bench(bm, MAX / 2);
+    err |= bench(bm, MAX);
+
+    bm_free(bm);
+
+    if (err) {
+        printf("MISMATCH\n");
+    }
+
+    return err;
+}
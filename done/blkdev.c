@@ -0,0 +1,708 @@
+/**
+ * @file blkdev.c
+ * @brief the backends of the block devices
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "blkdev.h"
+#include "unixv6fs.h"
+#include "error.h"
+
+#define BITS_PER_WORD (64)
+
+/**
+ * @brief read len bytes at offset of the image; pread does not move a shared
+ *        file offset, so threads may read the device at the same time
+ * @return 0 on success; <0 on error (including the end of the image)
+ */
+static int blkdev_pread(int fd, void *buf, size_t len, off_t offset)
+{
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t done = pread(fd, p, len, offset);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) { // Error, or end of the image.
+            return ERR_IO;
+        }
+
+        p += done;
+        len -= (size_t) done;
+        offset += done;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief write len bytes at offset of the image, with pwrite (see blkdev_pread())
+ * @return 0 on success; <0 on error
+ */
+static int blkdev_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t done = pwrite(fd, p, len, offset);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return ERR_IO;
+        }
+
+        p += done;
+        len -= (size_t) done;
+        offset += done;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief the number of bytes of a vector of buffers
+ * @return the number of bytes; 0 if a buffer does not hold whole sectors
+ */
+static size_t blkdev_iov_bytes(const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        if (iov[i].iov_len % SECTOR_SIZE != 0) {
+            return 0;
+        }
+        total += iov[i].iov_len;
+    }
+
+    return total;
+}
+
+/**
+ * @brief readv/writev of a backend whose transfers cost no system call (or
+ *        go through a bounce buffer anyway): one read/write per buffer
+ */
+static int blkdev_each_iov(struct blkdev *dev, uint32_t sector, const struct iovec *iov, int iovcnt, int write)
+{
+    if (iovcnt < 0 || (iovcnt > 0 && blkdev_iov_bytes(iov, iovcnt) == 0)) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    for (int i = 0; i < iovcnt; ++i) {
+        const uint32_t count = (uint32_t) (iov[i].iov_len / SECTOR_SIZE);
+        int err = write ? dev->ops->write(dev, sector, count, iov[i].iov_base)
+                  : dev->ops->read(dev, sector, count, iov[i].iov_base);
+        if (err != 0) {
+            return err;
+        }
+        sector += count;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief SECTOR_BACKEND_FD: read consecutive sectors with pread on the image
+ */
+static int blkdev_fd_read(struct blkdev *dev, uint32_t sector, uint32_t count, void *data)
+{
+    return blkdev_pread(dev->fd, data, (size_t) count * SECTOR_SIZE, (off_t) sector * SECTOR_SIZE);
+}
+
+static int blkdev_fd_write(struct blkdev *dev, uint32_t sector, uint32_t count, const void *data)
+{
+    return blkdev_pwrite(dev->fd, data, (size_t) count * SECTOR_SIZE, (off_t) sector * SECTOR_SIZE);
+}
+
+/**
+ * @brief one preadv/pwritev for all the buffers; what a short transfer left
+ *        is finished one buffer at a time
+ */
+static int blkdev_fd_rwv(struct blkdev *dev, uint32_t sector, const struct iovec *iov, int iovcnt, int write)
+{
+    const size_t total = blkdev_iov_bytes(iov, iovcnt);
+    if (iovcnt <= 0 || total == 0) {
+        return iovcnt == 0 ? 0 : ERR_BAD_PARAMETER;
+    }
+
+    const off_t offset = (off_t) sector * SECTOR_SIZE;
+    ssize_t done;
+    do {
+        done = write ? pwritev(dev->fd, iov, iovcnt, offset) : preadv(dev->fd, iov, iovcnt, offset);
+    } while (done < 0 && errno == EINTR);
+    if (done < 0) {
+        return ERR_IO;
+    }
+    if ((size_t) done == total) {
+        return 0;
+    }
+
+    size_t skip = (size_t) done;
+    off_t at = offset;
+    for (int i = 0; i < iovcnt; ++i) {
+        const size_t len = iov[i].iov_len;
+        if (skip >= len) {
+            skip -= len;
+            at += (off_t) len;
+            continue;
+        }
+
+        uint8_t *base = (uint8_t *) iov[i].iov_base + skip;
+        int err = write ? blkdev_pwrite(dev->fd, base, len - skip, at + (off_t) skip)
+                  : blkdev_pread(dev->fd, base, len - skip, at + (off_t) skip);
+        if (err != 0) {
+            return err;
+        }
+        skip = 0;
+        at += (off_t) len;
+    }
+
+    return 0;
+}
+
+static int blkdev_fd_readv(struct blkdev *dev, uint32_t sector, const struct iovec *iov, int iovcnt)
+{
+    return blkdev_fd_rwv(dev, sector, iov, iovcnt, 0);
+}
+
+static int blkdev_fd_writev(struct blkdev *dev, uint32_t sector, const struct iovec *iov, int iovcnt)
+{
+    return blkdev_fd_rwv(dev, sector, iov, iovcnt, 1);
+}
+
+static int blkdev_nop(struct blkdev *dev)
+{
+    (void) dev;
+
+    return 0;
+}
+
+static const struct blkdev_ops blkdev_fd_ops = {
+    .name = "pread",
+    .read = blkdev_fd_read,
+    .write = blkdev_fd_write,
+    .readv = blkdev_fd_readv,
+    .writev = blkdev_fd_writev,
+    .borrow = NULL,
+    .sync = blkdev_nop,
+    .close = blkdev_nop
+};
+
+/**
+ * @brief SECTOR_BACKEND_MMAP: the image is mapped once; the mapped memory of
+ *        a sector, or NULL past the end of the mapping (e.g. not yet written
+ *        on a fresh mkfs), where pread/pwrite are used instead
+ */
+static uint8_t *blkdev_mmap_borrow(struct blkdev *dev, uint32_t sector)
+{
+    if ((size_t) sector < dev->mem_size / SECTOR_SIZE) {
+        return dev->mem + (size_t) sector * SECTOR_SIZE;
+    }
+
+    return NULL;
+}
+
+static int blkdev_mmap_read(struct blkdev *dev, uint32_t sector, uint32_t count, void *data)
+{
+    const size_t end = ((size_t) sector + count) * SECTOR_SIZE;
+    if (end <= dev->mem_size) {
+        memcpy(data, dev->mem + (size_t) sector * SECTOR_SIZE, (size_t) count * SECTOR_SIZE);
+
+        return 0;
+    }
+
+    return blkdev_fd_read(dev, sector, count, data);
+}
+
+static int blkdev_mmap_write(struct blkdev *dev, uint32_t sector, uint32_t count, const void *data)
+{
+    const size_t end = ((size_t) sector + count) * SECTOR_SIZE;
+    if (end <= dev->mem_size) {
+        memcpy(dev->mem + (size_t) sector * SECTOR_SIZE, data, (size_t) count * SECTOR_SIZE);
+
+        return 0;
+    }
+
+    return blkdev_fd_write(dev, sector, count, data);
+}
+
+static int blkdev_mmap_readv(struct blkdev *dev, uint32_t sector, const struct iovec *iov, int iovcnt)
+{
+    return blkdev_each_iov(dev, sector, iov, iovcnt, 0);
+}
+
+static int blkdev_mmap_writev(struct blkdev *dev, uint32_t sector, const struct iovec *iov, int iovcnt)
+{
+    return blkdev_each_iov(dev, sector, iov, iovcnt, 1);
+}
+
+static int blkdev_mmap_sync(struct blkdev *dev)
+{
+    return msync(dev->mem, dev->mem_size, MS_SYNC) == 0 ? 0 : ERR_IO;
+}
+
+static int blkdev_mmap_close(struct blkdev *dev)
+{
+    int err = blkdev_mmap_sync(dev);
+    if (munmap(dev->mem, dev->mem_size) != 0) {
+        err = ERR_IO;
+    }
+    dev->mem = NULL;
+    dev->mem_size = 0;
+
+    return err;
+}
+
+static const struct blkdev_ops blkdev_mmap_ops = {
+    .name = "mmap",
+    .read = blkdev_mmap_read,
+    .write = blkdev_mmap_write,
+    .readv = blkdev_mmap_readv,
+    .writev = blkdev_mmap_writev,
+    .borrow = blkdev_mmap_borrow,
+    .sync = blkdev_mmap_sync,
+    .close = blkdev_mmap_close
+};
+
+/**
+ * @brief map the whole sectors of the image
+ * @return 0 on success; <0 if it cannot be mapped (dev is left untouched)
+ */
+static int blkdev_mmap_setup(struct blkdev *dev)
+{
+    struct stat st;
+    if (fstat(dev->fd, &st) != 0 || st.st_size < SECTOR_SIZE) {
+        return ERR_IO;
+    }
+
+    const size_t size = (size_t) st.st_size - (size_t) st.st_size % SECTOR_SIZE;
+    void *map = mmap(NULL, size, dev->readonly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if (map == MAP_FAILED) {
+        return ERR_IO;
+    }
+
+    dev->mem = map;
+    dev->mem_size = size;
+    dev->ops = &blkdev_mmap_ops;
+    dev->backend = SECTOR_BACKEND_MMAP;
+
+    return 0;
+}
+
+/**
+ * @brief SECTOR_BACKEND_RAM: the image is read once into memory, and all the
+ *        I/O is served from there (the sectors written go back to the image
+ *        only when the device is synced); the memory of a sector, or NULL
+ */
+static uint8_t *blkdev_ram_borrow(struct blkdev *dev, uint32_t sector)
+{
+    return blkdev_mmap_borrow(dev, sector);
+}
+
+static int blkdev_ram_read(struct blkdev *dev, uint32_t sector, uint32_t count, void *data)
+{
+    const size_t end = ((size_t) sector + count) * SECTOR_SIZE;
+
+    pthread_rwlock_rdlock(&dev->lock);
+    int err = ERR_IO; // Past the end of the image, as pread would be.
+    if (end <= dev->mem_size) {
+        memcpy(data, dev->mem + (size_t) sector * SECTOR_SIZE, (size_t) count * SECTOR_SIZE);
+        err = 0;
+    }
+    pthread_rwlock_unlock(&dev->lock);
+
+    return err;
+}
+
+/**
+ * @brief make room in memory for the sectors before end (in bytes); those
+ *        never written read as zeros, as in a file with a hole
+ * @return 0 on success; <0 on error
+ */
+static int blkdev_ram_grow(struct blkdev *dev, size_t end)
+{
+    if (end > dev->mem_alloc) {
+        size_t alloc = dev->mem_alloc * 2 > end ? dev->mem_alloc * 2 : end;
+
+        uint8_t *mem = realloc(dev->mem, alloc);
+        if (mem == NULL) {
+            return ERR_NOMEM;
+        }
+        dev->mem = mem;
+
+        const size_t old_words = (dev->mem_alloc / SECTOR_SIZE + BITS_PER_WORD - 1) / BITS_PER_WORD;
+        const size_t words = (alloc / SECTOR_SIZE + BITS_PER_WORD - 1) / BITS_PER_WORD;
+        uint64_t *dirty = realloc(dev->dirty, words * sizeof(uint64_t));
+        if (dirty == NULL) {
+            return ERR_NOMEM;
+        }
+        memset(dirty + old_words, 0, (words - old_words) * sizeof(uint64_t));
+        dev->dirty = dirty;
+        dev->mem_alloc = alloc;
+    }
+
+    memset(dev->mem + dev->mem_size, 0, end - dev->mem_size);
+    dev->mem_size = end;
+
+    return 0;
+}
+
+static int blkdev_ram_write(struct blkdev *dev, uint32_t sector, uint32_t count, const void *data)
+{
+    const size_t end = ((size_t) sector + count) * SECTOR_SIZE;
+
+    pthread_rwlock_wrlock(&dev->lock);
+    int err = 0;
+    if (end > dev->mem_size) {
+        err = blkdev_ram_grow(dev, end);
+    }
+    if (err == 0) {
+        memcpy(dev->mem + (size_t) sector * SECTOR_SIZE, data, (size_t) count * SECTOR_SIZE);
+        for (uint32_t s = sector; s < sector + count; ++s) {
+            dev->dirty[s / BITS_PER_WORD] |= UINT64_C(1) << (s % BITS_PER_WORD);
+        }
+    }
+    pthread_rwlock_unlock(&dev->lock);
+
+    return err;
+}
+
+static int blkdev_ram_readv(struct blkdev *dev, uint32_t sector, const struct iovec *iov, int iovcnt)
+{
+    return blkdev_each_iov(dev, sector, iov, iovcnt, 0);
+}
+
+static int blkdev_ram_writev(struct blkdev *dev, uint32_t sector, const struct iovec *iov, int iovcnt)
+{
+    return blkdev_each_iov(dev, sector, iov, iovcnt, 1);
+}
+
+/**
+ * @brief write the runs of dirty sectors back to the image
+ */
+static int blkdev_ram_sync(struct blkdev *dev)
+{
+    pthread_rwlock_wrlock(&dev->lock);
+    int err = 0;
+    const uint32_t nsectors = (uint32_t) (dev->mem_size / SECTOR_SIZE);
+    uint32_t s = 0;
+    while (s < nsectors && err == 0) {
+        if (dev->dirty[s / BITS_PER_WORD] == 0) { // A whole word of clean sectors.
+            s = (s / BITS_PER_WORD + 1) * BITS_PER_WORD;
+            continue;
+        }
+        if (!(dev->dirty[s / BITS_PER_WORD] & (UINT64_C(1) << (s % BITS_PER_WORD)))) {
+            s += 1;
+            continue;
+        }
+
+        uint32_t e = s;
+        while (e < nsectors && (dev->dirty[e / BITS_PER_WORD] & (UINT64_C(1) << (e % BITS_PER_WORD)))) {
+            dev->dirty[e / BITS_PER_WORD] &= ~(UINT64_C(1) << (e % BITS_PER_WORD));
+            e += 1;
+        }
+        err = blkdev_pwrite(dev->fd, dev->mem + (size_t) s * SECTOR_SIZE,
+                            (size_t) (e - s) * SECTOR_SIZE, (off_t) s * SECTOR_SIZE);
+        s = e;
+    }
+    pthread_rwlock_unlock(&dev->lock);
+
+    return err;
+}
+
+static int blkdev_ram_close(struct blkdev *dev)
+{
+    // Not synced: discarded.
+    free(dev->mem);
+    dev->mem = NULL;
+    free(dev->dirty);
+    dev->dirty = NULL;
+    dev->mem_size = 0;
+    dev->mem_alloc = 0;
+
+    return 0;
+}
+
+static const struct blkdev_ops blkdev_ram_ops = {
+    .name = "ram",
+    .read = blkdev_ram_read,
+    .write = blkdev_ram_write,
+    .readv = blkdev_ram_readv,
+    .writev = blkdev_ram_writev,
+    .borrow = blkdev_ram_borrow,
+    .sync = blkdev_ram_sync,
+    .close = blkdev_ram_close
+};
+
+/**
+ * @brief read the whole sectors of the image into memory
+ * @return 0 on success; <0 on error (dev is left untouched)
+ */
+static int blkdev_ram_setup(struct blkdev *dev)
+{
+    struct stat st;
+    if (fstat(dev->fd, &st) != 0) {
+        return ERR_IO;
+    }
+
+    const size_t size = (size_t) st.st_size - (size_t) st.st_size % SECTOR_SIZE;
+    const size_t alloc = size > SECTOR_SIZE ? size : SECTOR_SIZE;
+    uint8_t *mem = malloc(alloc);
+    uint64_t *dirty = calloc((alloc / SECTOR_SIZE + BITS_PER_WORD - 1) / BITS_PER_WORD, sizeof(uint64_t));
+    if (mem == NULL || dirty == NULL) {
+        free(mem);
+        free(dirty);
+        return ERR_NOMEM;
+    }
+
+    int err = blkdev_pread(dev->fd, mem, size, 0);
+    if (err != 0) {
+        free(mem);
+        free(dirty);
+        return err;
+    }
+
+    dev->mem = mem;
+    dev->mem_size = size;
+    dev->mem_alloc = alloc;
+    dev->dirty = dirty;
+    dev->ops = &blkdev_ram_ops;
+    dev->backend = SECTOR_BACKEND_RAM;
+
+    return 0;
+}
+
+#ifdef O_DIRECT
+/**
+ * @brief SECTOR_BACKEND_DIRECT: read consecutive sectors with pread,
+ *        bypassing the page cache of the host; O_DIRECT wants aligned
+ *        buffers: that of the caller is used if it is, the bounce buffer
+ *        otherwise
+ */
+static int blkdev_direct_read(struct blkdev *dev, uint32_t sector, uint32_t count, void *data)
+{
+    if ((uintptr_t) data % BLKDEV_DIRECT_ALIGN == 0) {
+        return blkdev_fd_read(dev, sector, count, data);
+    }
+
+    uint8_t *p = data;
+    int err = 0;
+    pthread_mutex_lock(&dev->bounce_lock);
+    while (count > 0 && err == 0) {
+        const uint32_t n = count < BLKDEV_BOUNCE_SECTORS ? count : BLKDEV_BOUNCE_SECTORS;
+        err = blkdev_fd_read(dev, sector, n, dev->bounce);
+        if (err == 0) {
+            memcpy(p, dev->bounce, (size_t) n * SECTOR_SIZE);
+        }
+        p += (size_t) n * SECTOR_SIZE;
+        sector += n;
+        count -= n;
+    }
+    pthread_mutex_unlock(&dev->bounce_lock);
+
+    return err;
+}
+
+static int blkdev_direct_write(struct blkdev *dev, uint32_t sector, uint32_t count, const void *data)
+{
+    if ((uintptr_t) data % BLKDEV_DIRECT_ALIGN == 0) {
+        return blkdev_fd_write(dev, sector, count, data);
+    }
+
+    const uint8_t *p = data;
+    int err = 0;
+    pthread_mutex_lock(&dev->bounce_lock);
+    while (count > 0 && err == 0) {
+        const uint32_t n = count < BLKDEV_BOUNCE_SECTORS ? count : BLKDEV_BOUNCE_SECTORS;
+        memcpy(dev->bounce, p, (size_t) n * SECTOR_SIZE);
+        err = blkdev_fd_write(dev, sector, n, dev->bounce);
+        p += (size_t) n * SECTOR_SIZE;
+        sector += n;
+        count -= n;
+    }
+    pthread_mutex_unlock(&dev->bounce_lock);
+
+    return err;
+}
+
+static int blkdev_direct_readv(struct blkdev *dev, uint32_t sector, const struct iovec *iov, int iovcnt)
+{
+    return blkdev_each_iov(dev, sector, iov, iovcnt, 0);
+}
+
+static int blkdev_direct_writev(struct blkdev *dev, uint32_t sector, const struct iovec *iov, int iovcnt)
+{
+    return blkdev_each_iov(dev, sector, iov, iovcnt, 1);
+}
+
+static int blkdev_direct_close(struct blkdev *dev)
+{
+    free(dev->bounce);
+    dev->bounce = NULL;
+
+    return 0;
+}
+
+static const struct blkdev_ops blkdev_direct_ops = {
+    .name = "direct",
+    .read = blkdev_direct_read,
+    .write = blkdev_direct_write,
+    .readv = blkdev_direct_readv,
+    .writev = blkdev_direct_writev,
+    .borrow = NULL,
+    .sync = blkdev_nop,
+    .close = blkdev_direct_close
+};
+#endif
+
+/**
+ * @brief turn O_DIRECT on for the image, if its filesystem takes
+ *        sector-sized transfers that way
+ * @return 0 on success; <0 if O_DIRECT is unavailable (dev is left untouched)
+ */
+static int blkdev_direct_setup(struct blkdev *dev)
+{
+#ifdef O_DIRECT
+    void *bounce = NULL;
+    if (posix_memalign(&bounce, BLKDEV_DIRECT_ALIGN, BLKDEV_BOUNCE_SECTORS * SECTOR_SIZE) != 0) {
+        return ERR_NOMEM;
+    }
+
+    const int flags = fcntl(dev->fd, F_GETFL);
+    if (flags < 0 || fcntl(dev->fd, F_SETFL, flags | O_DIRECT) != 0) {
+        free(bounce);
+        return ERR_IO;
+    }
+
+    // Some filesystems accept the flag, then refuse the transfers (or want larger ones).
+    if (blkdev_pread(dev->fd, bounce, SECTOR_SIZE, 0) != 0) {
+        fcntl(dev->fd, F_SETFL, flags);
+        free(bounce);
+        return ERR_IO;
+    }
+
+    dev->bounce = bounce;
+    dev->ops = &blkdev_direct_ops;
+    dev->backend = SECTOR_BACKEND_DIRECT;
+
+    return 0;
+#else
+    (void) dev;
+
+    return ERR_IO;
+#endif
+}
+
+/**
+ * @brief a new device on an open image, on SECTOR_BACKEND_FD
+ * @return the device; NULL on error (fd is closed)
+ */
+static struct blkdev *blkdev_alloc(int fd, int readonly)
+{
+    struct blkdev *dev = calloc(1, sizeof(struct blkdev));
+    if (dev == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    dev->ops = &blkdev_fd_ops;
+    dev->backend = SECTOR_BACKEND_FD;
+    dev->fd = fd;
+    dev->readonly = readonly;
+    pthread_rwlock_init(&dev->lock, NULL);
+    pthread_mutex_init(&dev->bounce_lock, NULL);
+
+    return dev;
+}
+
+/**
+ * @brief open an image through the given backend; falls back to
+ *        SECTOR_BACKEND_FD if it cannot be set up (e.g. the image cannot be
+ *        mapped, or the filesystem holding it has no O_DIRECT)
+ * @param filename the image
+ * @param backend the backend wanted
+ * @param readonly 1 to never write to the image
+ * @return the device (see dev->backend for the backend set up); NULL on error
+ */
+struct blkdev *blkdev_open(const char *filename, enum sector_backend backend, int readonly)
+{
+    if (filename == NULL) {
+        return NULL;
+    }
+
+    int fd = open(filename, readonly ? O_RDONLY : O_RDWR);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct blkdev *dev = blkdev_alloc(fd, readonly);
+    if (dev == NULL) {
+        return NULL;
+    }
+
+    // On failure, dev stays on pread/pwrite.
+    switch (backend) {
+    case SECTOR_BACKEND_MMAP:
+        blkdev_mmap_setup(dev);
+        break;
+    case SECTOR_BACKEND_RAM:
+        blkdev_ram_setup(dev);
+        break;
+    case SECTOR_BACKEND_DIRECT:
+        blkdev_direct_setup(dev);
+        break;
+    default:
+        break;
+    }
+
+    return dev;
+}
+
+/**
+ * @brief create an empty image (truncated if it exists), to be written
+ *        through SECTOR_BACKEND_FD
+ * @param filename the image
+ * @return the device; NULL on error
+ */
+struct blkdev *blkdev_create(const char *filename)
+{
+    if (filename == NULL) {
+        return NULL;
+    }
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    return blkdev_alloc(fd, 0);
+}
+
+/**
+ * @brief release a device and close its image; the writes a
+ *        SECTOR_BACKEND_RAM device holds since its last sync are discarded
+ * @param dev the device (may be NULL)
+ * @return 0 on success; <0 on error (the device is released anyway)
+ */
+int blkdev_close(struct blkdev *dev)
+{
+    if (dev == NULL) {
+        return 0;
+    }
+
+    int err = dev->ops->close(dev);
+    if (close(dev->fd) != 0 && err == 0) {
+        err = ERR_IO;
+    }
+
+    pthread_mutex_destroy(&dev->bounce_lock);
+    pthread_rwlock_destroy(&dev->lock);
+    free(dev);
+
+    return err;
+}
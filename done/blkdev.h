@@ -0,0 +1,89 @@
+#pragma once
+
+/**
+ * @file blkdev.h
+ * @brief the block device a filesystem image is accessed through: a table of
+ *        functions per backend (pread/pwrite, mmap, in-RAM copy, O_DIRECT),
+ *        all addressing whole 512-byte sectors.
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h> // for struct iovec
+#include "sector.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BLKDEV_DIRECT_ALIGN (4096)     // alignment of the buffers of O_DIRECT transfers
+#define BLKDEV_BOUNCE_SECTORS (64)     // sectors an O_DIRECT transfer moves at most at once
+
+struct blkdev;
+
+/**
+ * @brief what a backend implements; count and the iov_len are in whole sectors
+ *        (the latter in bytes), and every function returns 0 on success, <0 on error
+ */
+struct blkdev_ops {
+    const char *name;
+    // count sectors from sector on, to/from one buffer
+    int (*read)(struct blkdev *dev, uint32_t sector, uint32_t count, void *data);
+    int (*write)(struct blkdev *dev, uint32_t sector, uint32_t count, const void *data);
+    // the sectors from sector on, scattered over iovcnt buffers
+    int (*readv)(struct blkdev *dev, uint32_t sector, const struct iovec *iov, int iovcnt);
+    int (*writev)(struct blkdev *dev, uint32_t sector, const struct iovec *iov, int iovcnt);
+    // where the sector lives in memory; NULL if not in memory (NULL if never)
+    uint8_t *(*borrow)(struct blkdev *dev, uint32_t sector);
+    // write back to the image what the backend still holds in memory
+    int (*sync)(struct blkdev *dev);
+    // release what the backend holds (not dev, nor the file descriptor); what
+    // sync would write back is written back first, except by RAM, which discards it
+    int (*close)(struct blkdev *dev);
+};
+
+struct blkdev {
+    const struct blkdev_ops *ops;
+    enum sector_backend backend;       // the backend set up for ops
+    int fd;                            // the image
+    int readonly;                      // 1 if the image is never written
+    uint8_t *mem;                      // MMAP: the mapping; RAM: the copy of the image
+    size_t mem_size;                   // bytes of whole sectors in mem
+    size_t mem_alloc;                  // RAM: bytes allocated for mem
+    uint64_t *dirty;                   // RAM: a bit per sector of mem written since the last sync
+    pthread_rwlock_t lock;             // RAM: held for writing while mem grows or is synced
+    uint8_t *bounce;                   // DIRECT: BLKDEV_BOUNCE_SECTORS aligned sectors
+    pthread_mutex_t bounce_lock;       // DIRECT: held while bounce is in use
+};
+
+/**
+ * @brief open an image through the given backend; falls back to
+ *        SECTOR_BACKEND_FD if it cannot be set up (e.g. the image cannot be
+ *        mapped, or the filesystem holding it has no O_DIRECT)
+ * @param filename the image
+ * @param backend the backend wanted
+ * @param readonly 1 to never write to the image
+ * @return the device (see dev->backend for the backend set up); NULL on error
+ */
+struct blkdev *blkdev_open(const char *filename, enum sector_backend backend, int readonly);
+
+/**
+ * @brief create an empty image (truncated if it exists), to be written
+ *        through SECTOR_BACKEND_FD
+ * @param filename the image
+ * @return the device; NULL on error
+ */
+struct blkdev *blkdev_create(const char *filename);
+
+/**
+ * @brief release a device and close its image; the writes a
+ *        SECTOR_BACKEND_RAM device holds since its last sync are discarded
+ * @param dev the device (may be NULL)
+ * @return 0 on success; <0 on error (the device is released anyway)
+ */
+int blkdev_close(struct blkdev *dev);
+
+#ifdef __cplusplus
+}
+#endif
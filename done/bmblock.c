@@ -10,6 +10,13 @@
 #include "bmblock.h"
 #include "error.h"
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#define WORDS_PER_AVX2 (4)
+#endif
+
+#define NO_HINT (UINT64_MAX)
+
 #define ELE_PER_INDEX (64)
 #define CLEAR (0)
 #define GET_SHADOW (1)
@@ -35,12 +42,101 @@ struct bmblock_array* bm_alloc(uint64_t min, uint64_t max)
             bm->cursor = 0;
             bm->min = min;
             bm->max = max;
+            bm->full_length = (bm->length + ELE_PER_INDEX - 1) / ELE_PER_INDEX;
+            bm->full = calloc(bm->full_length, sizeof(uint64_t));
+
+            if (bm->full == NULL || pthread_mutex_init(&bm->lock, NULL) != 0) {
+                free(bm->full);
+                free(bm);
+                bm = NULL;
+            }
         }
     }
 
     return bm;
 }
 
+/**
+ * @brief release a bmblock_array allocated by bm_alloc
+ * @param bmblock_array the array (may be NULL)
+ */
+void bm_free(struct bmblock_array *bmblock_array)
+{
+    if (bmblock_array != NULL) {
+        pthread_mutex_destroy(&bmblock_array->lock);
+        free(bmblock_array->full);
+        free(bmblock_array);
+    }
+}
+
+/**
+ * @brief the mask of the bit of a value within its word (value x - min is bit
+ *        x - min % 64 of word (x - min) / 64, so words read in increasing order)
+ */
+static uint64_t bm_mask(const struct bmblock_array* bmblock_array, uint64_t x)
+{
+    return UINT64_C(1) << ((x - bmblock_array->min) % ELE_PER_INDEX);
+}
+
+/**
+ * @brief the mask of the bits of a word standing for values up to max
+ */
+static uint64_t bm_valid(const struct bmblock_array* bmblock_array, size_t word)
+{
+    const uint64_t last = (bmblock_array->max - bmblock_array->min) % ELE_PER_INDEX;
+    if (word + 1 < bmblock_array->length || last == ELE_PER_INDEX - 1) {
+        return ~UINT64_C(0);
+    }
+
+    return (UINT64_C(1) << (last + 1)) - 1;
+}
+
+/**
+ * @brief the number of trailing zeros of a (non zero) word
+ */
+static unsigned bm_ctz(uint64_t word)
+{
+#if defined(__GNUC__)
+    return (unsigned) __builtin_ctzll(word);
+#else
+    unsigned n = 0;
+    while ((word & GET_SHADOW) == 0) {
+        word >>= 1;
+        n += 1;
+    }
+    return n;
+#endif
+}
+
+/**
+ * @brief the bit associated to the given value (the lock is held by the caller)
+ */
+static int bm_bit(const struct bmblock_array* bmblock_array, uint64_t x)
+{
+    if (x < bmblock_array->min || x > bmblock_array->max) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    size_t i = (x - bmblock_array->min) / ELE_PER_INDEX;
+
+    return (bmblock_array->bm[i] & bm_mask(bmblock_array, x)) != 0;
+}
+
+/**
+ * @brief set the bit associated to the given value (the lock is held by the caller)
+ */
+static void bm_setbit(struct bmblock_array* bmblock_array, uint64_t x)
+{
+    if (bmblock_array->min <= x && x <= bmblock_array->max) {
+        size_t i = (x - bmblock_array->min) / ELE_PER_INDEX;
+
+        bmblock_array->bm[i] |= bm_mask(bmblock_array, x);
+        if (bmblock_array->bm[i] == bm_valid(bmblock_array, i)) {
+            bmblock_array->full[i / ELE_PER_INDEX] |= UINT64_C(1) << (i % ELE_PER_INDEX);
+        }
+    }
+}
+
 /**
 * @brief return the bit associated to the given value
 * @param bmblock_array the array containing the value we want to read
@@ -51,14 +147,11 @@ int bm_get(struct bmblock_array* bmblock_array, uint64_t x)
 {
     M_REQUIRE_NON_NULL(bmblock_array);
 
-    if (x < bmblock_array->min || x > bmblock_array->max) {
-        return ERR_BAD_PARAMETER;
-    }
-
-    size_t i = (x - bmblock_array->min) / ELE_PER_INDEX;
-    size_t off = (x - bmblock_array->min) % ELE_PER_INDEX;
+    pthread_mutex_lock(&bmblock_array->lock);
+    int bit = bm_bit(bmblock_array, x);
+    pthread_mutex_unlock(&bmblock_array->lock);
 
-    return (bmblock_array->bm[i] >> (ELE_PER_INDEX - off)) & GET_SHADOW;
+    return bit;
 }
 
 /**
@@ -68,11 +161,10 @@ int bm_get(struct bmblock_array* bmblock_array, uint64_t x)
 */
 void bm_set(struct bmblock_array* bmblock_array, uint64_t x)
 {
-    if (bmblock_array != NULL && bmblock_array->min <= x && x <= bmblock_array->max) {
-        size_t i = (x - bmblock_array->min) / ELE_PER_INDEX;
-        size_t off = (x - bmblock_array->min) % ELE_PER_INDEX;
-
-        bmblock_array->bm[i] |= (UINT64_C(1) << (ELE_PER_INDEX - off));
+    if (bmblock_array != NULL) {
+        pthread_mutex_lock(&bmblock_array->lock);
+        bm_setbit(bmblock_array, x);
+        pthread_mutex_unlock(&bmblock_array->lock);
     }
 }
 
@@ -84,15 +176,18 @@ void bm_set(struct bmblock_array* bmblock_array, uint64_t x)
 void bm_clear(struct bmblock_array* bmblock_array, uint64_t x)
 {
     if (bmblock_array != NULL && bmblock_array->min <= x && x <= bmblock_array->max) {
+        pthread_mutex_lock(&bmblock_array->lock);
 
         size_t i = (x - bmblock_array->min) / ELE_PER_INDEX;
-        size_t off = (x - bmblock_array->min) % ELE_PER_INDEX;
 
-        bmblock_array->bm[i] &= (~(UINT64_C(1) << (ELE_PER_INDEX - off)));
+        bmblock_array->bm[i] &= ~bm_mask(bmblock_array, x);
+        bmblock_array->full[i / ELE_PER_INDEX] &= ~(UINT64_C(1) << (i % ELE_PER_INDEX));
 
         if (bmblock_array->cursor > (x - bmblock_array->min) / ELE_PER_INDEX) {
             bmblock_array->cursor = (x - bmblock_array->min) / ELE_PER_INDEX;
         }
+
+        pthread_mutex_unlock(&bmblock_array->lock);
     }
 }
 
@@ -101,7 +196,7 @@ void bm_clear(struct bmblock_array* bmblock_array, uint64_t x)
 * @param bm the pointer to the bmblock_array struct
 * @param ind the uint64_t element
 */
-void bm_print_bit(struct bmblock_array* bm, uint64_t ind)
+void bm_print_bit(const struct bmblock_array* bm, uint64_t ind)
 {
     if (bm != NULL) {
         int counter = 0;
@@ -110,7 +205,7 @@ void bm_print_bit(struct bmblock_array* bm, uint64_t ind)
             if (i > bm->max) {
                 printf("%d", CLEAR);
             } else {
-                printf("%d", bm_get(bm, i));
+                printf("%d", bm_bit(bm, i));
             }
 
             counter += 1;
@@ -131,6 +226,8 @@ void bm_print(struct bmblock_array *bmblock_array)
     printf("**********BitMap Block START**********\n");
 
     if (bmblock_array != NULL) {
+        pthread_mutex_lock(&bmblock_array->lock);
+
         printf("lenght: %zu\n", bmblock_array->length);
         printf("min: %zu\n", bmblock_array->min);
         printf("max: %zu\n", bmblock_array->max);
@@ -142,6 +239,8 @@ void bm_print(struct bmblock_array *bmblock_array)
             bm_print_bit(bmblock_array, i);
             printf("\n");
         }
+
+        pthread_mutex_unlock(&bmblock_array->lock);
     } else {
         printf("NULL ptr");
     }
@@ -151,6 +250,92 @@ void bm_print(struct bmblock_array *bmblock_array)
     fflush(stdout);
 }
 
+/**
+ * @brief the mask of the summary bits of a word of full standing for words of bm
+ */
+static uint64_t bm_full_valid(const struct bmblock_array* bmblock_array, size_t s)
+{
+    const size_t words = bmblock_array->length - s * ELE_PER_INDEX;
+
+    return words >= ELE_PER_INDEX ? ~UINT64_C(0) : (UINT64_C(1) << words) - 1;
+}
+
+/**
+ * @brief the first unused bit of the words of bm from w on: the summary
+ *        skips 64 full words at once (256 per step on AVX2), ctz finds the
+ *        first word not full, then the unused bit in it
+ * @return the offset (x - min) of the unused bit; ERR_BITMAP_FULL if there is none
+ */
+static int64_t bm_search(const struct bmblock_array *bmblock_array, size_t w)
+{
+    if (w >= bmblock_array->length) {
+        return ERR_BITMAP_FULL;
+    }
+
+    size_t s = w / ELE_PER_INDEX;
+    uint64_t notFull = ~bmblock_array->full[s] & (~UINT64_C(0) << (w % ELE_PER_INDEX));
+
+    while (1) {
+        notFull &= bm_full_valid(bmblock_array, s);
+        if (notFull != 0) {
+            w = s * ELE_PER_INDEX + bm_ctz(notFull);
+            const uint64_t unused = ~bmblock_array->bm[w] & bm_valid(bmblock_array, w);
+
+            return (int64_t) (w * ELE_PER_INDEX + bm_ctz(unused));
+        }
+
+        s += 1;
+
+#ifdef __AVX2__
+        const __m256i full = _mm256_set1_epi64x(-1);
+        while (s + WORDS_PER_AVX2 < bmblock_array->full_length
+               && _mm256_testc_si256(_mm256_loadu_si256((const __m256i *) &bmblock_array->full[s]), full)) {
+            s += WORDS_PER_AVX2;
+        }
+#endif
+
+        if (s >= bmblock_array->full_length) {
+            return ERR_BITMAP_FULL;
+        }
+        notFull = ~bmblock_array->full[s];
+    }
+}
+
+/**
+* @brief the first unused bit at or after hint, else the next unused bit
+*        from the cursor (the lock is held by the caller)
+* @param hint the value wanted; NO_HINT for the next unused bit
+* @return <0 on failure, the value of the unused value otherwise
+*/
+static int bm_next(struct bmblock_array *bmblock_array, uint64_t hint)
+{
+    if (hint != NO_HINT && bmblock_array->min <= hint && hint <= bmblock_array->max) {
+        const uint64_t off = hint - bmblock_array->min;
+        const size_t w = off / ELE_PER_INDEX;
+
+        // The word of the hint itself, from the hint on...
+        const uint64_t unused = ~bmblock_array->bm[w] & bm_valid(bmblock_array, w)
+                                & (~UINT64_C(0) << (off % ELE_PER_INDEX));
+        if (unused != 0) {
+            return (int) (bmblock_array->min + w * ELE_PER_INDEX + bm_ctz(unused));
+        }
+
+        // ...then the words after it.
+        const int64_t found = bm_search(bmblock_array, w + 1);
+        if (found >= 0) {
+            return (int) (bmblock_array->min + (uint64_t) found);
+        }
+    }
+
+    const int64_t found = bm_search(bmblock_array, bmblock_array->cursor);
+    if (found < 0) {
+        return ERR_BITMAP_FULL;
+    }
+    bmblock_array->cursor = (uint64_t) found / ELE_PER_INDEX;
+
+    return (int) (bmblock_array->min + (uint64_t) found);
+}
+
 /**
 * @brief return the next unused bit
 * @param bmblock_array the array we want to search for place
@@ -160,16 +345,365 @@ int bm_find_next(struct bmblock_array *bmblock_array)
 {
     M_REQUIRE_NON_NULL(bmblock_array);
 
-    uint64_t i = bmblock_array->cursor * BYTE_SIZE;
-    while (bm_get(bmblock_array, i) && i <= bmblock_array->max) {
-        i += 1;
+    pthread_mutex_lock(&bmblock_array->lock);
+    int next = bm_next(bmblock_array, NO_HINT);
+    pthread_mutex_unlock(&bmblock_array->lock);
+
+    return next;
+}
+
+/**
+ * @brief find the next unused bit and set it, atomically with respect to
+ *        the other threads using the array
+ * @param bmblock_array the array we want to search for place
+ * @return <0 on failure, the value now used otherwise
+ */
+int bm_take_next(struct bmblock_array *bmblock_array)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    return bm_take_next_from(bmblock_array, NO_HINT);
+}
+
+/**
+ * @brief return the first unused bit at or after a hint (e.g. next to the
+ *        last sector of a file), else the next unused bit as bm_find_next()
+ * @param bmblock_array the array we want to search for place
+ * @param hint the value we would like; out of [min, max] (e.g. 0) for none
+ * @return <0 on failure, the value of the unused value otherwise
+ */
+int bm_find_next_from(struct bmblock_array *bmblock_array, uint64_t hint)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    pthread_mutex_lock(&bmblock_array->lock);
+    int next = bm_next(bmblock_array, hint);
+    pthread_mutex_unlock(&bmblock_array->lock);
+
+    return next;
+}
+
+/**
+ * @brief bm_find_next_from() and set the bit found, atomically with respect
+ *        to the other threads using the array
+ * @param bmblock_array the array we want to search for place
+ * @param hint the value we would like; out of [min, max] (e.g. 0) for none
+ * @return <0 on failure, the value now used otherwise
+ */
+int bm_take_next_from(struct bmblock_array *bmblock_array, uint64_t hint)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    pthread_mutex_lock(&bmblock_array->lock);
+    int next = bm_next(bmblock_array, hint);
+    if (next >= 0) {
+        bm_setbit(bmblock_array, (uint64_t) next);
+    }
+    pthread_mutex_unlock(&bmblock_array->lock);
+
+    return next;
+}
+
+/**
+ * @brief the mask of the bits from lo (included) to hi (excluded) of a word
+ */
+static uint64_t bm_span(uint64_t lo, uint64_t hi)
+{
+    const uint64_t high = hi >= ELE_PER_INDEX ? ~UINT64_C(0) : (UINT64_C(1) << hi) - 1;
+
+    return high & (~UINT64_C(0) << lo);
+}
+
+/**
+ * @brief the first unused bit at or after offset off (offsets are x - min)
+ * @return the offset of the unused bit; ERR_BITMAP_FULL if there is none
+ */
+static int64_t bm_unused_from(const struct bmblock_array *bmblock_array, uint64_t off)
+{
+    const size_t w = off / ELE_PER_INDEX;
+    if (w >= bmblock_array->length) {
+        return ERR_BITMAP_FULL;
+    }
+
+    const uint64_t unused = ~bmblock_array->bm[w] & bm_valid(bmblock_array, w)
+                            & (~UINT64_C(0) << (off % ELE_PER_INDEX));
+    if (unused != 0) {
+        return (int64_t) (w * ELE_PER_INDEX + bm_ctz(unused));
+    }
+
+    return bm_search(bmblock_array, w + 1);
+}
+
+/**
+ * @brief the first used bit at or after offset off and before offset limit
+ * @return the offset of the used bit; limit if there is none
+ */
+static uint64_t bm_used_from(const struct bmblock_array *bmblock_array, uint64_t off, uint64_t limit)
+{
+    while (off < limit) {
+        const size_t w = off / ELE_PER_INDEX;
+        const uint64_t used = bmblock_array->bm[w] & (~UINT64_C(0) << (off % ELE_PER_INDEX));
+        if (used != 0) {
+            const uint64_t found = w * ELE_PER_INDEX + bm_ctz(used);
+            return found < limit ? found : limit;
+        }
+        off = (w + 1) * ELE_PER_INDEX;
+    }
+
+    return limit;
+}
+
+/**
+ * @brief the first run of count unused bits from offset off on (the lock is held by the caller)
+ * @return the offset of the run; ERR_BITMAP_FULL if there is none
+ */
+static int64_t bm_run_from(const struct bmblock_array *bmblock_array, uint64_t off, uint64_t count)
+{
+    const uint64_t size = bmblock_array->max - bmblock_array->min + 1;
+
+    while (1) {
+        const int64_t first = bm_unused_from(bmblock_array, off);
+        if (first < 0 || (uint64_t) first + count > size) {
+            return ERR_BITMAP_FULL;
+        }
+
+        // Long enough up to the next used bit?
+        const uint64_t end = bm_used_from(bmblock_array, (uint64_t) first, (uint64_t) first + count);
+        if (end == (uint64_t) first + count) {
+            return first;
+        }
+        off = end;
+    }
+}
+
+/**
+ * @brief the first run of count unused bits, at or after hint if possible
+ *        (the lock is held by the caller)
+ * @return <0 on failure, the first value of the run otherwise
+ */
+static int bm_run(const struct bmblock_array *bmblock_array, uint64_t count, uint64_t hint)
+{
+    if (count == 0) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    int64_t found = ERR_BITMAP_FULL;
+    if (bmblock_array->min <= hint && hint <= bmblock_array->max) {
+        found = bm_run_from(bmblock_array, hint - bmblock_array->min, count);
+    }
+
+    // The words before the cursor are full.
+    if (found < 0) {
+        found = bm_run_from(bmblock_array, bmblock_array->cursor * ELE_PER_INDEX, count);
+    }
+
+    return found < 0 ? (int) found : (int) (bmblock_array->min + (uint64_t) found);
+}
+
+/**
+ * @brief set or clear the bits of count consecutive values (the lock is held by the caller)
+ */
+static void bm_range(struct bmblock_array *bmblock_array, uint64_t x, uint64_t count, int set)
+{
+    // Only the part within [min, max].
+    uint64_t from = x < bmblock_array->min ? bmblock_array->min : x;
+    uint64_t to = x + count > bmblock_array->max + 1 ? bmblock_array->max + 1 : x + count;
+    if (count == 0 || x + count < x || from >= to) {
+        return;
+    }
+    from -= bmblock_array->min;
+    to -= bmblock_array->min;
+
+    for (size_t w = from / ELE_PER_INDEX; w * ELE_PER_INDEX < to; ++w) {
+        const uint64_t lo = w * ELE_PER_INDEX < from ? from - w * ELE_PER_INDEX : 0;
+        const uint64_t hi = to - w * ELE_PER_INDEX;
+        const uint64_t mask = bm_span(lo, hi);
+        const uint64_t summary = UINT64_C(1) << (w % ELE_PER_INDEX);
+
+        if (set) {
+            bmblock_array->bm[w] |= mask;
+            if (bmblock_array->bm[w] == bm_valid(bmblock_array, w)) {
+                bmblock_array->full[w / ELE_PER_INDEX] |= summary;
+            }
+        } else {
+            bmblock_array->bm[w] &= ~mask;
+            bmblock_array->full[w / ELE_PER_INDEX] &= ~summary;
+        }
+    }
+
+    if (!set && bmblock_array->cursor > from / ELE_PER_INDEX) {
+        bmblock_array->cursor = from / ELE_PER_INDEX;
+    }
+}
+
+/**
+ * @brief return the first of count consecutive unused bits, starting at or
+ *        after a hint if possible, else anywhere (first fit)
+ * @param bmblock_array the array we want to search for place
+ * @param count the number of consecutive unused bits wanted (>0)
+ * @param hint the value we would like; out of [min, max] (e.g. 0) for none
+ * @return <0 on failure (ERR_BITMAP_FULL if there is no such run), the first value of the run otherwise
+ */
+int bm_find_run(struct bmblock_array *bmblock_array, uint64_t count, uint64_t hint)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    pthread_mutex_lock(&bmblock_array->lock);
+    int first = bm_run(bmblock_array, count, hint);
+    pthread_mutex_unlock(&bmblock_array->lock);
+
+    return first;
+}
+
+/**
+ * @brief bm_find_run() and set the bits of the run found, atomically with
+ *        respect to the other threads using the array
+ * @param bmblock_array the array we want to search for place
+ * @param count the number of consecutive unused bits wanted (>0)
+ * @param hint the value we would like; out of [min, max] (e.g. 0) for none
+ * @return <0 on failure, the first value of the run now used otherwise
+ */
+int bm_take_run(struct bmblock_array *bmblock_array, uint64_t count, uint64_t hint)
+{
+    M_REQUIRE_NON_NULL(bmblock_array);
+
+    pthread_mutex_lock(&bmblock_array->lock);
+    int first = bm_run(bmblock_array, count, hint);
+    if (first >= 0) {
+        bm_range(bmblock_array, (uint64_t) first, count, 1);
+
+        // The cursor moves on to the first word not full, as after bm_find_next().
+        const int64_t next = bm_search(bmblock_array, bmblock_array->cursor);
+        if (next >= 0) {
+            bmblock_array->cursor = (uint64_t) next / ELE_PER_INDEX;
+        }
+    }
+    pthread_mutex_unlock(&bmblock_array->lock);
+
+    return first;
+}
+
+/**
+ * @brief set to true (or 1) the bits of count consecutive values, a word at a time
+ * @param bmblock_array the array containing the values we want to set
+ * @param x the first value
+ * @param count the number of values (those out of [min, max] are ignored)
+ */
+void bm_set_range(struct bmblock_array *bmblock_array, uint64_t x, uint64_t count)
+{
+    if (bmblock_array != NULL) {
+        pthread_mutex_lock(&bmblock_array->lock);
+        bm_range(bmblock_array, x, count, 1);
+        pthread_mutex_unlock(&bmblock_array->lock);
+    }
+}
+
+/**
+ * @brief set to false (or 0) the bits of count consecutive values, a word at a time
+ * @param bmblock_array the array containing the values we want to clear
+ * @param x the first value
+ * @param count the number of values (those out of [min, max] are ignored)
+ */
+void bm_clear_range(struct bmblock_array *bmblock_array, uint64_t x, uint64_t count)
+{
+    if (bmblock_array != NULL) {
+        pthread_mutex_lock(&bmblock_array->lock);
+        bm_range(bmblock_array, x, count, 0);
+        pthread_mutex_unlock(&bmblock_array->lock);
+    }
+}
+
+/**
+ * @brief add to a bmblock_array the bits set in another one (e.g. built by
+ *        another thread) of the same range
+ * @param dst the array to complete
+ * @param src the array to add, not used by other threads meanwhile
+ * @return 0 on success; <0 on error
+ */
+int bm_merge(struct bmblock_array *dst, const struct bmblock_array *src)
+{
+    M_REQUIRE_NON_NULL(dst);
+    M_REQUIRE_NON_NULL(src);
+
+    if (dst->min != src->min || dst->max != src->max) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    pthread_mutex_lock(&dst->lock);
+    for (size_t w = 0; w < dst->length; ++w) {
+        dst->bm[w] |= src->bm[w];
+        if (dst->bm[w] == bm_valid(dst, w)) {
+            dst->full[w / ELE_PER_INDEX] |= UINT64_C(1) << (w % ELE_PER_INDEX);
+        }
     }
+    pthread_mutex_unlock(&dst->lock);
 
-    if (i <= bmblock_array->max) {
-        bmblock_array->cursor = (i - bmblock_array->min) / ELE_PER_INDEX;
+    return 0;
+}
 
-        return (int) i;
+/**
+ * @brief the number of bytes of the content of a bmblock_array, as exported
+ *        by bm_export() (one bit per value)
+ * @param bmblock_array the array
+ * @return the number of bytes
+ */
+size_t bm_bytes(const struct bmblock_array *bmblock_array)
+{
+    if (bmblock_array == NULL) {
+        return 0;
     }
 
-    return ERR_BITMAP_FULL;
+    return (size_t) ((bmblock_array->max - bmblock_array->min) / BYTE_SIZE + 1);
+}
+
+/**
+ * @brief copy the content of a bmblock_array, bit j of byte k standing for the
+ *        value min + 8 * k + j (the same on any host, e.g. to be saved on disk)
+ * @param bmblock_array the array
+ * @param buf points to bm_bytes() bytes of available memory (OUT)
+ */
+void bm_export(struct bmblock_array *bmblock_array, uint8_t *buf)
+{
+    if (bmblock_array != NULL && buf != NULL) {
+        pthread_mutex_lock(&bmblock_array->lock);
+
+        const size_t bytes = bm_bytes(bmblock_array);
+        for (size_t k = 0; k < bytes; ++k) {
+            const uint64_t word = bmblock_array->bm[k / BYTE_SIZE];
+            buf[k] = (uint8_t) (word >> (k % BYTE_SIZE * BYTE_SIZE));
+        }
+
+        pthread_mutex_unlock(&bmblock_array->lock);
+    }
+}
+
+/**
+ * @brief replace the content of a bmblock_array with what bm_export() produced
+ * @param bmblock_array the array
+ * @param buf points to the bm_bytes() bytes of the content (IN)
+ */
+void bm_import(struct bmblock_array *bmblock_array, const uint8_t *buf)
+{
+    if (bmblock_array != NULL && buf != NULL) {
+        pthread_mutex_lock(&bmblock_array->lock);
+
+        memset(bmblock_array->bm, 0, bmblock_array->length * sizeof(uint64_t));
+        memset(bmblock_array->full, 0, bmblock_array->full_length * sizeof(uint64_t));
+
+        const size_t bytes = bm_bytes(bmblock_array);
+        for (size_t k = 0; k < bytes; ++k) {
+            bmblock_array->bm[k / BYTE_SIZE] |= (uint64_t) buf[k] << (k % BYTE_SIZE * BYTE_SIZE);
+        }
+
+        // Bits past max are never set; the summary and the cursor start over.
+        for (size_t w = 0; w < bmblock_array->length; ++w) {
+            bmblock_array->bm[w] &= bm_valid(bmblock_array, w);
+            if (bmblock_array->bm[w] == bm_valid(bmblock_array, w)) {
+                bmblock_array->full[w / ELE_PER_INDEX] |= UINT64_C(1) << (w % ELE_PER_INDEX);
+            }
+        }
+        bmblock_array->cursor = 0;
+
+        pthread_mutex_unlock(&bmblock_array->lock);
+    }
 }
@@ -10,6 +10,7 @@
 
 #include <stddef.h> // for size_t
 #include <stdint.h>
+#include <pthread.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,6 +21,9 @@ struct bmblock_array {
     uint64_t cursor;
     uint64_t min;       // inclusive, nbrToUse = max - min + 1
     uint64_t max;       // inclusive
+    pthread_mutex_t lock; // held by every bm_ function
+    uint64_t *full;     // summary: bit w%64 of full[w/64] set iff word w of bm is full
+    size_t full_length; // number of words of full
     uint64_t bm[1];
 };
 
@@ -34,6 +38,12 @@ struct bmblock_array {
  */
 struct bmblock_array *bm_alloc(uint64_t min, uint64_t max);
 
+/**
+ * @brief release a bmblock_array allocated by bm_alloc
+ * @param bmblock_array the array (may be NULL)
+ */
+void bm_free(struct bmblock_array *bmblock_array);
+
 /**
  * @brief return the bit associated to the given value
  * @param bmblock_array the array containing the value we want to read
@@ -63,6 +73,100 @@ void bm_clear(struct bmblock_array *bmblock_array, uint64_t x);
  */
 int bm_find_next(struct bmblock_array *bmblock_array);
 
+/**
+ * @brief find the next unused bit and set it, atomically with respect to
+ *        the other threads using the array
+ * @param bmblock_array the array we want to search for place
+ * @return <0 on failure, the value now used otherwise
+ */
+int bm_take_next(struct bmblock_array *bmblock_array);
+
+/**
+ * @brief return the first unused bit at or after a hint (e.g. next to the
+ *        last sector of a file), else the next unused bit as bm_find_next()
+ * @param bmblock_array the array we want to search for place
+ * @param hint the value we would like; out of [min, max] (e.g. 0) for none
+ * @return <0 on failure, the value of the unused value otherwise
+ */
+int bm_find_next_from(struct bmblock_array *bmblock_array, uint64_t hint);
+
+/**
+ * @brief bm_find_next_from() and set the bit found, atomically with respect
+ *        to the other threads using the array
+ * @param bmblock_array the array we want to search for place
+ * @param hint the value we would like; out of [min, max] (e.g. 0) for none
+ * @return <0 on failure, the value now used otherwise
+ */
+int bm_take_next_from(struct bmblock_array *bmblock_array, uint64_t hint);
+
+/**
+ * @brief return the first of count consecutive unused bits, starting at or
+ *        after a hint if possible, else anywhere (first fit)
+ * @param bmblock_array the array we want to search for place
+ * @param count the number of consecutive unused bits wanted (>0)
+ * @param hint the value we would like; out of [min, max] (e.g. 0) for none
+ * @return <0 on failure (ERR_BITMAP_FULL if there is no such run), the first value of the run otherwise
+ */
+int bm_find_run(struct bmblock_array *bmblock_array, uint64_t count, uint64_t hint);
+
+/**
+ * @brief bm_find_run() and set the bits of the run found, atomically with
+ *        respect to the other threads using the array
+ * @param bmblock_array the array we want to search for place
+ * @param count the number of consecutive unused bits wanted (>0)
+ * @param hint the value we would like; out of [min, max] (e.g. 0) for none
+ * @return <0 on failure, the first value of the run now used otherwise
+ */
+int bm_take_run(struct bmblock_array *bmblock_array, uint64_t count, uint64_t hint);
+
+/**
+ * @brief set to true (or 1) the bits of count consecutive values, a word at a time
+ * @param bmblock_array the array containing the values we want to set
+ * @param x the first value
+ * @param count the number of values (those out of [min, max] are ignored)
+ */
+void bm_set_range(struct bmblock_array *bmblock_array, uint64_t x, uint64_t count);
+
+/**
+ * @brief set to false (or 0) the bits of count consecutive values, a word at a time
+ * @param bmblock_array the array containing the values we want to clear
+ * @param x the first value
+ * @param count the number of values (those out of [min, max] are ignored)
+ */
+void bm_clear_range(struct bmblock_array *bmblock_array, uint64_t x, uint64_t count);
+
+/**
+ * @brief add to a bmblock_array the bits set in another one (e.g. built by
+ *        another thread) of the same range
+ * @param dst the array to complete
+ * @param src the array to add, not used by other threads meanwhile
+ * @return 0 on success; <0 on error
+ */
+int bm_merge(struct bmblock_array *dst, const struct bmblock_array *src);
+
+/**
+ * @brief the number of bytes of the content of a bmblock_array, as exported
+ *        by bm_export() (one bit per value)
+ * @param bmblock_array the array
+ * @return the number of bytes
+ */
+size_t bm_bytes(const struct bmblock_array *bmblock_array);
+
+/**
+ * @brief copy the content of a bmblock_array, bit j of byte k standing for the
+ *        value min + 8 * k + j (the same on any host, e.g. to be saved on disk)
+ * @param bmblock_array the array
+ * @param buf points to bm_bytes() bytes of available memory (OUT)
+ */
+void bm_export(struct bmblock_array *bmblock_array, uint8_t *buf);
+
+/**
+ * @brief replace the content of a bmblock_array with what bm_export() produced
+ * @param bmblock_array the array
+ * @param buf points to the bm_bytes() bytes of the content (IN)
+ */
+void bm_import(struct bmblock_array *bmblock_array, const uint8_t *buf);
+
 /**
  * @brief usefull to see (and debug) content of a bmblock_array
  * @param bmblock_array the array we want to see
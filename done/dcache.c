@@ -0,0 +1,261 @@
+/**
+ * @file dcache.c
+ * @brief dentry cache: results of whole path lookups
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "dcache.h"
+#include "error.h"
+
+/**
+ * @brief allocate a new (empty) dentry cache
+ * @param size the number of paths it can hold (rounded up to a power of 2)
+ * @return a pointer to the new cache or NULL on failure
+ */
+struct dcache *dcache_alloc(size_t size)
+{
+    if (size == 0 || size > INT32_MAX) {
+        return NULL;
+    }
+
+    size_t pow2 = 1;
+    while (pow2 < size) {
+        pow2 *= 2;
+    }
+
+    struct dcache *c = calloc(1, sizeof(struct dcache));
+    if (c == NULL) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&c->lock, NULL) != 0) {
+        free(c);
+        return NULL;
+    }
+
+    c->entries = calloc(pow2, sizeof(struct dcache_entry));
+    c->buckets = calloc(pow2, sizeof(int32_t));
+    if (c->entries == NULL || c->buckets == NULL) {
+        dcache_free(c);
+        return NULL;
+    }
+    c->size = pow2;
+
+    for (size_t i = 0; i < c->size; ++i) {
+        c->buckets[i] = -1;
+        c->entries[i].next = -1;
+    }
+
+    return c;
+}
+
+/**
+ * @brief release a dentry cache
+ * @param c the cache
+ */
+void dcache_free(struct dcache *c)
+{
+    if (c != NULL) {
+        pthread_mutex_destroy(&c->lock);
+        free(c->entries);
+        free(c->buckets);
+        free(c);
+    }
+}
+
+/**
+ * @brief the hash bucket of a (root, path) pair
+ */
+static size_t dcache_bucket(const struct dcache *c, uint16_t root, const char *path)
+{
+    uint32_t h = 2166136261u ^ root;
+    h *= 16777619u;
+    for (size_t i = 0; path[i] != '\0'; ++i) {
+        h ^= (uint8_t) path[i];
+        h *= 16777619u;
+    }
+
+    return h & (c->size - 1);
+}
+
+/**
+ * @brief remove an entry from its hash bucket and mark it free
+ */
+static void dcache_unhash(struct dcache *c, int32_t i)
+{
+    struct dcache_entry *e = &c->entries[i];
+    if (e->root != 0) {
+        int32_t *p = &c->buckets[dcache_bucket(c, e->root, e->path)];
+        while (*p >= 0 && *p != i) {
+            p = &c->entries[*p].next;
+        }
+        if (*p == i) {
+            *p = e->next;
+        }
+    }
+
+    memset(e, 0, sizeof(struct dcache_entry));
+    e->next = -1;
+}
+
+/**
+ * @brief the entry of a (root, path) pair in its bucket b, the lock held
+ * @return its index; -1 if none
+ */
+static int32_t dcache_find(const struct dcache *c, size_t b, uint16_t root, const char *path)
+{
+    for (int32_t i = c->buckets[b]; i >= 0; i = c->entries[i].next) {
+        const struct dcache_entry *e = &c->entries[i];
+        if (e->root == root && strcmp(e->path, path) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief look up a path in the cache
+ * @param c the cache
+ * @param root the directory the path is relative to
+ * @param path the path
+ * @param inr the inode number, or ERR_INODE_OUTOF_RANGE if the path is known not to exist (OUT)
+ * @return 1 on a hit; 0 on a miss
+ */
+int dcache_lookup(struct dcache *c, uint16_t root, const char *path, int *inr)
+{
+    if (c == NULL || path == NULL || inr == NULL || strlen(path) > DCACHE_PATHLEN) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    const int32_t i = dcache_find(c, dcache_bucket(c, root, path), root, path);
+    const int hit = i >= 0;
+    if (hit) {
+        c->negative_hits += c->entries[i].inr < 0 ? 1 : 0;
+        *inr = c->entries[i].inr;
+    }
+    c->hits += hit ? 1 : 0;
+    c->misses += hit ? 0 : 1;
+    pthread_mutex_unlock(&c->lock);
+
+    return hit;
+}
+
+/**
+ * @brief the generation of a cache, to be taken before a lookup whose result
+ *        will be inserted
+ * @param c the cache
+ * @return the number of purges so far
+ */
+uint64_t dcache_generation(struct dcache *c)
+{
+    if (c == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    const uint64_t generation = c->generation;
+    pthread_mutex_unlock(&c->lock);
+
+    return generation;
+}
+
+/**
+ * @brief remember the result of a path lookup, unless the cache was purged
+ *        since the lookup began (the path may have been created meanwhile);
+ *        a path already cached keeps its entry, updated
+ * @param c the cache
+ * @param generation what dcache_generation() returned before the lookup
+ * @param root the directory the path is relative to
+ * @param path the path
+ * @param inr the inode number, or ERR_INODE_OUTOF_RANGE if the path does not exist
+ */
+void dcache_insert(struct dcache *c, uint64_t generation, uint16_t root, const char *path, int inr)
+{
+    if (c == NULL || path == NULL || root == 0 || strlen(path) > DCACHE_PATHLEN) {
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    if (c->generation != generation) {
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+
+    const size_t b = dcache_bucket(c, root, path);
+    const int32_t known = dcache_find(c, b, root, path);
+    if (known >= 0) {
+        c->entries[known].inr = inr;
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+
+    const int32_t i = (int32_t) c->hand;
+    c->hand = (c->hand + 1) & (c->size - 1);
+    dcache_unhash(c, i);
+
+    struct dcache_entry *e = &c->entries[i];
+    e->root = root;
+    e->inr = inr;
+    strncpy(e->path, path, DCACHE_PATHLEN);
+    e->path[DCACHE_PATHLEN] = '\0';
+
+    e->next = c->buckets[b];
+    c->buckets[b] = i;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * @brief forget all the negative entries (e.g. after creating a new entry)
+ * @param c the cache
+ */
+void dcache_purge_negative(struct dcache *c)
+{
+    if (c == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    for (size_t i = 0; i < c->size; ++i) {
+        if (c->entries[i].root != 0 && c->entries[i].inr < 0) {
+            dcache_unhash(c, (int32_t) i);
+        }
+    }
+    c->generation += 1;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * @brief print the counters of a dentry cache
+ * @param c the cache
+ */
+void dcache_print(const struct dcache *c)
+{
+    printf("**********Dentry Cache START**********\n");
+
+    if (c != NULL) {
+        size_t used = 0;
+        size_t negative = 0;
+        for (size_t i = 0; i < c->size; ++i) {
+            used += c->entries[i].root != 0 ? 1 : 0;
+            negative += c->entries[i].root != 0 && c->entries[i].inr < 0 ? 1 : 0;
+        }
+
+        printf("%-20s: %zu\n", "size", c->size);
+        printf("%-20s: %zu\n", "used", used);
+        printf("%-20s: %zu\n", "negative", negative);
+        printf("%-20s: %" PRIu64 "\n", "hits", c->hits);
+        printf("%-20s: %" PRIu64 "\n", "negative hits", c->negative_hits);
+        printf("%-20s: %" PRIu64 "\n", "misses", c->misses);
+    } else {
+        printf("NULL ptr");
+    }
+
+    printf("**********Dentry Cache END************\n");
+
+    fflush(stdout);
+}
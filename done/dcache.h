@@ -0,0 +1,96 @@
+#pragma once
+
+/**
+ * @file dcache.h
+ * @brief dentry cache: results of whole path lookups, including the paths
+ *        which do not exist (negative entries).
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DCACHE_DEFAULT_SIZE (1024)   // cached paths per mount
+#define DCACHE_PATHLEN (127)         // longer paths are never cached
+
+struct dcache_entry {
+    uint16_t root;                    // the directory the path is relative to; 0 if free
+    int inr;                          // the inode number; ERR_INODE_OUTOF_RANGE if negative
+    int32_t next;                     // next entry in the same bucket; -1 at the end
+    char path[DCACHE_PATHLEN + 1];
+};
+
+struct dcache {
+    pthread_mutex_t lock;             // held by every dcache_ function
+    size_t size;                      // a power of 2
+    size_t hand;                      // next entry to recycle (FIFO replacement)
+    struct dcache_entry *entries;     // the size entries
+    int32_t *buckets;                 // first entry of each bucket; -1 if empty
+    uint64_t generation;              // bumped each time the negative entries are purged
+    uint64_t hits;
+    uint64_t negative_hits;           // hits on paths which do not exist
+    uint64_t misses;
+};
+
+/**
+ * @brief allocate a new (empty) dentry cache
+ * @param size the number of paths it can hold (rounded up to a power of 2)
+ * @return a pointer to the new cache or NULL on failure
+ */
+struct dcache *dcache_alloc(size_t size);
+
+/**
+ * @brief release a dentry cache
+ * @param c the cache
+ */
+void dcache_free(struct dcache *c);
+
+/**
+ * @brief look up a path in the cache
+ * @param c the cache
+ * @param root the directory the path is relative to
+ * @param path the path
+ * @param inr the inode number, or ERR_INODE_OUTOF_RANGE if the path is known not to exist (OUT)
+ * @return 1 on a hit; 0 on a miss
+ */
+int dcache_lookup(struct dcache *c, uint16_t root, const char *path, int *inr);
+
+/**
+ * @brief the generation of a cache, to be taken before a lookup whose result
+ *        will be inserted
+ * @param c the cache
+ * @return the number of purges so far
+ */
+uint64_t dcache_generation(struct dcache *c);
+
+/**
+ * @brief remember the result of a path lookup, unless the cache was purged
+ *        since the lookup began (the path may have been created meanwhile);
+ *        a path already cached keeps its entry, updated
+ * @param c the cache
+ * @param generation what dcache_generation() returned before the lookup
+ * @param root the directory the path is relative to
+ * @param path the path
+ * @param inr the inode number, or ERR_INODE_OUTOF_RANGE if the path does not exist
+ */
+void dcache_insert(struct dcache *c, uint64_t generation, uint16_t root, const char *path, int inr);
+
+/**
+ * @brief forget all the negative entries (e.g. after creating a new entry)
+ * @param c the cache
+ */
+void dcache_purge_negative(struct dcache *c);
+
+/**
+ * @brief print the counters of a dentry cache
+ * @param c the cache
+ */
+void dcache_print(const struct dcache *c);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,315 @@
+/**
+ * @file dindex.c
+ * @brief in-memory hash index of directory entries
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "dindex.h"
+#include "error.h"
+
+#define DINDEX_MIN_BUCKETS (16)
+
+/**
+ * @brief allocate a new (empty) directory index
+ * @param size the number of directories it can index at once (>0)
+ * @return a pointer to the new index or NULL on failure
+ */
+struct dindex *dindex_alloc(size_t size)
+{
+    if (size == 0) {
+        return NULL;
+    }
+
+    struct dindex *x = calloc(1, sizeof(struct dindex));
+    if (x == NULL) {
+        return NULL;
+    }
+
+    x->dirs = calloc(size, sizeof(struct dindex_dir));
+    if (x->dirs == NULL || pthread_mutex_init(&x->lock, NULL) != 0) {
+        free(x->dirs);
+        free(x);
+        return NULL;
+    }
+    x->size = size;
+
+    return x;
+}
+
+/**
+ * @brief release the index of a directory built aside and not installed
+ *        (also frees a slot of the index)
+ * @param d the index of the directory
+ */
+void dindex_release(struct dindex_dir *d)
+{
+    if (d != NULL) {
+        free(d->entries);
+        free(d->buckets);
+        memset(d, 0, sizeof(struct dindex_dir));
+    }
+}
+
+/**
+ * @brief release a directory index
+ * @param x the index
+ */
+void dindex_free(struct dindex *x)
+{
+    if (x != NULL) {
+        for (size_t i = 0; i < x->size; ++i) {
+            dindex_release(&x->dirs[i]);
+        }
+        free(x->dirs);
+        pthread_mutex_destroy(&x->lock);
+        free(x);
+    }
+}
+
+/**
+ * @brief FNV-1a hash of a name of at most DIRENT_MAXLEN characters
+ */
+static uint32_t dindex_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < DIRENT_MAXLEN && name[i] != '\0'; ++i) {
+        h ^= (uint8_t) name[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/**
+ * @brief get the index of a directory, if it is indexed
+ * @param x the index
+ * @param inr the inode number of the directory
+ * @return the index of the directory; NULL if not indexed
+ */
+struct dindex_dir *dindex_find(struct dindex *x, uint16_t inr)
+{
+    if (x == NULL || inr == 0) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < x->size; ++i) {
+        if (x->dirs[i].inr == inr) {
+            x->tick += 1;
+            x->hits += 1;
+            x->dirs[i].used = x->tick;
+
+            return &x->dirs[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief add to the index the index of a directory built aside (d->inr set,
+ *        filled with dindex_insert()), recycling the least recently used one
+ * @param x the index
+ * @param d the index of the directory; emptied, what it held belongs to x (IN-OUT)
+ * @return the index of the directory in x; NULL on error
+ */
+struct dindex_dir *dindex_install(struct dindex *x, struct dindex_dir *d)
+{
+    if (x == NULL || d == NULL || d->inr == 0) {
+        return NULL;
+    }
+    const uint16_t inr = d->inr;
+
+    struct dindex_dir *victim = &x->dirs[0];
+    for (size_t i = 0; i < x->size; ++i) {
+        if (x->dirs[i].inr == 0 || x->dirs[i].inr == inr) {
+            victim = &x->dirs[i];
+            break;
+        }
+        if (x->dirs[i].used < victim->used) {
+            victim = &x->dirs[i];
+        }
+    }
+
+    dindex_release(victim);
+    *victim = *d;
+    memset(d, 0, sizeof(struct dindex_dir));
+    x->tick += 1;
+    x->builds += 1;
+    victim->used = x->tick;
+
+    return victim;
+}
+
+/**
+ * @brief forget the index of a directory (e.g. when it cannot be built)
+ * @param x the index
+ * @param inr the inode number of the directory
+ */
+void dindex_drop(struct dindex *x, uint16_t inr)
+{
+    if (x == NULL || inr == 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < x->size; ++i) {
+        if (x->dirs[i].inr == inr) {
+            dindex_release(&x->dirs[i]);
+        }
+    }
+}
+
+/**
+ * @brief the first entry of a directory with the given name
+ * @return its position in d->entries; -1 if there is none
+ */
+static int32_t dindex_probe(const struct dindex_dir *d, const char *name)
+{
+    if (d->nbuckets == 0) {
+        return -1;
+    }
+
+    int32_t i = d->buckets[dindex_hash(name) & (d->nbuckets - 1)];
+    while (i >= 0 && strncmp(d->entries[i].dirent.d_name, name, DIRENT_MAXLEN) != 0) {
+        i = d->entries[i].next;
+    }
+
+    return i;
+}
+
+/**
+ * @brief double the number of buckets (and of entries) of a directory
+ * @return 0 on success; <0 on error
+ */
+static int dindex_grow(struct dindex_dir *d)
+{
+    const size_t capacity = d->capacity > 0 ? 2 * d->capacity : DINDEX_MIN_BUCKETS;
+    if (capacity > INT32_MAX) {
+        return ERR_NOMEM;
+    }
+
+    struct dindex_entry *entries = realloc(d->entries, capacity * sizeof(struct dindex_entry));
+    if (entries == NULL) {
+        return ERR_NOMEM;
+    }
+    d->entries = entries;
+
+    int32_t *buckets = realloc(d->buckets, capacity * sizeof(int32_t));
+    if (buckets == NULL) {
+        return ERR_NOMEM;
+    }
+    d->buckets = buckets;
+    d->capacity = capacity;
+    d->nbuckets = capacity;
+
+    // Rehash, keeping in each bucket the entries in the order of the directory.
+    for (size_t b = 0; b < d->nbuckets; ++b) {
+        d->buckets[b] = -1;
+    }
+    for (size_t i = d->count; i-- > 0;) {
+        const size_t b = dindex_hash(d->entries[i].dirent.d_name) & (d->nbuckets - 1);
+        d->entries[i].next = d->buckets[b];
+        d->buckets[b] = (int32_t) i;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief add an entry to the index of a directory; when a name appears
+ *        twice the first entry wins, as with a linear scan
+ * @param d the index of the directory
+ * @param dirent the entry
+ * @return 0 on success; <0 on error
+ */
+int dindex_insert(struct dindex_dir *d, const struct direntv6 *dirent)
+{
+    M_REQUIRE_NON_NULL(d);
+    M_REQUIRE_NON_NULL(dirent);
+
+    char name[DIRENT_MAXLEN + 1];
+    strncpy(name, dirent->d_name, DIRENT_MAXLEN);
+    name[DIRENT_MAXLEN] = '\0';
+
+    if (dindex_probe(d, name) >= 0) {
+        return 0;
+    }
+
+    if (d->count == d->capacity) {
+        int err = dindex_grow(d);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    // Append at the end of the chain to keep the order of the directory.
+    struct dindex_entry *e = &d->entries[d->count];
+    memset(e, 0, sizeof(struct dindex_entry));
+    e->dirent.d_inumber = dirent->d_inumber;
+    strncpy(e->dirent.d_name, name, DIRENT_MAXLEN);
+    e->next = -1;
+
+    int32_t *p = &d->buckets[dindex_hash(name) & (d->nbuckets - 1)];
+    while (*p >= 0) {
+        p = &d->entries[*p].next;
+    }
+    *p = (int32_t) d->count;
+    d->count += 1;
+
+    return 0;
+}
+
+/**
+ * @brief look up a name in the index of a directory
+ * @param d the index of the directory
+ * @param name the NULL-terminated name
+ * @return the inode number of the entry; ERR_INODE_OUTOF_RANGE if there is none
+ */
+int dindex_lookup(const struct dindex_dir *d, const char *name)
+{
+    M_REQUIRE_NON_NULL(d);
+    M_REQUIRE_NON_NULL(name);
+
+    if (strlen(name) > DIRENT_MAXLEN) {
+        return ERR_INODE_OUTOF_RANGE;
+    }
+
+    int32_t i = dindex_probe(d, name);
+    if (i < 0) {
+        return ERR_INODE_OUTOF_RANGE;
+    }
+
+    return d->entries[i].dirent.d_inumber;
+}
+
+/**
+ * @brief print the counters of a directory index
+ * @param x the index
+ */
+void dindex_print(const struct dindex *x)
+{
+    printf("**********Directory Index START**********\n");
+
+    if (x != NULL) {
+        size_t used = 0;
+        size_t entries = 0;
+        for (size_t i = 0; i < x->size; ++i) {
+            used += x->dirs[i].inr != 0 ? 1 : 0;
+            entries += x->dirs[i].count;
+        }
+
+        printf("%-20s: %zu\n", "size", x->size);
+        printf("%-20s: %zu\n", "used", used);
+        printf("%-20s: %zu\n", "entries", entries);
+        printf("%-20s: %" PRIu64 "\n", "hits", x->hits);
+        printf("%-20s: %" PRIu64 "\n", "builds", x->builds);
+    } else {
+        printf("NULL ptr");
+    }
+
+    printf("**********Directory Index END************\n");
+
+    fflush(stdout);
+}
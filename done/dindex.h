@@ -0,0 +1,113 @@
+#pragma once
+
+/**
+ * @file dindex.h
+ * @brief in-memory hash index of the entries of the most recently looked
+ *        up directories, keyed by d_name; built by the directory layer.
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <pthread.h>
+#include "unixv6fs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DINDEX_DEFAULT_NDIRS (32)   // directories indexed at once per mount
+
+struct dindex_entry {
+    struct direntv6 dirent;           // copy of the entry on disk
+    int32_t next;                     // next entry in the same bucket; -1 at the end
+};
+
+struct dindex_dir {
+    uint16_t inr;                     // the directory; 0 if the slot is free
+    uint64_t used;                    // tick of the last use, for LRU replacement
+    size_t count;                     // number of entries
+    size_t capacity;                  // size of entries
+    size_t nbuckets;                  // size of buckets (a power of 2)
+    struct dindex_entry *entries;
+    int32_t *buckets;                 // first entry of each bucket; -1 if empty
+};
+
+struct dindex {
+    pthread_mutex_t lock;             // taken by the directory layer around each use
+    size_t size;
+    uint64_t tick;
+    struct dindex_dir *dirs;          // the size indexed directories
+    uint64_t hits;                    // lookups in an indexed directory
+    uint64_t builds;                  // directories (re)indexed
+    uint64_t generation;              // bumped (locked) each time an entry is added to a directory on disk
+};
+
+/**
+ * @brief allocate a new (empty) directory index
+ * @param size the number of directories it can index at once (>0)
+ * @return a pointer to the new index or NULL on failure
+ */
+struct dindex *dindex_alloc(size_t size);
+
+/**
+ * @brief release a directory index
+ * @param x the index
+ */
+void dindex_free(struct dindex *x);
+
+/**
+ * @brief get the index of a directory, if it is indexed
+ * @param x the index
+ * @param inr the inode number of the directory
+ * @return the index of the directory; NULL if not indexed
+ */
+struct dindex_dir *dindex_find(struct dindex *x, uint16_t inr);
+
+/**
+ * @brief add to the index the index of a directory built aside (d->inr set,
+ *        filled with dindex_insert()), recycling the least recently used one
+ * @param x the index
+ * @param d the index of the directory; emptied, what it held belongs to x (IN-OUT)
+ * @return the index of the directory in x; NULL on error
+ */
+struct dindex_dir *dindex_install(struct dindex *x, struct dindex_dir *d);
+
+/**
+ * @brief release the index of a directory built aside and not installed
+ * @param d the index of the directory
+ */
+void dindex_release(struct dindex_dir *d);
+
+/**
+ * @brief forget the index of a directory (e.g. when it cannot be built)
+ * @param x the index
+ * @param inr the inode number of the directory
+ */
+void dindex_drop(struct dindex *x, uint16_t inr);
+
+/**
+ * @brief add an entry to the index of a directory; when a name appears
+ *        twice the first entry wins, as with a linear scan
+ * @param d the index of the directory
+ * @param dirent the entry
+ * @return 0 on success; <0 on error
+ */
+int dindex_insert(struct dindex_dir *d, const struct direntv6 *dirent);
+
+/**
+ * @brief look up a name in the index of a directory
+ * @param d the index of the directory
+ * @param name the NULL-terminated name
+ * @return the inode number of the entry; ERR_INODE_OUTOF_RANGE if there is none
+ */
+int dindex_lookup(const struct dindex_dir *d, const char *name);
+
+/**
+ * @brief print the counters of a directory index
+ * @param x the index
+ */
+void dindex_print(const struct dindex *x);
+
+#ifdef __cplusplus
+}
+#endif
@@ -14,6 +14,8 @@
 #include "bmblock.h"
 #include "inode.h"
 #include "filev6.h"
+#include "dindex.h"
+#include "dcache.h"
 
 #define PATH_TOKEN_STRING "/"
 
@@ -28,7 +30,7 @@ int direntv6_opendir(const struct unix_filesystem *u, uint16_t inr, struct direc
 {
     M_REQUIRE_NON_NULL(u);
     M_REQUIRE_NON_NULL(d);
-    M_REQUIRE_NON_NULL(u->f);
+    M_REQUIRE_NON_NULL(u->dev);
 
     if (inr < 1) {
         return ERR_BAD_PARAMETER;
@@ -99,7 +101,7 @@ int direntv6_readdir(struct directory_reader *d, char *name, uint16_t *child_inr
 int direntv6_print_tree(const struct unix_filesystem *u, uint16_t inr, const char *prefix)
 {
     M_REQUIRE_NON_NULL(u);
-    M_REQUIRE_NON_NULL(u->f);
+    M_REQUIRE_NON_NULL(u->dev);
     M_REQUIRE_NON_NULL(prefix);
 
     struct directory_reader d;
@@ -165,6 +167,132 @@ int direntv6_print_tree(const struct unix_filesystem *u, uint16_t inr, const cha
     return 0;
 }
 
+/**
+ * @brief index the entries of a directory, read from disk (u->dindex unlocked)
+ * @param u a mounted filesystem
+ * @param inr the directory
+ * @param index the index of the directory, to be installed (OUT)
+ * @return 0 on success; <0 on error (nothing to release)
+ */
+static int direntv6_build_index(const struct unix_filesystem *u, uint16_t inr, struct dindex_dir *index)
+{
+    memset(index, 0, sizeof(struct dindex_dir));
+
+    struct directory_reader d;
+    memset(&d, 0, sizeof(struct directory_reader));
+
+    int err = direntv6_opendir(u, inr, &d);
+    if (err != 0) {
+        return err;
+    }
+    index->inr = inr;
+
+    struct direntv6 dirent;
+    memset(&dirent, 0, sizeof(struct direntv6));
+    char name[DIRENT_MAXLEN + 1];
+
+    while ((err = direntv6_readdir(&d, name, &dirent.d_inumber)) > 0) {
+        strncpy(dirent.d_name, name, DIRENT_MAXLEN);
+        err = dindex_insert(index, &dirent);
+        if (err < 0) {
+            break;
+        }
+    }
+    if (err < 0) {
+        dindex_release(index);
+
+        return err;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief the index of the entries of a directory, built on first use
+ * @param u a mounted filesystem, with u->dindex non NULL and locked; it is
+ *        unlocked while the directory is read
+ * @param inr the directory
+ * @param index the index of the directory (OUT)
+ * @return 0 on success; <0 on error
+ */
+static int direntv6_index(const struct unix_filesystem *u, uint16_t inr, struct dindex_dir **index)
+{
+    *index = dindex_find(u->dindex, inr);
+
+    while (*index == NULL) {
+        const uint64_t generation = u->dindex->generation;
+        pthread_mutex_unlock(&u->dindex->lock);
+
+        struct dindex_dir built;
+        int err = direntv6_build_index(u, inr, &built);
+
+        pthread_mutex_lock(&u->dindex->lock);
+        if (err < 0) {
+            return err;
+        }
+
+        // Another thread may have indexed it meanwhile; an entry added while
+        // we were reading may be missing from ours: read it again then.
+        *index = dindex_find(u->dindex, inr);
+        if (*index == NULL && u->dindex->generation == generation) {
+            *index = dindex_install(u->dindex, &built);
+            if (*index == NULL) {
+                dindex_release(&built);
+                return ERR_NOMEM;
+            }
+        } else {
+            dindex_release(&built);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief get the inode number of one entry of a directory
+ * @param u a mounted filesystem
+ * @param inr the directory
+ * @param name the name of the entry (a single path component)
+ * @return inr on success; <0 on error
+ */
+static int direntv6_lookup_name(const struct unix_filesystem *u, uint16_t inr, const char *name)
+{
+    if (u->dindex != NULL) {
+        pthread_mutex_lock(&u->dindex->lock);
+        struct dindex_dir *index = NULL;
+        int found = direntv6_index(u, inr, &index);
+        if (found == 0) {
+            found = dindex_lookup(index, name);
+        }
+        pthread_mutex_unlock(&u->dindex->lock);
+
+        return found;
+    }
+
+    // No index on this filesystem: linear scan.
+    struct directory_reader d;
+    memset(&d, 0, sizeof(struct directory_reader));
+
+    int err = direntv6_opendir(u, inr, &d);
+    if (err != 0) {
+        return err;
+    }
+
+    char childName[DIRENT_MAXLEN + 1];
+    uint16_t child_inr = 0;
+
+    while ((err = direntv6_readdir(&d, childName, &child_inr)) > 0) {
+        if (strcmp(childName, name) == 0) {
+            return child_inr;
+        }
+    }
+    if (err < 0) {
+        return err;
+    }
+
+    return ERR_INODE_OUTOF_RANGE;
+}
+
 /**
 * @brief get the inode number for the given path
 * @param u a mounted filesystem
@@ -180,62 +308,30 @@ int direntv6_dirlookup_core(const struct unix_filesystem *u, uint16_t inr, const
 
     if (size <= 0) {
         return ERR_INODE_OUTOF_RANGE;
-    } else {
-
-        char entryTempCpy[MAXPATHLEN_UV6 + 1];
-        memset(entryTempCpy, 0, MAXPATHLEN_UV6 + 1);
-        strncpy(entryTempCpy, entry, strlen(entry) + 1);
-        entryTempCpy[MAXPATHLEN_UV6] = '\0';
-
-        char* tmp = trim_slash(entryTempCpy);
-        char entry_cpy[MAXPATHLEN_UV6 + 1];
-        memset(entry_cpy, 0, MAXPATHLEN_UV6 + 1);
-        strncpy(entry_cpy, tmp, strlen(tmp) + 1);
-        entry_cpy[MAXPATHLEN_UV6] = '\0';
-
-        char* p = strchr(entry_cpy, PATH_TOKEN);
-
-        struct directory_reader d;
-        char name[DIRENT_MAXLEN + 1];
-        uint16_t child_inr = 0;
-
-        direntv6_opendir(u, inr, &d);
-        name[DIRENT_MAXLEN] = '\0';
-
-        int err = 0;
-        if (p == NULL) { // At the end of the iteration.
-            while ((err = direntv6_readdir(&d, name, &child_inr)) > 0) {
-                if (strcmp(name, entry_cpy) == 0) {
-                    return child_inr;
-                }
+    }
 
-                memset(name, 0, DIRENT_MAXLEN);
-                child_inr = 0;
-            }
+    char entryTempCpy[MAXPATHLEN_UV6 + 1];
+    memset(entryTempCpy, 0, MAXPATHLEN_UV6 + 1);
+    strncpy(entryTempCpy, entry, MAXPATHLEN_UV6);
 
-            return ERR_INODE_OUTOF_RANGE;
-        } else { // We need to find the right directory to explore.
+    char* entry_cpy = trim_slash(entryTempCpy);
+    char* p = strchr(entry_cpy, PATH_TOKEN);
 
-            *p++ = '\0';
+    if (p == NULL) { // At the end of the iteration.
+        return direntv6_lookup_name(u, inr, entry_cpy);
+    }
 
-            while ((err = direntv6_readdir(&d, name, &child_inr)) > 0) {
-                if (strcmp(name, entry_cpy) == 0) {
-                    char p_cpy[strlen(p) + 1];
-                    memcpy(p_cpy, p, strlen(p));
-                    p_cpy[strlen(p)] = '\0';
+    // We need to find the right directory to explore.
+    *p++ = '\0';
 
-                    return direntv6_dirlookup_core(u, child_inr, p_cpy, strlen(p_cpy));
-                }
-                memset(name, 0, DIRENT_MAXLEN);
-            }
-            if (err < 0) {
-                return err;
-            }
-        }
+    int child_inr = direntv6_lookup_name(u, inr, entry_cpy);
+    if (child_inr < 0) {
+        return child_inr;
     }
 
-    return ERR_INODE_OUTOF_RANGE;
+    return direntv6_dirlookup_core(u, (uint16_t) child_inr, p, strlen(p));
 }
+
 /**
  * @brief get the inode number for the given path
  * @param u a mounted filesystem
@@ -246,7 +342,7 @@ int direntv6_dirlookup_core(const struct unix_filesystem *u, uint16_t inr, const
 int direntv6_dirlookup(const struct unix_filesystem *u, uint16_t inr, const char *entry)
 {
     M_REQUIRE_NON_NULL(u);
-    M_REQUIRE_NON_NULL(u->f);
+    M_REQUIRE_NON_NULL(u->dev);
     M_REQUIRE_NON_NULL(entry);
 
     if (strcmp(entry, PATH_TOKEN_STRING) == 0) {
@@ -258,7 +354,22 @@ int direntv6_dirlookup(const struct unix_filesystem *u, uint16_t inr, const char
         }
     }
 
-    return direntv6_dirlookup_core(u, inr, entry, strlen(entry));
+    // Taken first: an entry created during the lookup purges the cache, and
+    // a "does not exist" found before it is then not inserted.
+    const uint64_t generation = dcache_generation(u->dcache);
+    int cached = 0;
+    if (dcache_lookup(u->dcache, inr, entry, &cached)) {
+        return cached;
+    }
+
+    int found = direntv6_dirlookup_core(u, inr, entry, strlen(entry));
+
+    // Only "does not exist" is remembered among the errors (negative entries).
+    if (found >= 0 || found == ERR_INODE_OUTOF_RANGE) {
+        dcache_insert(u->dcache, generation, inr, entry, found);
+    }
+
+    return found;
 }
 
 /**
@@ -348,12 +459,29 @@ int direntv6_create(struct unix_filesystem *u, const char *entry, uint16_t mode)
         return feedback;
     }
 
-    // We write the content to the disk.
+    // We write the content to the disk (at once: lookups read it from there).
     feedback = filev6_writebytes(u, &parentFv6, &childDirentv6, sizeof(struct direntv6));
+    int closed = filev6_close(u, &parentFv6);
+    if (feedback == 0) {
+        feedback = closed;
+    }
     if (feedback != 0) {
         return feedback;
     }
 
+    // Keep the index of the parent (if any) in sync with the disk; the new
+    // path, and any path below it, may have been cached as nonexistent.
+    if (u->dindex != NULL) {
+        pthread_mutex_lock(&u->dindex->lock);
+        struct dindex_dir *index = dindex_find(u->dindex, (uint16_t) parentInodeNumber);
+        if (index != NULL && dindex_insert(index, &childDirentv6) != 0) {
+            dindex_drop(u->dindex, (uint16_t) parentInodeNumber);
+        }
+        u->dindex->generation += 1;
+        pthread_mutex_unlock(&u->dindex->lock);
+    }
+    dcache_purge_negative(u->dcache);
+
     // Write the inode
     struct inode tempInode;
     memset(&tempInode, 0, sizeof(struct inode));
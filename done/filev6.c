@@ -6,8 +6,27 @@
 #include "sector.h"
 #include "filev6.h"
 
+/**
+ * @brief forget where the reader, the readahead and the writer of a file were
+ *        (the write buffer itself is left to the caller)
+ */
+static void filev6_reset(struct filev6 *fv6)
+{
+    fv6->offset = 0;
+    fv6->map_valid = 0;
+    memset(&fv6->cur, 0, sizeof(struct filev6_cursor));
+    memset(&fv6->ra_cur, 0, sizeof(struct filev6_cursor));
+    fv6->cur.dmap_slot = -1;
+    fv6->ra_cur.dmap_slot = -1;
+    fv6->ra_next = 0;
+    fv6->ra_window = 0;
+    fv6->ra_end = 0;
+    fv6->wlen = 0;
+}
+
 /**
  * @brief open the file corresponding to a given inode; set offset to zero
+ *        (the file is closed with filev6_close() if it is written to)
  * @param u the filesystem (IN)
  * @param inr the inode number (IN)
  * @param fv6 the complete filve6 data structure (OUT)
@@ -16,16 +35,214 @@
 int filev6_open(const struct unix_filesystem *u, uint16_t inr, struct filev6 *fv6)
 {
     M_REQUIRE_NON_NULL(u);
-    M_REQUIRE_NON_NULL(u->f);
+    M_REQUIRE_NON_NULL(u->dev);
     M_REQUIRE_NON_NULL(fv6);
 
     fv6->u = u;
     fv6->i_number = inr;
-    fv6->offset = 0;
+    filev6_reset(fv6);
+    fv6->wbuf = NULL;
+    fv6->wsize = 0;
 
     return inode_read(fv6->u, fv6->i_number, &fv6->i_node);
 }
 
+/**
+ * @brief filev6_buildmap() for an IEXTENT file: its extents are copied
+ *        instead (one read if they overflow i_addr)
+ */
+static int filev6_buildextents(struct filev6 *fv6)
+{
+    const int32_t count = fv6->i_node.i_addr[ADDR_EXTENT_COUNT];
+    if (count > EXTENTS_MAX) {
+        return ERR_FILE_TOO_LARGE;
+    }
+
+    const int32_t inInode = count < EXTENTS_IN_INODE ? count : EXTENTS_IN_INODE;
+    memcpy(fv6->ext, fv6->i_node.i_addr, (size_t) (2 * inInode) * sizeof(uint16_t));
+
+    if (count > EXTENTS_IN_INODE) {
+        uint16_t overflow[ADDRESSES_PER_SECTOR];
+        int err = sector_read(fv6->u, fv6->i_node.i_addr[ADDR_EXTENT_BLOCK], overflow);
+        if (err != 0) {
+            return err;
+        }
+        memcpy(&fv6->ext[2 * EXTENTS_IN_INODE], overflow, (size_t) (2 * (count - EXTENTS_IN_INODE)) * sizeof(uint16_t));
+    }
+
+    fv6->ext_count = count;
+    memset(&fv6->cur, 0, sizeof(struct filev6_cursor));
+    memset(&fv6->ra_cur, 0, sizeof(struct filev6_cursor));
+    fv6->map_valid = 1;
+
+    return 0;
+}
+
+/**
+ * @brief resolve once the data sector of every sector of the file up to
+ *        SECT_UP_LIM (one read per indirect sector, straight into fv6->map);
+ *        past it, only the double indirect sector is read (into fv6->dind)
+ * @param fv6 the filev6 (IN-OUT; map will be built)
+ * @return 0 on success; <0 on error
+ */
+static int filev6_buildmap(struct filev6 *fv6)
+{
+    const int32_t size = inode_getsize(&fv6->i_node);
+    if (size > SECT_HUGE_LIM) {
+        return ERR_FILE_TOO_LARGE;
+    }
+
+    if (inode_has_extents(fv6->u, &fv6->i_node)) {
+        return filev6_buildextents(fv6);
+    }
+
+    int32_t nbSectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (nbSectors > FILEV6_MAP_LENGTH) {
+        nbSectors = FILEV6_MAP_LENGTH;
+    }
+
+    if (size <= SECT_DOWN_LIM) {
+        memcpy(fv6->map, fv6->i_node.i_addr, (size_t) nbSectors * sizeof(uint16_t));
+    } else {
+        for (int32_t i = 0; i * ADDRESSES_PER_SECTOR < nbSectors; ++i) {
+            int err = sector_read(fv6->u, fv6->i_node.i_addr[i], &fv6->map[i * ADDRESSES_PER_SECTOR]);
+            if (err != 0) {
+                return err;
+            }
+        }
+    }
+
+    if (size > SECT_UP_LIM) {
+        int err = sector_read(fv6->u, fv6->i_node.i_addr[ADDR_DOUBLE], fv6->dind);
+        if (err != 0) {
+            return err;
+        }
+    }
+    fv6->cur.dmap_slot = -1;
+    fv6->ra_cur.dmap_slot = -1;
+
+    fv6->map_valid = 1;
+
+    return 0;
+}
+
+/**
+ * @brief identify the data sector of a given sector of the file, as
+ *        inode_findsector() does, but from the map of the file
+ * @param fv6 the filev6 (IN-OUT; map is built on first use)
+ * @param cur where the search resumes (IN-OUT)
+ * @param file_sec_off the offset within the file (in sector-size units)
+ * @return >0: the sector on disk;  <0 error
+ */
+static int filev6_findsector(struct filev6 *fv6, struct filev6_cursor *cur, int32_t file_sec_off)
+{
+    if (!fv6->map_valid) {
+        int err = filev6_buildmap(fv6);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    if (file_sec_off < 0 || file_sec_off * SECTOR_SIZE >= inode_getsize(&fv6->i_node)) {
+        return ERR_OFFSET_OUT_OF_RANGE;
+    }
+
+    if (inode_has_extents(fv6->u, &fv6->i_node)) {
+        // From the extent last found by this cursor: a sequential reader
+        // (or the readahead) never searches.
+        if (file_sec_off < cur->ext_off) {
+            cur->ext = 0;
+            cur->ext_off = 0;
+        }
+        while (cur->ext < fv6->ext_count) {
+            const uint16_t *extent = &fv6->ext[2 * cur->ext];
+            if (file_sec_off < cur->ext_off + extent[1]) {
+                return extent[0] + (file_sec_off - cur->ext_off);
+            }
+            cur->ext_off += extent[1];
+            cur->ext += 1;
+        }
+
+        return ERR_OFFSET_OUT_OF_RANGE;
+    }
+
+    if (file_sec_off < FILEV6_MAP_LENGTH) {
+        return fv6->map[file_sec_off];
+    }
+
+    // Past the map: the indirect sector covering it is read once, then kept
+    // until this cursor moves on to the next one.
+    const int32_t slot = (file_sec_off - FILEV6_MAP_LENGTH) / ADDRESSES_PER_SECTOR;
+    if (slot != cur->dmap_slot) {
+        cur->dmap_slot = -1;
+        int err = sector_read(fv6->u, fv6->dind[slot], cur->dmap);
+        if (err != 0) {
+            return err;
+        }
+        cur->dmap_slot = slot;
+    }
+
+    return cur->dmap[(file_sec_off - FILEV6_MAP_LENGTH) % ADDRESSES_PER_SECTOR];
+}
+
+/**
+ * @brief adaptive readahead, before reading count sectors of the file from
+ *        first: while the file is read sequentially the window doubles (up to
+ *        FILEV6_RA_MAX) and the sectors just past the reader are prefetched
+ *        into the buffer cache; a random access collapses the window
+ * @param fv6 the filev6, its map built (IN-OUT; readahead state updated)
+ * @param first the first sector of the file about to be read
+ * @param count the number of sectors about to be read
+ */
+static void filev6_readahead(struct filev6 *fv6, int32_t first, int32_t count)
+{
+    // Small unaligned reads come back to the last sector read: still sequential.
+    const int sequential = first == fv6->ra_next || first + 1 == fv6->ra_next;
+    if (first + count > fv6->ra_next || !sequential) {
+        fv6->ra_next = first + count;
+    }
+
+    if (!sequential) {
+        fv6->ra_window = 0;
+        fv6->ra_end = fv6->ra_next;
+        return;
+    }
+
+    // Read ahead again only once the reader is in the second half of the window.
+    if (fv6->ra_end - fv6->ra_next > fv6->ra_window / 2) {
+        return;
+    }
+
+    fv6->ra_window = fv6->ra_window == 0 ? FILEV6_RA_MIN : 2 * fv6->ra_window;
+    if (fv6->ra_window > FILEV6_RA_MAX) {
+        fv6->ra_window = FILEV6_RA_MAX;
+    }
+
+    const int32_t nbSectors = (inode_getsize(&fv6->i_node) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    int32_t from = fv6->ra_end > fv6->ra_next ? fv6->ra_end : fv6->ra_next;
+    int32_t to = fv6->ra_next + fv6->ra_window < nbSectors ? fv6->ra_next + fv6->ra_window : nbSectors;
+
+    // One request per physically contiguous run; it is only a hint: errors are
+    // left to the reads themselves.
+    while (from < to) {
+        const int sect = filev6_findsector(fv6, &fv6->ra_cur, from);
+        if (sect < 0) {
+            break;
+        }
+
+        int32_t run = 1;
+        while (from + run < to && filev6_findsector(fv6, &fv6->ra_cur, from + run) == sect + run) {
+            run += 1;
+        }
+        if (sector_prefetch(fv6->u, (uint32_t) sect, (uint32_t) run) != 0) {
+            break;
+        }
+        from += run;
+    }
+
+    fv6->ra_end = from;
+}
+
 /**
  * @brief change the current offset of the given file to the one specified
  * @param fv6 the filev6 (IN-OUT; offset will be changed)
@@ -45,6 +262,36 @@ int filev6_lseek(struct filev6 *fv6, int32_t offset)
     return ERR_OFFSET_OUT_OF_RANGE;
 }
 
+/**
+ * @brief filev6_readblock(), the lock of the inode being held by the caller
+ */
+static int filev6_readsector(struct filev6 *fv6, void *buf)
+{
+    int inodeSize = inode_getsize(&fv6->i_node);
+    if (inodeSize <= fv6->offset) {
+
+        return 0;
+    } else {
+        int sect = filev6_findsector(fv6, &fv6->cur, fv6->offset / SECTOR_SIZE);
+
+        if (sect < 0) {
+            return sect;
+        } else {
+            filev6_readahead(fv6, fv6->offset / SECTOR_SIZE, 1);
+
+            int read = sector_read(fv6->u, (uint32_t) sect, buf);
+            if (read < 0) {
+                return read;
+            }
+
+            int readBytes = (inodeSize - fv6->offset >= SECTOR_SIZE) ? SECTOR_SIZE : inodeSize - fv6->offset;
+            fv6->offset += readBytes;
+
+            return readBytes;
+        }
+    }
+}
+
 /**
  * @brief read at most SECTOR_SIZE from the file at the current cursor
  * @param fv6 the filev6 (IN-OUT; offset will be changed)
@@ -56,35 +303,121 @@ int filev6_readblock(struct filev6 *fv6, void *buf)
 {
     M_REQUIRE_NON_NULL(fv6);
     M_REQUIRE_NON_NULL(fv6->u);
-    M_REQUIRE_NON_NULL(fv6->u->f);
+    M_REQUIRE_NON_NULL(fv6->u->dev);
     M_REQUIRE_NON_NULL(buf);
 
-    int inodeSize = inode_getsize(&fv6->i_node);
-    if (inodeSize <= fv6->offset) {
+    struct itable_entry *e = NULL;
+    int err = itable_lock(fv6->u, fv6->i_number, 0, &e);
+    if (err != 0) {
+        return err;
+    }
+
+    int read = filev6_readsector(fv6, buf);
+    itable_unlock(fv6->u, e);
+
+    return read;
+}
 
+/**
+ * @brief filev6_read(), the lock of the inode being held by the caller
+ */
+static int filev6_readrun(struct filev6 *fv6, void *buf, int len)
+{
+    const int32_t inodeSize = inode_getsize(&fv6->i_node);
+    if (inodeSize <= fv6->offset) {
         return 0;
-    } else {
-        int sect = inode_findsector(fv6->u, &(fv6->i_node), fv6->offset / SECTOR_SIZE);
+    }
+    if (len > inodeSize - fv6->offset) {
+        len = inodeSize - fv6->offset;
+    }
+
+    const int32_t first = fv6->offset / SECTOR_SIZE;
+    int firstSect = filev6_findsector(fv6, &fv6->cur, first);
+    if (firstSect < 0) {
+        return firstSect;
+    }
+    filev6_readahead(fv6, first, (fv6->offset + len - 1) / SECTOR_SIZE - first + 1);
 
+    uint8_t *out = buf;
+    int done = 0;
+    while (done < len) {
+        const int32_t fileSector = fv6->offset / SECTOR_SIZE;
+        const int inSector = fv6->offset % SECTOR_SIZE;
+        const int left = len - done;
+
+        int sect = filev6_findsector(fv6, &fv6->cur, fileSector);
         if (sect < 0) {
             return sect;
-        } else {
+        }
 
-            int read = sector_read(fv6->u->f, (uint32_t) sect, buf);
-            if (read < 0) {
-                return read;
+        if (inSector != 0 || left < SECTOR_SIZE) {
+            // Unaligned head or tail: through a sector buffer.
+            uint8_t sectorBuf[SECTOR_SIZE];
+            int err = sector_read(fv6->u, (uint32_t) sect, sectorBuf);
+            if (err != 0) {
+                return err;
             }
 
-            int readBytes = (inodeSize - fv6->offset >= SECTOR_SIZE) ? SECTOR_SIZE : inodeSize - fv6->offset;
-            fv6->offset += readBytes;
+            int toCopy = SECTOR_SIZE - inSector < left ? SECTOR_SIZE - inSector : left;
+            memcpy(out + done, sectorBuf + inSector, (size_t) toCopy);
+            done += toCopy;
+            fv6->offset += toCopy;
+        } else {
+            // Whole sectors: as many as are physically contiguous at once.
+            int32_t count = 1;
+            while (count < left / SECTOR_SIZE
+                   && filev6_findsector(fv6, &fv6->cur, fileSector + count) == sect + count) {
+                count += 1;
+            }
 
-            return readBytes;
+            int err = sector_read_run(fv6->u, (uint32_t) sect, (uint32_t) count, out + done);
+            if (err != 0) {
+                return err;
+            }
+
+            done += count * SECTOR_SIZE;
+            fv6->offset += count * SECTOR_SIZE;
         }
     }
+
+    return done;
 }
 
 /**
- * @brief create a new filev6
+ * @brief read at most len bytes from the file at the current cursor, straight
+ *        into buf; physically contiguous sectors are read in one request
+ * @param fv6 the filev6 (IN-OUT; offset will be changed)
+ * @param buf points to len bytes of available memory (OUT)
+ * @param len the number of bytes wanted
+ * @return >0: the number of bytes of the file read; 0: end of file;
+ *             the appropriate error code (<0) on error
+ */
+int filev6_read(struct filev6 *fv6, void *buf, int len)
+{
+    M_REQUIRE_NON_NULL(fv6);
+    M_REQUIRE_NON_NULL(fv6->u);
+    M_REQUIRE_NON_NULL(buf);
+
+    if (len < 0) {
+        return ERR_BAD_PARAMETER;
+    }
+
+    // Shared: readers of one file proceed together, a writer waits for them.
+    struct itable_entry *e = NULL;
+    int err = itable_lock(fv6->u, fv6->i_number, 0, &e);
+    if (err != 0) {
+        return err;
+    }
+
+    int read = filev6_readrun(fv6, buf, len);
+    itable_unlock(fv6->u, e);
+
+    return read;
+}
+
+/**
+ * @brief create a new filev6; what was not written yet of the file it held
+ *        (see filev6_close()) is discarded
  * @param u the filesystem (IN)
  * @param mode the mode of the file
  * @param fv6 the filev6 (IN-OUT; offset will be changed)
@@ -102,7 +435,11 @@ int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6)
     int err = inode_write(u, fv6->i_number, &tempInode);
     if (!err) {
         memcpy(&fv6->i_node, &tempInode, sizeof(struct inode));
-        fv6->offset = 0;
+        fv6->u = u;
+        filev6_reset(fv6);
+        free(fv6->wbuf);
+        fv6->wbuf = NULL;
+        fv6->wsize = 0;
         return 0;
     }
     return err;
@@ -122,7 +459,10 @@ int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, const void
     M_REQUIRE_NON_NULL(fv6);
     M_REQUIRE_NON_NULL(buf);
 
-    int feedback = sector_write(u->f, sector, buf);
+    int feedback = mountv6_bitmaps(u);
+    if (feedback == 0) {
+        feedback = sector_write(u, sector, buf);
+    }
     if (feedback == 0) {
         bm_set(u->fbm, sector);
     }
@@ -131,34 +471,359 @@ int filev6_writesector(struct unix_filesystem *u, struct filev6 *fv6, const void
 }
 
 /**
- * @brief write the len bytes of the given buffer on disk to the given filev6
+ * @brief the sectors an append took from the bitmap, given back if it fails
+ */
+struct filev6_taken {
+    uint64_t (*runs)[2];                   // the [first, end) of each run taken
+    size_t count;                          // number of runs in runs
+    size_t size;                           // number of runs allocated
+};
+
+/**
+ * @brief remember a run of sectors taken by an append
+ * @param taken the sectors taken so far (IN-OUT)
+ * @param first the first sector of the run
+ * @param end the sector after the run
+ * @return 0 on success; <0 on error (the run is not remembered)
+ */
+static int filev6_taken_add(struct filev6_taken *taken, uint64_t first, uint64_t end)
+{
+    if (taken->count == taken->size) {
+        const size_t size = taken->size > 0 ? 2 * taken->size : 8;
+        uint64_t (*runs)[2] = realloc(taken->runs, size * sizeof(*runs));
+        if (runs == NULL) {
+            return ERR_NOMEM;
+        }
+        taken->runs = runs;
+        taken->size = size;
+    }
+
+    taken->runs[taken->count][0] = first;
+    taken->runs[taken->count][1] = end;
+    taken->count += 1;
+
+    return 0;
+}
+
+/**
+ * @brief give back to the bitmap every sector an append took (on error), or
+ *        only forget them (on success)
  * @param u the filesystem (IN)
- * @param fv6 the filev6 (IN)
- * @param buf the data we want to write (IN)
- * @param len the length of the bytes we want to write
+ * @param taken the sectors taken (IN-OUT; emptied)
+ * @param give_back 1 to clear them in u->fbm
+ */
+static void filev6_taken_release(struct unix_filesystem *u, struct filev6_taken *taken, int give_back)
+{
+    for (size_t i = 0; give_back && i < taken->count; ++i) {
+        bm_clear_range(u->fbm, taken->runs[i][0], taken->runs[i][1] - taken->runs[i][0]);
+    }
+
+    free(taken->runs);
+    taken->runs = NULL;
+    taken->count = 0;
+    taken->size = 0;
+}
+
+/**
+ * @brief bm_take_next_from() a sector for the metadata of a file (indirect,
+ *        double indirect or extent overflow sector), remembered in taken
+ * @param u the filesystem (IN)
+ * @param taken the sectors taken so far (IN-OUT)
+ * @param hint the sector we would like
+ * @return the sector now used; <0 on error
+ */
+static int filev6_take(struct unix_filesystem *u, struct filev6_taken *taken, uint64_t hint)
+{
+    int sector = bm_take_next_from(u->fbm, hint);
+    if (sector < 0) {
+        return sector;
+    }
+
+    int err = filev6_taken_add(taken, (uint64_t) sector, (uint64_t) sector + 1);
+    if (err != 0) {
+        bm_clear(u->fbm, (uint64_t) sector);
+        return err;
+    }
+
+    return sector;
+}
+
+/**
+ * @brief reserve a run of free sectors for the data of a file: count sectors
+ *        if there is such a run (after hint if possible), else the longest of
+ *        count / 2, count / 4, ... sectors
+ * @param u the filesystem (IN)
+ * @param taken the sectors taken so far; the run is added to them (IN-OUT)
+ * @param count the number of sectors wanted (>0)
+ * @param hint the sector we would like first (e.g. after the last one of the file)
+ * @param first the first sector of the run, now used in u->fbm (OUT)
+ * @param end the sector after the run (OUT)
  * @return 0 on success; <0 on error
  */
-int filev6_writebytes(struct unix_filesystem *u, struct filev6 *fv6, const void *buf, int len)
+static int filev6_reserve(struct unix_filesystem *u, struct filev6_taken *taken, uint32_t count,
+                          uint64_t hint, uint64_t *first, uint64_t *end)
 {
-    M_REQUIRE_NON_NULL(u);
-    M_REQUIRE_NON_NULL(u->f);
-    M_REQUIRE_NON_NULL(fv6);
-    M_REQUIRE_NON_NULL(buf);
+    int sector = ERR_BITMAP_FULL;
+    while (count > 0 && (sector = bm_take_run(u->fbm, count, hint)) == ERR_BITMAP_FULL) {
+        count /= 2;
+    }
+    if (sector < 0) {
+        return sector;
+    }
 
-    if (len < 0) {
-        return ERR_BAD_PARAMETER;
+    int err = filev6_taken_add(taken, (uint64_t) sector, (uint64_t) sector + count);
+    if (err != 0) {
+        bm_clear_range(u->fbm, (uint64_t) sector, count);
+        return err;
+    }
+
+    *first = (uint64_t) sector;
+    *end = (uint64_t) sector + count;
+
+    return 0;
+}
+
+/**
+ * @brief write the data of a run of sectors just reserved, in one request but
+ *        for its last sector if the data ends within it
+ * @param u the filesystem (IN)
+ * @param data the data (IN)
+ * @param bytes the number of bytes of data left (the run may hold less)
+ * @param first the first sector of the run
+ * @param count the number of sectors of the run
+ * @return 0 on success; <0 on error
+ */
+static int filev6_write_run(struct unix_filesystem *u, const char *data, uint32_t bytes,
+                            uint32_t first, uint32_t count)
+{
+    const uint32_t whole = bytes / SECTOR_SIZE < count ? bytes / SECTOR_SIZE : count;
+
+    int err = sector_write_run(u, first, whole, data);
+    if (err == 0 && whole < count) { // The end of the data: the rest of the sector is zeros.
+        char sect_buf[SECTOR_SIZE];
+        memset(sect_buf, 0, SECTOR_SIZE);
+        memcpy(sect_buf, data + (size_t) whole * SECTOR_SIZE, bytes - whole * SECTOR_SIZE);
+        err = sector_write(u, first + whole, sect_buf);
+    }
+
+    return err;
+}
+
+/**
+ * @brief an indirect sector an append is filling, kept in memory until the
+ *        append moves to the next one (or ends)
+ */
+struct filev6_indirect {
+    int32_t slot;                          // its index in i_addr (from ADDR_DOUBLE on: in the double indirect sector); -1 if none
+    uint16_t sector;                       // where it is on disk
+    int dirty;                             // addr is newer than the disk
+    uint16_t addr[ADDRESSES_PER_SECTOR];
+};
+
+/**
+ * @brief write an indirect sector kept in memory, if it changed
+ * @param u the filesystem (IN)
+ * @param ind the indirect sector (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+static int filev6_indirect_flush(struct unix_filesystem *u, struct filev6_indirect *ind)
+{
+    if (ind->slot < 0 || !ind->dirty) {
+        return 0;
+    }
+
+    int err = sector_write(u, ind->sector, ind->addr);
+    if (err == 0) {
+        ind->dirty = 0;
+    }
+
+    return err;
+}
+
+/**
+ * @brief record the data sector of a sector of a large file; its indirect
+ *        sector replaces the one in memory (read, or allocated if new) when
+ *        it is another one. Past the 7 first indirect sectors, the others
+ *        are listed in the double indirect sector i_addr[ADDR_DOUBLE], kept
+ *        in memory as well (and allocated along with the first of them).
+ * @param u the filesystem (IN)
+ * @param fv6 the filev6 (IN-OUT; i_addr changes with a new indirect sector)
+ * @param ind the indirect sector kept in memory (IN-OUT)
+ * @param dbl the double indirect sector kept in memory (IN-OUT)
+ * @param taken the sectors taken by the append; new indirect sectors are added (IN-OUT)
+ * @param file_sec_off the offset of the sector within the file (in sectors)
+ * @param sector its data sector
+ * @param hint where a new indirect sector would best be
+ * @return 0 on success; <0 on error
+ */
+static int filev6_indirect_set(struct unix_filesystem *u, struct filev6 *fv6, struct filev6_indirect *ind,
+                               struct filev6_indirect *dbl, struct filev6_taken *taken,
+                               int32_t file_sec_off, uint16_t sector, uint64_t hint)
+{
+    const int32_t slot = file_sec_off / ADDRESSES_PER_SECTOR;
+    if (slot >= ADDR_DOUBLE + ADDRESSES_PER_SECTOR) {
+        return ERR_FILE_TOO_LARGE;
+    }
+
+    if (slot != ind->slot) {
+        int err = filev6_indirect_flush(u, ind);
+        if (err != 0) {
+            return err;
+        }
+        ind->slot = -1;
+
+        uint16_t *where = &fv6->i_node.i_addr[slot < ADDR_DOUBLE ? slot : ADDR_DOUBLE];
+        if (slot >= ADDR_DOUBLE) {
+            if (dbl->slot < 0) {
+                if (file_sec_off == ADDR_DOUBLE * ADDRESSES_PER_SECTOR) { // The file becomes huge.
+                    int new_double_sect = filev6_take(u, taken, hint);
+                    if (new_double_sect < 0) {
+                        return new_double_sect;
+                    }
+
+                    memset(dbl->addr, 0, sizeof(dbl->addr));
+                    *where = (uint16_t) new_double_sect;
+                    dbl->dirty = 1;
+                } else {
+                    err = sector_read(u, *where, dbl->addr);
+                    if (err != 0) {
+                        return err;
+                    }
+                }
+                dbl->slot = ADDR_DOUBLE;
+                dbl->sector = *where;
+            }
+            where = &dbl->addr[slot - ADDR_DOUBLE];
+        }
+
+        if (file_sec_off % ADDRESSES_PER_SECTOR == 0) { // The last indirect sector is full.
+            int new_indirect_sect = filev6_take(u, taken, hint);
+            if (new_indirect_sect < 0) {
+                return new_indirect_sect;
+            }
+
+            memset(ind->addr, 0, sizeof(ind->addr));
+            *where = (uint16_t) new_indirect_sect;
+            if (slot >= ADDR_DOUBLE) {
+                dbl->dirty = 1;
+            }
+        } else {
+            err = sector_read(u, *where, ind->addr);
+            if (err != 0) {
+                return err;
+            }
+        }
+        ind->slot = slot;
+        ind->sector = *where;
+    }
+
+    ind->addr[file_sec_off % ADDRESSES_PER_SECTOR] = sector;
+    ind->dirty = 1;
+
+    return 0;
+}
+
+/**
+ * @brief record the data sector of the next sector of an IEXTENT file: the
+ *        last extent grows if the sector follows it, else a new one starts
+ *        (in the overflow sector, kept in memory, once i_addr is full)
+ * @param u the filesystem (IN)
+ * @param fv6 the filev6 (IN-OUT; its extents in i_addr change)
+ * @param ovf the overflow sector kept in memory (IN-OUT)
+ * @param taken the sectors taken by the append; a new overflow sector is added (IN-OUT)
+ * @param sector the data sector
+ * @param hint where the overflow sector would best be
+ * @return 0 on success; <0 on error
+ */
+static int filev6_extent_add(struct unix_filesystem *u, struct filev6 *fv6, struct filev6_indirect *ovf,
+                             struct filev6_taken *taken, uint16_t sector, uint64_t hint)
+{
+    uint16_t *addr = fv6->i_node.i_addr;
+    const int32_t count = addr[ADDR_EXTENT_COUNT];
+    if (count > EXTENTS_MAX) {
+        return ERR_FILE_TOO_LARGE;
+    }
+
+    if (count > EXTENTS_IN_INODE && ovf->slot < 0) {
+        int err = sector_read(u, addr[ADDR_EXTENT_BLOCK], ovf->addr);
+        if (err != 0) {
+            return err;
+        }
+        ovf->slot = ADDR_EXTENT_BLOCK;
+        ovf->sector = addr[ADDR_EXTENT_BLOCK];
+        ovf->dirty = 0;
     }
 
+    if (count > 0) {
+        uint16_t *last = count <= EXTENTS_IN_INODE ? &addr[2 * (count - 1)] : &ovf->addr[2 * (count - 1 - EXTENTS_IN_INODE)];
+        if (last[0] + last[1] == sector && last[1] < UINT16_MAX) {
+            last[1] += 1;
+            if (count > EXTENTS_IN_INODE) {
+                ovf->dirty = 1;
+            }
+            return 0;
+        }
+    }
+
+    if (count == EXTENTS_MAX) {
+        return ERR_FILE_TOO_LARGE;
+    }
+
+    if (count == EXTENTS_IN_INODE) { // i_addr is full.
+        int new_overflow_sect = filev6_take(u, taken, hint);
+        if (new_overflow_sect < 0) {
+            return new_overflow_sect;
+        }
+
+        memset(ovf->addr, 0, sizeof(ovf->addr));
+        addr[ADDR_EXTENT_BLOCK] = (uint16_t) new_overflow_sect;
+        ovf->slot = ADDR_EXTENT_BLOCK;
+        ovf->sector = (uint16_t) new_overflow_sect;
+    }
+
+    uint16_t *next = count < EXTENTS_IN_INODE ? &addr[2 * count] : &ovf->addr[2 * (count - EXTENTS_IN_INODE)];
+    next[0] = sector;
+    next[1] = 1;
+    if (count >= EXTENTS_IN_INODE) {
+        ovf->dirty = 1;
+    }
+    addr[ADDR_EXTENT_COUNT] = (uint16_t) (count + 1);
+
+    return 0;
+}
+
+/**
+ * @brief filev6_writebytes(), the lock of the inode being held by the caller
+ */
+static int filev6_append(struct unix_filesystem *u, struct filev6 *fv6, const void *buf, int len)
+{
+    // The sectors of the file change: its map will be rebuilt on next read.
+    fv6->map_valid = 0;
+
+    // On error, the inode is left as it was, and the sectors taken are free again.
+    const struct inode saved = fv6->i_node;
+    struct filev6_taken taken;
+    memset(&taken, 0, sizeof(struct filev6_taken));
+
     int32_t inode_size = inode_getsize(&fv6->i_node);
     uint32_t offset = 0;
 
-    if (inode_size + len > SECT_UP_LIM) {
+    if (inode_size + len > SECT_HUGE_LIM) {
         return ERR_FILE_TOO_LARGE;
     }
 
     uint32_t free_space = (uint32_t) (SECTOR_SIZE - inode_size % SECTOR_SIZE);
     int err = 0;
 
+    // New sectors go right after the last one of the file, when it is free.
+    uint64_t hint = 0;
+    if (inode_size > 0) {
+        int last = inode_findsector(u, &fv6->i_node, (inode_size - 1) / SECTOR_SIZE);
+        if (last > 0) {
+            hint = (uint64_t) last + 1;
+        }
+    }
+
     if ((free_space > 0) && (free_space != SECTOR_SIZE)) {
         /// 1. There is space left in the last sector, we fill it before creating new sectors.
 
@@ -178,7 +843,7 @@ int filev6_writebytes(struct unix_filesystem *u, struct filev6 *fv6, const void
             return sector;
         }
 
-        err = sector_read(u->f, (uint32_t) sector, sect_buf);
+        err = sector_read(u, (uint32_t) sector, sect_buf);
         if (err != 0) {
             return err;
         }
@@ -194,115 +859,214 @@ int filev6_writebytes(struct unix_filesystem *u, struct filev6 *fv6, const void
     }
 
     /// 2. We maybe have to allocate new sectors and write in them.
+    // The sectors of the new data are reserved by runs, so that they are contiguous on disk.
+    uint64_t run_next = 0;
+    uint64_t run_end = 0;
+
+    // The indirect sector being filled stays in memory until we move to the next one,
+    // and so does the double indirect sector of a huge file.
+    struct filev6_indirect indirect;
+    indirect.slot = -1;
+    indirect.dirty = 0;
+    struct filev6_indirect dbl;
+    dbl.slot = -1;
+    dbl.dirty = 0;
+
     while (offset < (uint32_t) len) {
         uint32_t nb_bytes = ((uint32_t) len - offset >= SECTOR_SIZE) ? SECTOR_SIZE : ((uint32_t) len - offset);
 
-        /// 2.1 We write at the next available place if it exists and write it to the disk.
-        int sec_content = bm_find_next(u->fbm);
-        if (sec_content < 0) {
-            return sec_content;
-        }
+        /// 2.1 We write at the next sector of the run and write it to the disk.
+        if (run_next == run_end) {
+            uint32_t sectors_left = ((uint32_t) len - offset + SECTOR_SIZE - 1) / SECTOR_SIZE;
+            err = filev6_reserve(u, &taken, sectors_left, hint, &run_next, &run_end);
+            if (err != 0) {
+                break;
+            }
 
-        err = filev6_writesector(u, fv6, (const char *) buf + offset, (uint32_t) sec_content);
-        if (err != 0) {
-            return err;
+            // The data of the whole run is written at once.
+            err = filev6_write_run(u, (const char *) buf + offset, (uint32_t) len - offset,
+                                   (uint32_t) run_next, (uint32_t) (run_end - run_next));
+            if (err != 0) {
+                break;
+            }
         }
 
+        int sec_content = (int) run_next;
+        hint = run_next + 1;
+
         /// 2.2  Update of i_addr
-        int small = ((uint32_t)inode_size + offset + nb_bytes <= SECT_DOWN_LIM);
-        int medium = ((uint32_t)inode_size + offset + nb_bytes > SECT_DOWN_LIM);
-        int goingFromSmallToMedium = (((uint32_t)inode_size + offset <= SECT_DOWN_LIM) &&
-                                      ((uint32_t)inode_size + offset + nb_bytes > SECT_DOWN_LIM));
-
-        if (small) { /// 2.2.1 Direct sectors
-            int32_t nb_sect_used = (int32_t)((uint32_t)inode_size + offset ) > 0 ?
-                                   (int32_t)((((uint32_t)inode_size + offset - 1) / SECTOR_SIZE) + 1) : 0;
-            fv6->i_node.i_addr[nb_sect_used] = (uint16_t) sec_content;
-        }
-        if(goingFromSmallToMedium) { /// 2.2.2 From direct to indirect sectors.
-            /// 2.2.2.1 Gathering old sectors into one new and linking it to iaddr.
-            /// (here we are not adding the address of the new sector)
-            uint16_t temp_sect_addr[ADDRESSES_PER_SECTOR];
-            memset(temp_sect_addr, 0, ADDRESSES_PER_SECTOR);
-
-            int32_t nb_sect_used = (int32_t)((uint32_t)inode_size + offset ) > 0 ?
-                                   (int32_t)((((uint32_t)inode_size + offset - 1) / SECTOR_SIZE) + 1) : 0;
-            for (int32_t i = 0; i < nb_sect_used; ++i) {
-                temp_sect_addr[i] = (uint16_t) fv6->i_node.i_addr[i];
-            }
+        int32_t nb_sect_used = (int32_t)((((uint32_t)inode_size + offset + SECTOR_SIZE - 1) / SECTOR_SIZE));
 
-            int new_indirect_sect = bm_find_next(u->fbm);
-            if (new_indirect_sect < 0) {
-                return new_indirect_sect;
+        if (inode_has_extents(fv6->u, &fv6->i_node)) { /// 2.2.0 Extents (the indirect sector in memory is the overflow one)
+            err = filev6_extent_add(u, fv6, &indirect, &taken, (uint16_t) sec_content, hint);
+            if (err != 0) {
+                break;
             }
+        } else if ((uint32_t)inode_size + offset + nb_bytes <= SECT_DOWN_LIM) { /// 2.2.1 Direct sectors
+            fv6->i_node.i_addr[nb_sect_used] = (uint16_t) sec_content;
+        } else {
+            if ((uint32_t)inode_size + offset <= SECT_DOWN_LIM) { /// 2.2.2 From direct to indirect sectors.
+                /// The direct sectors become the first addresses of a new indirect sector.
+                int new_indirect_sect = filev6_take(u, &taken, hint);
+                if (new_indirect_sect < 0) {
+                    err = new_indirect_sect;
+                    break;
+                }
 
-            err = sector_write(u->f, (uint32_t) new_indirect_sect, temp_sect_addr);
-            if (err < 0) {
-                return err;
+                memset(indirect.addr, 0, sizeof(indirect.addr));
+                memcpy(indirect.addr, fv6->i_node.i_addr, (size_t) nb_sect_used * sizeof(uint16_t));
+                memset(fv6->i_node.i_addr, 0, sizeof(fv6->i_node.i_addr));
+                fv6->i_node.i_addr[0] = (uint16_t) new_indirect_sect;
+                indirect.slot = 0;
+                indirect.sector = (uint16_t) new_indirect_sect;
+                indirect.dirty = 1;
             }
 
-            memset(fv6->i_node.i_addr, 0, sizeof(fv6->i_node.i_addr));
-            fv6->i_node.i_addr[0] = (uint16_t) new_indirect_sect;
-            bm_set(u->fbm, (uint64_t) new_indirect_sect);
+            /// 2.2.3 Indirect sectors
+            err = filev6_indirect_set(u, fv6, &indirect, &dbl, &taken, nb_sect_used, (uint16_t) sec_content, hint);
+            if (err != 0) {
+                break;
+            }
         }
 
-        if (medium) { /// 2.2.3 Indirect sectors
-            uint16_t temp_sect_addr[ADDRESSES_PER_SECTOR];
-            memset(temp_sect_addr, 0, sizeof(fv6->i_node.i_addr));
+        /// 2.3 We increase the offset for the data to write (sec_content is used now).
+        run_next += 1;
+        offset += nb_bytes;
+    }
 
-            int32_t nb_sect_used = (int32_t)((uint32_t)inode_size + offset ) > 0 ?
-                                   (int32_t)((((uint32_t)inode_size + offset - 1) / SECTOR_SIZE) + 1) : 0;
-            int32_t i_addr_off = nb_sect_used > 0 ? ((nb_sect_used - 1) / ADDRESSES_PER_SECTOR) : 0;
+    if (err == 0) {
+        err = filev6_indirect_flush(u, &indirect);
+    }
+    if (err == 0) {
+        err = filev6_indirect_flush(u, &dbl);
+    }
 
-            int lastIndirectSectIsFull = ((nb_sect_used % ADDRESSES_PER_SECTOR) == 0);
-            if (lastIndirectSectIsFull ) { /// 2.2.3.1 We need to allocate one new sector.
-                i_addr_off++;
+    if (err == 0) {
+        err = inode_setsize(&fv6->i_node, inode_size + len);
+    }
+    if (err == 0) {
+        err = inode_write(u, fv6->i_number, &fv6->i_node);
+    }
 
-                int new_indirect_sect = bm_find_next(u->fbm);
-                if (new_indirect_sect < 0) {
-                    return new_indirect_sect;
-                }
+    if (err != 0) {
+        fv6->i_node = saved;
+    }
+    filev6_taken_release(u, &taken, err != 0);
 
-                temp_sect_addr[0] = (uint16_t) sec_content;
+    return err;
+}
 
-                err = filev6_writesector(u,fv6, temp_sect_addr, (uint32_t)new_indirect_sect);
-                if (err < 0) {
-                    return err;
-                }
+/**
+ * @brief append the len bytes of the given buffer to the given filev6; they
+ *        are kept in memory, and only allocated and written on disk (as few
+ *        runs as possible) by filev6_flush(), filev6_close(), or once
+ *        FILEV6_WBUF_MAX bytes are waiting
+ * @param u the filesystem (IN)
+ * @param fv6 the filev6 (IN-OUT)
+ * @param buf the data we want to write (IN)
+ * @param len the length of the bytes we want to write
+ * @return 0 on success; <0 on error
+ */
+int filev6_writebytes(struct unix_filesystem *u, struct filev6 *fv6, const void *buf, int len)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->dev);
+    M_REQUIRE_NON_NULL(fv6);
+    M_REQUIRE_NON_NULL(buf);
 
-                fv6->i_node.i_addr[i_addr_off] = (uint16_t)new_indirect_sect;
+    if (len < 0) {
+        return ERR_BAD_PARAMETER;
+    }
 
-            } else { /// 2.2.3.2 We can add our address in the last indirect sector.
-                err = sector_read(u->f, fv6->i_node.i_addr[i_addr_off], temp_sect_addr);
-                if (err < 0) {
-                    return err;
-                }
+    int err = mountv6_bitmaps(u);
+    if (err != 0) {
+        return err;
+    }
 
-                temp_sect_addr[nb_sect_used % ADDRESSES_PER_SECTOR] = (uint16_t) sec_content;
+    if (inode_getsize(&fv6->i_node) + fv6->wlen + len > SECT_HUGE_LIM) {
+        return ERR_FILE_TOO_LARGE;
+    }
 
-                err = sector_write(u->f, fv6->i_node.i_addr[i_addr_off], temp_sect_addr);
-                if (err < 0) {
-                    return err;
-                }
-            }
+    // The buffer grows up to FILEV6_WBUF_MAX: a directory entry needs little.
+    if (fv6->wlen + len > fv6->wsize && fv6->wsize < FILEV6_WBUF_MAX) {
+        int32_t size = fv6->wsize > 0 ? fv6->wsize : SECTOR_SIZE;
+        while (size < fv6->wlen + len && size < FILEV6_WBUF_MAX) {
+            size *= 2;
         }
+        size = size < FILEV6_WBUF_MAX ? size : FILEV6_WBUF_MAX;
 
-        /// 2.3 we set to 1 sect we used.
-        bm_set(u->fbm, (uint64_t) sec_content);
+        uint8_t *wbuf = realloc(fv6->wbuf, (size_t) size);
+        if (wbuf == NULL) {
+            return ERR_NOMEM;
+        }
+        fv6->wbuf = wbuf;
+        fv6->wsize = size;
+    }
 
-        /// 2.4 We increase the offset for the data to write.
-        offset += nb_bytes;
+    const uint8_t *in = buf;
+    while (len > 0) {
+        const int32_t n = len < fv6->wsize - fv6->wlen ? len : fv6->wsize - fv6->wlen;
+        memcpy(fv6->wbuf + fv6->wlen, in, (size_t) n);
+        fv6->wlen += n;
+        in += n;
+        len -= n;
+
+        // The buffer is full: its bytes are allocated together.
+        if (fv6->wlen == fv6->wsize) {
+            err = filev6_flush(u, fv6);
+            if (err != 0) {
+                return err;
+            }
+        }
     }
 
-    err = inode_setsize(&fv6->i_node, inode_size + len);
-    if (err != 0) {
-        return err;
+    return 0;
+}
+
+/**
+ * @brief allocate and write on disk the bytes filev6_writebytes() kept in
+ *        memory, then the inode of the file
+ * @param u the filesystem (IN)
+ * @param fv6 the filev6 (IN-OUT)
+ * @return 0 on success; <0 on error (the bytes kept are lost)
+ */
+int filev6_flush(struct unix_filesystem *u, struct filev6 *fv6)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(fv6);
+
+    if (fv6->wlen == 0) {
+        return 0;
     }
 
-    err = inode_write(u, fv6->i_number, &fv6->i_node);
-    if (err != 0) {
-        return err;
+    // Exclusive: no reader sees the sectors and the inode half updated.
+    struct itable_entry *e = NULL;
+    int err = itable_lock(u, fv6->i_number, 1, &e);
+    if (err == 0) {
+        err = filev6_append(u, fv6, fv6->wbuf, fv6->wlen);
+        itable_unlock(u, e);
     }
+    fv6->wlen = 0;
 
-    return 0;
+    return err;
+}
+
+/**
+ * @brief filev6_flush() and release what the filev6 holds in memory
+ * @param u the filesystem (IN)
+ * @param fv6 the filev6 (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+int filev6_close(struct unix_filesystem *u, struct filev6 *fv6)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(fv6);
+
+    int err = filev6_flush(u, fv6);
+
+    free(fv6->wbuf);
+    fv6->wbuf = NULL;
+    fv6->wsize = 0;
+
+    return err;
 }
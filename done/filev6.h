@@ -10,20 +10,51 @@
 
 #include "unixv6fs.h"
 #include "mount.h"
+#include "inode.h"
+
+#define FILEV6_MAP_LENGTH (SECT_UP_LIM / SECTOR_SIZE)
+#define FILEV6_RA_MIN (4)                // first readahead window, in sectors
+#define FILEV6_RA_MAX (32)               // largest readahead window, in sectors
+#define FILEV6_WBUF_MAX (512 * SECTOR_SIZE) // bytes written to a file before they are allocated on disk
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * @brief where a search in the map of a file resumes: the reader and the
+ *        readahead (ahead of it) each keep their own
+ */
+struct filev6_cursor {
+    int32_t ext;                         // IEXTENT: the extent last found
+    int32_t ext_off;                     // IEXTENT: the first sector of the file it covers
+    int32_t dmap_slot;                   // which indirect sector of dind dmap holds; -1 if none
+    uint16_t dmap[ADDRESSES_PER_SECTOR]; // data sectors of the sectors of the file it covers
+};
+
 struct filev6 {
     const struct unix_filesystem* u;     // the filesystem
     uint16_t i_number;                   // the inode number (on disk)
     struct inode i_node;                 // the content of the inode
     int32_t offset;                      // the current cursor within the file (in bytes)
+    int map_valid;                       // 1 once map is built for the current i_node
+    uint16_t map[FILEV6_MAP_LENGTH];     // data sector of each sector of the file (up to SECT_UP_LIM)
+    uint16_t dind[ADDRESSES_PER_SECTOR]; // the double indirect sector, past SECT_UP_LIM (valid with map)
+    uint16_t ext[2 * EXTENTS_MAX];       // IEXTENT: the (start, length) extents, instead of map (valid with map)
+    int32_t ext_count;                   // IEXTENT: the number of extents in ext
+    struct filev6_cursor cur;            // where the searches of the reader resume
+    struct filev6_cursor ra_cur;         // where the searches of the readahead resume
+    int32_t ra_next;                     // sector of the file a sequential reader reads next
+    int32_t ra_window;                   // current readahead window; 0 after a random access
+    int32_t ra_end;                      // sectors of the file before it are read ahead
+    uint8_t *wbuf;                       // written to the end of the file, not on disk yet (NULL if none)
+    int32_t wlen;                        // number of bytes in wbuf
+    int32_t wsize;                       // number of bytes allocated for wbuf (at most FILEV6_WBUF_MAX)
 };
 
 /**
  * @brief open the file corresponding to a given inode; set offset to zero
+ *        (the file is closed with filev6_close() if it is written to)
  * @param u the filesystem (IN)
  * @param inr the inode number (IN)
  * @param fv6 the complete filve6 data structure (OUT)
@@ -49,7 +80,19 @@ int filev6_lseek(struct filev6 *fv6, int32_t offset);
 int filev6_readblock(struct filev6 *fv6, void *buf);
 
 /**
- * @brief create a new filev6
+ * @brief read at most len bytes from the file at the current cursor, straight
+ *        into buf; physically contiguous sectors are read in one request
+ * @param fv6 the filev6 (IN-OUT; offset will be changed)
+ * @param buf points to len bytes of available memory (OUT)
+ * @param len the number of bytes wanted
+ * @return >0: the number of bytes of the file read; 0: end of file;
+ *             the appropriate error code (<0) on error
+ */
+int filev6_read(struct filev6 *fv6, void *buf, int len);
+
+/**
+ * @brief create a new filev6; what was not written yet of the file it held
+ *        (see filev6_close()) is discarded
  * @param u the filesystem (IN)
  * @param mode the mode of the file
  * @param fv6 the filev6 (IN-OUT; offset will be changed)
@@ -58,15 +101,35 @@ int filev6_readblock(struct filev6 *fv6, void *buf);
 int filev6_create(struct unix_filesystem *u, uint16_t mode, struct filev6 *fv6);
 
 /**
- * @brief write the len bytes of the given buffer on disk to the given filev6
+ * @brief append the len bytes of the given buffer to the given filev6; they
+ *        are kept in memory, and only allocated and written on disk (as few
+ *        runs as possible) by filev6_flush(), filev6_close(), or once
+ *        FILEV6_WBUF_MAX bytes are waiting
  * @param u the filesystem (IN)
- * @param fv6 the filev6 (IN)
+ * @param fv6 the filev6 (IN-OUT)
  * @param buf the data we want to write (IN)
  * @param len the length of the bytes we want to write
  * @return 0 on success; <0 on error
  */
 int filev6_writebytes(struct unix_filesystem *u, struct filev6 *fv6, const void *buf, int len);
 
+/**
+ * @brief allocate and write on disk the bytes filev6_writebytes() kept in
+ *        memory, then the inode of the file
+ * @param u the filesystem (IN)
+ * @param fv6 the filev6 (IN-OUT)
+ * @return 0 on success; <0 on error (the bytes kept are lost)
+ */
+int filev6_flush(struct unix_filesystem *u, struct filev6 *fv6);
+
+/**
+ * @brief filev6_flush() and release what the filev6 holds in memory
+ * @param u the filesystem (IN)
+ * @param fv6 the filev6 (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+int filev6_close(struct unix_filesystem *u, struct filev6 *fv6);
+
 #ifdef __cplusplus
 }
 #endif
@@ -16,6 +16,8 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include "error.h"
 #include "direntv6.h"
 #include "unixv6fs.h"
@@ -25,8 +27,29 @@
 #include "inode.h"
 
 #define BLOCK_512B (512)
+#define FS_NHANDLES (128)  // files and directories open at once
+
+/*
+ * The image is mounted read-only and nothing else writes it: the kernel may
+ * keep attributes and lookups (those readdir returns too) for long, and uses
+ * our inode numbers.
+ */
+#define FS_KERNEL_OPTS "-ouse_ino,attr_timeout=3600,entry_timeout=3600,negative_timeout=3600"
+
+/*
+ * An open file or directory: the lookup and the sector map of the file are
+ * done once in open/opendir, then every read goes straight to the sectors.
+ * fuse_file_info->fh holds the index in handles plus one (0: no handle).
+ */
+struct fs_handle {
+    int used;                   // taken under handles_lock
+    pthread_mutex_t lock;       // FUSE may use one handle from several threads
+    struct directory_reader d;  // d.fv6 alone for a regular file
+};
 
 static struct unix_filesystem fs;
+static struct fs_handle handles[FS_NHANDLES];
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * From https://github.com/libfuse/libfuse/wiki/Option-Parsing.
@@ -37,7 +60,13 @@ static int arg_parse(void* data, const char* filename, int key, struct fuse_args
     (void) data;
     (void) outargs;
 
-    if (key == FUSE_OPT_KEY_NONOPT && fs.f == NULL && filename != NULL) {
+    if (key == FUSE_OPT_KEY_NONOPT && fs.dev == NULL && filename != NULL) {
+        // The daemon lives long and mostly reads: we map the whole image.
+        // FUSE calls us from several threads (unless run with -s).
+        // We never write: the bitmaps are not even built.
+        fs.backend = SECTOR_BACKEND_MMAP;
+        fs.multithreaded = 1;
+        fs.readonly = 1;
         int feedback = mountv6(filename, &fs);
         if (feedback) {
             fprintf(stderr, "ERROR: %d in arg_parse\n", feedback);
@@ -50,6 +79,30 @@ static int arg_parse(void* data, const char* filename, int key, struct fuse_args
     return 1;
 }
 
+/*
+ * The attributes of an (allocated) inode.
+ */
+static void fs_fill_stat(uint16_t inr, const struct inode* inode, struct stat* stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+
+    stbuf->st_ino = (ino_t) inr;
+    stbuf->st_size = (off_t) inode_getsize(inode);
+    stbuf->st_blksize = (blksize_t) SECTOR_SIZE;
+
+    stbuf->st_blocks = (blkcnt_t) (stbuf->st_size / BLOCK_512B);
+    if (stbuf->st_size % BLOCK_512B != 0) {
+        stbuf->st_blocks += 1;
+    }
+
+    stbuf->st_mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+    if ((inode->i_mode & IFMT) == IFDIR) {
+        stbuf->st_mode = stbuf->st_mode | S_IFDIR;
+    } else {
+        stbuf->st_mode = stbuf->st_mode | S_IFREG;
+    }
+}
+
 static int fs_getattr(const char* path, struct stat* stbuf)
 {
     M_REQUIRE_NON_NULL(path);
@@ -62,30 +115,154 @@ static int fs_getattr(const char* path, struct stat* stbuf)
         return inr;
     }
 
+    // Unallocated inodes are refused.
     struct inode inode;
     int feedback = inode_read(&fs, (uint16_t) inr, &inode);
     if (feedback < 0) {
         return feedback;
     }
 
-    if (inode.i_mode & IALLOC) {
-        stbuf->st_ino = (ino_t) inr;
-        stbuf->st_size = (off_t) inode_getsize(&inode);
-        stbuf->st_blksize = (blksize_t) SECTOR_SIZE;
+    fs_fill_stat((uint16_t) inr, &inode, stbuf);
+
+    return 0;
+}
+
+/*
+ * Take a free handle and open the file or directory at path in it.
+ * Returns the value for fuse_file_info->fh (>0) on success; <0 on error.
+ */
+static int fs_handle_open(const char* path, int dir)
+{
+    int inr = direntv6_dirlookup(&fs, ROOT_INUMBER, path);
+    if (inr < 0) {
+        return inr;
+    }
+
+    struct fs_handle* h = NULL;
+    pthread_mutex_lock(&handles_lock);
+    for (size_t i = 0; i < FS_NHANDLES && h == NULL; ++i) {
+        if (!handles[i].used) {
+            h = &handles[i];
+            h->used = 1;
+        }
+    }
+    pthread_mutex_unlock(&handles_lock);
+
+    if (h == NULL) {
+        return ERR_NOMEM;
+    }
+
+    // Nobody else knows h yet: no need of its lock.
+    memset(&h->d, 0, sizeof(struct directory_reader));
 
-        stbuf->st_blocks = (blkcnt_t) (stbuf->st_size / BLOCK_512B);
-        if (stbuf->st_size % BLOCK_512B != 0) {
-            stbuf->st_blocks += 1;
+    int err = 0;
+    if (dir) {
+        err = direntv6_opendir(&fs, (uint16_t) inr, &h->d);
+    } else {
+        err = filev6_open(&fs, (uint16_t) inr, &h->d.fv6);
+        if (err == 0 && (h->d.fv6.i_node.i_mode & IFMT) == IFDIR) {
+            err = ERR_BAD_PARAMETER;
         }
+    }
+    if (err < 0) {
+        pthread_mutex_lock(&handles_lock);
+        h->used = 0;
+        pthread_mutex_unlock(&handles_lock);
+
+        return err;
+    }
+
+    return (int) (h - handles) + 1;
+}
+
+/*
+ * The handle open in fi, or NULL if there is none.
+ */
+static struct fs_handle* fs_handle_get(const struct fuse_file_info *fi)
+{
+    if (fi == NULL || fi->fh < 1 || fi->fh > FS_NHANDLES || !handles[fi->fh - 1].used) {
+        return NULL;
+    }
+
+    return &handles[fi->fh - 1];
+}
+
+static int fs_open(const char *path, struct fuse_file_info *fi)
+{
+    M_REQUIRE_NON_NULL(fs.dev);
+    M_REQUIRE_NON_NULL(path);
+    M_REQUIRE_NON_NULL(fi);
+
+    int fh = fs_handle_open(path, 0);
+    if (fh < 0) {
+        return fh;
+    }
+    fi->fh = (uint64_t) fh;
+
+    return 0;
+}
+
+static int fs_opendir(const char *path, struct fuse_file_info *fi)
+{
+    M_REQUIRE_NON_NULL(fs.dev);
+    M_REQUIRE_NON_NULL(path);
+    M_REQUIRE_NON_NULL(fi);
+
+    int fh = fs_handle_open(path, 1);
+    if (fh < 0) {
+        return fh;
+    }
+    fi->fh = (uint64_t) fh;
+
+    return 0;
+}
+
+static int fs_release(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
+
+    struct fs_handle* h = fs_handle_get(fi);
+    if (h != NULL) {
+        pthread_mutex_lock(&handles_lock);
+        h->used = 0;
+        pthread_mutex_unlock(&handles_lock);
+        fi->fh = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Hand the entries of a directory to filler with their attributes: the
+ * sectors of their inodes are read in one batch, and the path of each entry
+ * goes to the dentry cache, for the getattr the kernel may still issue.
+ */
+static int fs_fill_dir(const char *path, void *buf, fuse_fill_dir_t filler,
+                       char (*names)[DIRENT_MAXLEN + 1], const uint16_t* inrs, size_t n)
+{
+    int err = inode_prefetch(&fs, inrs, n);
+    if (err < 0) {
+        return err;
+    }
 
-        stbuf->st_mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
-        if ((inode.i_mode & IFMT) == IFDIR) {
-            stbuf->st_mode = stbuf->st_mode | S_IFDIR;
+    const size_t len = strlen(path);
+    const char* sep = len > 0 && path[len - 1] == PATH_TOKEN ? "" : "/";
+    for (size_t i = 0; i < n; ++i) {
+        struct inode inode;
+        struct stat st;
+        if (inode_read(&fs, inrs[i], &inode) == 0) {
+            fs_fill_stat(inrs[i], &inode, &st);
+            filler(buf, names[i], &st, 0);
         } else {
-            stbuf->st_mode = stbuf->st_mode | S_IFREG;
+            filler(buf, names[i], NULL, 0);
+        }
+
+        char child[DCACHE_PATHLEN + 1];
+        int written = snprintf(child, sizeof(child), "%s%s%s", path, sep, names[i]);
+        if (written > 0 && (size_t) written < sizeof(child)) {
+            // Purges only drop paths which do not exist: this one does.
+            dcache_insert(fs.dcache, dcache_generation(fs.dcache), ROOT_INUMBER, child, inrs[i]);
         }
-    } else {
-        return ERR_UNALLOCATED_INODE;
     }
 
     return 0;
@@ -94,34 +271,81 @@ static int fs_getattr(const char* path, struct stat* stbuf)
 static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
     (void) offset;
-    (void) fi;
 
-    M_REQUIRE_NON_NULL(fs.f);
+    M_REQUIRE_NON_NULL(fs.dev);
     M_REQUIRE_NON_NULL(path);
     M_REQUIRE_NON_NULL(buf);
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-
     struct directory_reader d;
     char name[DIRENT_MAXLEN + 1];
     memset(name, 0, DIRENT_MAXLEN + 1);
     name[DIRENT_MAXLEN] = '\0';
     uint16_t child_inr = 0;
+    int err = 0;
+
+    // The whole directory is listed at each call: rewind the handle, if any.
+    struct fs_handle* h = fs_handle_get(fi);
+    if (h != NULL) {
+        pthread_mutex_lock(&h->lock);
+        err = filev6_lseek(&h->d.fv6, 0);
+        if (err < 0) {
+            pthread_mutex_unlock(&h->lock);
+            return err;
+        }
+        h->d.cur = 0;
+        h->d.last = 0;
+    } else {
+        int inr = direntv6_dirlookup(&fs, ROOT_INUMBER, path);
+        if (inr < 0) {
+            return inr;
+        }
 
-    int inr = direntv6_dirlookup(&fs, ROOT_INUMBER, path);
-    if (inr < 0) {
-        return inr;
+        err = direntv6_opendir(&fs, (uint16_t) inr, &d);
+        if (err < 0) {
+            return err;
+        }
     }
+    struct directory_reader* reader = h != NULL ? &h->d : &d;
 
-    int err = direntv6_opendir(&fs, (uint16_t) inr, &d);
-    if (err < 0) {
-        return err;
+    struct stat self;
+    fs_fill_stat(reader->fv6.i_number, &reader->fv6.i_node, &self);
+    filler(buf, ".", &self, 0);
+    filler(buf, "..", NULL, 0);
+
+    // The entries first, then their inodes all together.
+    char (*names)[DIRENT_MAXLEN + 1] = NULL;
+    uint16_t* inrs = NULL;
+    size_t n = 0;
+    size_t size = 0;
+    while ((err = direntv6_readdir(reader, name, &child_inr)) > 0) {
+        if (n == size) {
+            size = size == 0 ? (size_t) DIRENTRIES_PER_SECTOR : 2 * size;
+            char (*more_names)[DIRENT_MAXLEN + 1] = realloc(names, size * sizeof(*names));
+            if (more_names != NULL) {
+                names = more_names;
+            }
+            uint16_t* more_inrs = realloc(inrs, size * sizeof(uint16_t));
+            if (more_inrs != NULL) {
+                inrs = more_inrs;
+            }
+            if (more_names == NULL || more_inrs == NULL) {
+                err = ERR_NOMEM;
+                break;
+            }
+        }
+        memcpy(names[n], name, DIRENT_MAXLEN + 1);
+        inrs[n] = child_inr;
+        n += 1;
+    }
+    if (h != NULL) {
+        pthread_mutex_unlock(&h->lock);
     }
 
-    while ((err = direntv6_readdir(&d, name, &child_inr)) > 0) {
-        filler(buf, name, NULL, 0);
+    if (err == 0) {
+        err = fs_fill_dir(path, buf, filler, names, inrs, n);
     }
+    free(names);
+    free(inrs);
     if (err < 0) {
         return err;
     }
@@ -131,49 +355,51 @@ static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t
 
 static int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    (void) fi;
-
-    M_REQUIRE_NON_NULL(fs.f);
+    M_REQUIRE_NON_NULL(fs.dev);
     M_REQUIRE_NON_NULL(path);
     M_REQUIRE_NON_NULL(buf);
 
-    int inr = direntv6_dirlookup(&fs, ROOT_INUMBER, path);
-    if (inr < 0) {
-        return 0;
-    }
-
+    // Opened by fs_open: no lookup, and the sector map is already built.
+    struct fs_handle* h = fs_handle_get(fi);
     struct filev6 fv6;
-    int err = filev6_open(&fs, (uint16_t) inr, &fv6);
-    if (err < 0) {
-        return 0;
-    }
+    struct filev6* file = h != NULL ? &h->d.fv6 : &fv6;
 
-    err = filev6_lseek(&fv6, (int32_t) offset);
-    if (err < 0) {
-        return 0;
-    }
+    if (h == NULL) {
+        int inr = direntv6_dirlookup(&fs, ROOT_INUMBER, path);
+        if (inr < 0) {
+            return 0;
+        }
 
-    unsigned char tempBuffer[SECTOR_SIZE];
-    memset(tempBuffer, 0, SECTOR_SIZE);
-    size_t bytesRead = 0;
-    int toAdd = 0;
+        int err = filev6_open(&fs, (uint16_t) inr, &fv6);
+        if (err < 0) {
+            return 0;
+        }
+    }
 
-    // While there is a block to read, we can read it.
-    while (bytesRead < size && (toAdd = filev6_readblock(&fv6, tempBuffer)) > 0) {
-        memcpy(buf + bytesRead, tempBuffer, (size_t) toAdd);
-        bytesRead += (size_t) toAdd;
+    // The offset of the handle is shared: seek and read at once.
+    if (h != NULL) {
+        pthread_mutex_lock(&h->lock);
+    }
 
-        memset(tempBuffer, 0, SECTOR_SIZE);
+    // Straight into the buffer of FUSE (a file is at most a few MB: size fits an int).
+    int read = filev6_lseek(file, (int32_t) offset);
+    if (read == 0) {
+        read = filev6_read(file, buf, size > INT_MAX ? INT_MAX : (int) size);
     }
-    if (toAdd < 0) {
-        return toAdd;
+
+    if (h != NULL) {
+        pthread_mutex_unlock(&h->lock);
     }
 
-    return (int) bytesRead;
+    return read < 0 ? 0 : read;
 }
 
 static struct fuse_operations available_ops = {
     .getattr    = fs_getattr,
+    .open       = fs_open,
+    .release    = fs_release,
+    .opendir    = fs_opendir,
+    .releasedir = fs_release,
     .readdir    = fs_readdir,
     .read       = fs_read,
 };
@@ -183,6 +409,14 @@ int main(int argc, char *argv[])
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     int ret = fuse_opt_parse(&args, NULL, NULL, arg_parse);
 
+    for (size_t i = 0; i < FS_NHANDLES && ret == 0; ++i) {
+        ret = pthread_mutex_init(&handles[i].lock, NULL);
+    }
+
+    if (ret == 0) {
+        ret = fuse_opt_add_arg(&args, FS_KERNEL_OPTS);
+    }
+
     if (ret == 0) {
         ret = fuse_main(args.argc, args.argv, &available_ops, NULL);
         (void) umountv6(&fs);
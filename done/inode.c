@@ -1,9 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include "inode.h"
 #include "unixv6fs.h"
 #include "sector.h"
+#include "itable.h"
+#include "bcache.h"
 #include "error.h"
 
 #define SIZE0_SHIFT (16)
@@ -18,7 +21,13 @@
  */
 int inode_scan_print(const struct unix_filesystem *u)
 {
-    M_REQUIRE_NON_NULL(u->f);
+    M_REQUIRE_NON_NULL(u->dev);
+
+    // We scan the sectors themselves: they must be up to date.
+    int syncFeedback = itable_sync(u);
+    if (syncFeedback != 0) {
+        return syncFeedback;
+    }
 
     size_t sectStart = u->s.s_inode_start;
     size_t nbrSect = u->s.s_isize;
@@ -28,7 +37,7 @@ int inode_scan_print(const struct unix_filesystem *u)
     size_t sectCount = 0;
     while (sectCount < nbrSect) {
 
-        int readFeedback = sector_read(u->f, (uint32_t) (sectStart + sectCount), tempInodes);
+        int readFeedback = sector_read(u, (uint32_t) (sectStart + sectCount), tempInodes);
         if (readFeedback != 0) {
             return readFeedback;
         }
@@ -85,7 +94,7 @@ void inode_print(const struct inode *inode)
 int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inode)
 {
     M_REQUIRE_NON_NULL(u);
-    M_REQUIRE_NON_NULL(u->f);
+    M_REQUIRE_NON_NULL(u->dev);
     M_REQUIRE_NON_NULL(inode);
 
     if (inr < 1) {
@@ -96,23 +105,131 @@ int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inod
         return ERR_INODE_OUTOF_RANGE;
     }
 
-    size_t sector = u->s.s_inode_start + (inr / INODES_PER_SECTOR);
-    size_t goodInodeNbr = inr % INODES_PER_SECTOR;
+    struct itable_entry *e = NULL;
+    int getFeedback = itable_get(u, inr, &e);
+    if (getFeedback != 0) {
+        return getFeedback;
+    }
 
-    struct inode tempInodes[INODES_PER_SECTOR];
+    struct inode copy;
+    itable_load(u, e, &copy);
+    itable_put(u, e);
+
+    if (!(copy.i_mode & IALLOC)) {
+        return ERR_UNALLOCATED_INODE;
+    }
+    memcpy(inode, &copy, sizeof(struct inode));
+
+    return 0;
+}
+
+/**
+ * @brief read ahead the sectors holding the given inodes, in as few batched
+ *        requests as possible: reading them afterwards costs no I/O
+ * @param u the filesystem (IN)
+ * @param inrs the inode numbers, in any order (IN)
+ * @param n the number of inode numbers
+ * @return 0 on success; <0 on error
+ */
+int inode_prefetch(const struct unix_filesystem *u, const uint16_t *inrs, size_t n)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->dev);
+
+    if (n == 0 || u->s.s_isize == 0) {
+        return 0;
+    }
+    M_REQUIRE_NON_NULL(inrs);
+
+    // The sectors of the inode region wanted, then their runs.
+    uint8_t *want = calloc(u->s.s_isize, sizeof(uint8_t));
+    if (want == NULL) {
+        return ERR_NOMEM;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (inrs[i] / INODES_PER_SECTOR < u->s.s_isize) {
+            want[inrs[i] / INODES_PER_SECTOR] = 1;
+        }
+    }
+
+    int err = 0;
+    uint32_t first = 0;
+    while (first < u->s.s_isize && err == 0) {
+        if (!want[first]) {
+            first += 1;
+            continue;
+        }
+
+        uint32_t end = first + 1;
+        while (end < u->s.s_isize && want[end] && end - first < BCACHE_PREFETCH_MAX) {
+            end += 1;
+        }
+        err = sector_prefetch(u, u->s.s_inode_start + first, end - first);
+        first = end;
+    }
+    free(want);
+
+    return err;
+}
+
+/**
+ * @brief read one address of an indirect sector
+ * @param u the filesystem (IN)
+ * @param sector the indirect sector
+ * @param index the index of the address within it
+ * @return the address (>=0); <0 on error
+ */
+static int inode_indirect_get(const struct unix_filesystem *u, uint16_t sector, int32_t index)
+{
+    const uint16_t *addresses = sector_borrow(u, sector);
+    if (addresses != NULL) {
+        return addresses[index];
+    }
+
+    uint16_t temp[ADDRESSES_PER_SECTOR];
 
-    int readFeedback = sector_read(u->f, (uint32_t) sector, tempInodes);
+    int readFeedback = sector_read(u, sector, temp);
     if (readFeedback != 0) {
         return readFeedback;
     }
 
-    if (!(tempInodes[goodInodeNbr].i_mode & IALLOC)) {
-        return ERR_UNALLOCATED_INODE;
-    } else {
-        memcpy(inode, &tempInodes[goodInodeNbr], sizeof(struct inode));
+    return temp[index];
+}
+
+/**
+ * @brief inode_findsector() for an IEXTENT inode
+ */
+static int inode_extent_findsector(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off)
+{
+    const int32_t count = i->i_addr[ADDR_EXTENT_COUNT];
+    if (count > EXTENTS_MAX) {
+        return ERR_FILE_TOO_LARGE;
     }
 
-    return 0;
+    uint16_t temp[ADDRESSES_PER_SECTOR];
+    const uint16_t *extents = i->i_addr;
+    int32_t first = 0;
+
+    for (int32_t k = 0; k < count; ++k) {
+        if (k == EXTENTS_IN_INODE) {
+            extents = sector_borrow(u, i->i_addr[ADDR_EXTENT_BLOCK]);
+            if (extents == NULL) {
+                int readFeedback = sector_read(u, i->i_addr[ADDR_EXTENT_BLOCK], temp);
+                if (readFeedback != 0) {
+                    return readFeedback;
+                }
+                extents = temp;
+            }
+        }
+
+        const uint16_t *extent = &extents[2 * (k < EXTENTS_IN_INODE ? k : k - EXTENTS_IN_INODE)];
+        if (file_sec_off >= 0 && file_sec_off < first + extent[1]) {
+            return extent[0] + (file_sec_off - first);
+        }
+        first += extent[1];
+    }
+
+    return ERR_OFFSET_OUT_OF_RANGE;
 }
 
 /**
@@ -125,30 +242,41 @@ int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inod
 int inode_findsector(const struct unix_filesystem *u, const struct inode *i, int32_t file_sec_off)
 {
     M_REQUIRE_NON_NULL(u);
-    M_REQUIRE_NON_NULL(u->f);
+    M_REQUIRE_NON_NULL(u->dev);
     M_REQUIRE_NON_NULL(i);
 
     if (i->i_mode & IALLOC) {
         int32_t inodeSize = inode_getsize(i);
 
-        if (inodeSize > SECT_UP_LIM) {
+        if (inodeSize > SECT_HUGE_LIM) {
             // ERR FIL TOO LARGE
             return ERR_FILE_TOO_LARGE;
         } else {
+            if (inode_has_extents(u, i)) {
+                // FIL EXTENT-MAPPED
+                return inode_extent_findsector(u, i, file_sec_off);
+            }
+
             if (inodeSize > SECT_DOWN_LIM) {
                 // FIL MID-SIZE
                 int32_t offsetIAddr = file_sec_off / ADDRESSES_PER_SECTOR;
                 int32_t indirectOffset = file_sec_off % ADDRESSES_PER_SECTOR;
 
-                if (offsetIAddr >= 0 && offsetIAddr < ADDR_SMALL_LENGTH) {
-                    uint16_t temp[ADDRESSES_PER_SECTOR];
+                if (offsetIAddr >= 0 && offsetIAddr < ADDR_DOUBLE) {
+                    return inode_indirect_get(u, i->i_addr[offsetIAddr], indirectOffset);
+                } else if (offsetIAddr >= ADDR_DOUBLE && inodeSize > SECT_UP_LIM) {
+                    // FIL HUGE: past the 7 indirect sectors, through the double indirect one
+                    int32_t doubleOffset = offsetIAddr - ADDR_DOUBLE;
+                    if (doubleOffset >= ADDRESSES_PER_SECTOR) {
+                        return ERR_OFFSET_OUT_OF_RANGE;
+                    }
 
-                    int readFeedback = sector_read(u->f, i->i_addr[offsetIAddr], temp);
-                    if (readFeedback != 0) {
-                        return readFeedback;
+                    int indirect = inode_indirect_get(u, i->i_addr[ADDR_DOUBLE], doubleOffset);
+                    if (indirect < 0) {
+                        return indirect;
                     }
 
-                    return temp[indirectOffset];
+                    return inode_indirect_get(u, (uint16_t) indirect, indirectOffset);
                 } else {
                     return ERR_OFFSET_OUT_OF_RANGE;
                 }
@@ -175,14 +303,16 @@ int inode_alloc(struct unix_filesystem *u)
 {
     M_REQUIRE_NON_NULL(u);
 
-    int feedback = bm_find_next(u->ibm);
-    if (feedback == ERR_BITMAP_FULL) {
-        return ERR_NOMEM;
-    } else if (feedback < 0) {
+    int feedback = mountv6_bitmaps(u);
+    if (feedback != 0) {
         return feedback;
     }
 
-    bm_set(u->ibm, (uint64_t) feedback);
+    // Found and marked used at once: no other thread can get it too.
+    feedback = bm_take_next(u->ibm);
+    if (feedback == ERR_BITMAP_FULL) {
+        return ERR_NOMEM;
+    }
 
     return feedback;
 }
@@ -199,24 +329,28 @@ int inode_write(struct unix_filesystem *u, uint16_t inr, const struct inode *ino
     M_REQUIRE_NON_NULL(u);
     M_REQUIRE_NON_NULL(inode);
 
+    if (inr < 1) {
+        return ERR_BAD_PARAMETER;
+    }
+
     uint32_t sect = u->s.s_inode_start + inr / (uint32_t) INODES_PER_SECTOR;
 
     if (sect > (uint32_t) (u->s.s_inode_start + u->s.s_isize - 1)) {
         return ERR_BAD_PARAMETER;
     }
 
-    struct inode temp[INODES_PER_SECTOR];
-    memset(temp, 0, sizeof(temp));
-
-    int err = sector_read(u->f, sect , temp);
-    if (err < 0) {
-        return err;
+    int feedBack = mountv6_bitmaps(u);
+    if (feedBack != 0) {
+        return feedBack;
     }
 
-    memcpy(&temp[inr % INODES_PER_SECTOR], inode, sizeof(struct inode));
+    // The in-core copy is updated now, the inode sector on itable_sync().
+    struct itable_entry *e = NULL;
+    feedBack = itable_get(u, inr, &e);
+    if (feedBack == 0) {
+        itable_store(u, e, inode);
+        itable_put(u, e);
 
-    int feedBack = sector_write(u->f, sect, temp);
-    if(feedBack == 0) {
         bm_set(u->fbm, sect);
         bm_set(u->ibm, inr);
     }
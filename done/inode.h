@@ -12,7 +12,17 @@
 #include "mount.h"
 
 #define SECT_DOWN_LIM (ADDR_SMALL_LENGTH * SECTOR_SIZE)
-#define SECT_UP_LIM (7 * ADDRESSES_PER_SECTOR * SECTOR_SIZE)
+#define SECT_UP_LIM (7 * ADDRESSES_PER_SECTOR * SECTOR_SIZE)  // beyond, i_addr[7] is a double indirect sector
+#define SECT_HUGE_LIM ((1 << 24) - 1)                         // the largest size a 24-bit i_size holds
+#define ADDR_DOUBLE (ADDR_SMALL_LENGTH - 1)                   // the index in i_addr of the double indirect sector
+
+// An IEXTENT inode lists (start, length) runs of sectors instead: the first
+// ones in i_addr, the others in an overflow sector.
+#define EXTENTS_IN_INODE (3)                                  // pairs in i_addr[0..5]
+#define ADDR_EXTENT_BLOCK (6)                                 // the index in i_addr of the overflow sector (if needed)
+#define ADDR_EXTENT_COUNT (7)                                 // the index in i_addr of the number of extents
+#define EXTENTS_PER_SECTOR (ADDRESSES_PER_SECTOR / 2)
+#define EXTENTS_MAX (EXTENTS_IN_INODE + EXTENTS_PER_SECTOR)
 
 #ifdef __cplusplus
 extern "C" {
@@ -54,6 +64,18 @@ static inline int32_t inode_getsectorsize(const struct inode *inode)
     return (i_size ? ((i_size - 1) / SECTOR_SIZE + 1) * SECTOR_SIZE + 1 : 1);
 }
 
+/**
+ * @brief whether the sectors of an inode are listed by extents: IEXTENT set,
+ *        on an image formatted with SUPERBLOCK_FEATURE_EXTENTS
+ * @param u the filesystem
+ * @param inode the inode
+ * @return 1 if so; 0 otherwise
+ */
+static inline int inode_has_extents(const struct unix_filesystem *u, const struct inode *inode)
+{
+    return (u->s.s_features & SUPERBLOCK_FEATURE_EXTENTS) && (inode->i_mode & IEXTENT);
+}
+
 /**
  * @brief set the size of a given inode to the given size
  * @param inode the inode
@@ -85,6 +107,16 @@ int inode_scan_print(const struct unix_filesystem *u);
  */
 int inode_read(const struct unix_filesystem *u, uint16_t inr, struct inode *inode);
 
+/**
+ * @brief read ahead the sectors holding the given inodes, in as few batched
+ *        requests as possible: reading them afterwards costs no I/O
+ * @param u the filesystem (IN)
+ * @param inrs the inode numbers, in any order (IN)
+ * @param n the number of inode numbers
+ * @return 0 on success; <0 on error
+ */
+int inode_prefetch(const struct unix_filesystem *u, const uint16_t *inrs, size_t n);
+
 /**
  * @brief identify the sector that corresponds to a given portion of a file
  * @param u the filesystem (IN)
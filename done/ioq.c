@@ -0,0 +1,629 @@
+/**
+ * @file ioq.c
+ * @brief asynchronous sector I/O, on io_uring or on a pool of threads
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "ioq.h"
+#include "sector.h"
+#include "mount.h"
+#include "blkdev.h"
+#include "unixv6fs.h"
+#include "error.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+#define IOQ_HAVE_URING
+#endif
+
+#ifdef IOQ_HAVE_URING
+/**
+ * @brief the rings shared with the kernel (the layout of io_uring(7))
+ */
+struct ioq_uring {
+    int fd;                        // the ring itself
+    void *sq_ptr;                  // mapping of the submission ring
+    size_t sq_size;
+    void *cq_ptr;                  // mapping of the completion ring (may be sq_ptr)
+    size_t cq_size;
+    struct io_uring_sqe *sqes;     // the submission entries
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+#endif
+
+struct ioq {
+    const struct unix_filesystem *u;
+    enum ioq_engine engine;
+    unsigned depth;
+    int inline_io;                 // 1 if the device is in memory: requests complete at once
+    pthread_mutex_t lock;          // protects all that follows (and the ring)
+    size_t inflight;               // started and not completed (ioq_run()) or not reaped yet
+    int collecting;                // IOQ_ENGINE_URING: 1 while a thread waits for the completions of all
+    pthread_cond_t work;           // a request is pending (or the pool stops)
+    pthread_cond_t completed;      // a request completed (or a thread stopped collecting)
+    struct ioq_req *pending;       // IOQ_ENGINE_THREADS: requests not started yet
+    struct ioq_req *pending_tail;
+    struct ioq_req *done;          // completed and not reaped yet
+    struct ioq_req *done_tail;
+    int stopping;                  // 1 once the pool shall exit
+    size_t nthreads;
+    pthread_t threads[IOQ_THREADS];
+#ifdef IOQ_HAVE_URING
+    struct ioq_uring ring;
+#endif
+};
+
+/**
+ * @brief carry out a request synchronously
+ */
+static void ioq_do(const struct ioq *q, struct ioq_req *r)
+{
+    sector_dev_do(q->u, r);
+}
+
+/**
+ * @brief append a request to a list
+ */
+static void ioq_push(struct ioq_req **head, struct ioq_req **tail, struct ioq_req *r)
+{
+    r->next = NULL;
+    if (*tail != NULL) {
+        (*tail)->next = r;
+    } else {
+        *head = r;
+    }
+    *tail = r;
+}
+
+/**
+ * @brief remove the first request of a list (NULL if empty)
+ */
+static struct ioq_req *ioq_pop(struct ioq_req **head, struct ioq_req **tail)
+{
+    struct ioq_req *r = *head;
+    if (r != NULL) {
+        *head = r->next;
+        if (*head == NULL) {
+            *tail = NULL;
+        }
+        r->next = NULL;
+    }
+
+    return r;
+}
+
+/**
+ * @brief a request completed, the lock of the queue held: it counts down the
+ *        batch of its ioq_run(), or waits in the done list for ioq_reap()
+ */
+static void ioq_complete(struct ioq *q, struct ioq_req *r)
+{
+    if (r->left != NULL) {
+        *r->left -= 1;
+        q->inflight -= 1;
+    } else {
+        ioq_push(&q->done, &q->done_tail, r);
+    }
+    pthread_cond_broadcast(&q->completed);
+}
+
+/**
+ * @brief body of a thread of the pool: requests are carried out in order
+ * @param arg the queue
+ * @return NULL
+ */
+static void *ioq_worker(void *arg)
+{
+    struct ioq *q = arg;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (!q->stopping && q->pending == NULL) {
+            pthread_cond_wait(&q->work, &q->lock);
+        }
+
+        struct ioq_req *r = ioq_pop(&q->pending, &q->pending_tail);
+        if (r == NULL) { // Stopping, and nothing is left to do.
+            break;
+        }
+
+        pthread_mutex_unlock(&q->lock);
+        ioq_do(q, r);
+        pthread_mutex_lock(&q->lock);
+
+        ioq_complete(q, r);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return NULL;
+}
+
+#ifdef IOQ_HAVE_URING
+/**
+ * @brief io_uring_enter(2), retried when interrupted
+ */
+static int ioq_uring_enter(struct ioq *q, unsigned submit, unsigned complete, unsigned flags)
+{
+    for (;;) {
+        long ret = syscall(__NR_io_uring_enter, q->ring.fd, submit, complete, flags, NULL, 0);
+        if (ret >= 0) {
+            return (int) ret;
+        }
+        if (errno != EINTR && errno != EAGAIN) {
+            return ERR_IO;
+        }
+    }
+}
+
+/**
+ * @brief release the rings (on any part set up)
+ */
+static void ioq_uring_close(struct ioq_uring *ring)
+{
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != NULL) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(struct ioq_uring));
+    ring->fd = -1;
+}
+
+/**
+ * @brief set up the rings of a queue
+ * @return 0 on success; <0 if io_uring is unavailable
+ */
+static int ioq_uring_open(struct ioq *q)
+{
+    struct ioq_uring *ring = &q->ring;
+    memset(ring, 0, sizeof(struct ioq_uring));
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(struct io_uring_params));
+    long fd = syscall(__NR_io_uring_setup, q->depth, &p);
+    if (fd < 0) {
+        ring->fd = -1;
+        return ERR_IO;
+    }
+    ring->fd = (int) fd;
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_size = ring->sq_size > ring->cq_size ? ring->sq_size : ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    void *sq = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        ioq_uring_close(ring);
+        return ERR_IO;
+    }
+    ring->sq_ptr = sq;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = sq;
+    } else {
+        void *cq = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            ioq_uring_close(ring);
+            return ERR_IO;
+        }
+        ring->cq_ptr = cq;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        ioq_uring_close(ring);
+        return ERR_IO;
+    }
+    ring->sqes = sqes;
+
+    uint8_t *sqp = ring->sq_ptr;
+    uint8_t *cqp = ring->cq_ptr;
+    ring->sq_head = (unsigned *) (void *) (sqp + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (void *) (sqp + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (void *) (sqp + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (void *) (sqp + p.sq_off.array);
+    ring->cq_head = (unsigned *) (void *) (cqp + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (void *) (cqp + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (void *) (cqp + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (void *) (cqp + p.cq_off.cqes);
+
+    // The submission ring is never fuller than the queue is deep.
+    if (p.sq_entries < q->depth) {
+        q->depth = p.sq_entries;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief start requests on io_uring, the lock of the queue held; those the
+ *        kernel refuses are done synchronously instead
+ */
+static void ioq_uring_submit(struct ioq *q, struct ioq_req *reqs, size_t n)
+{
+    struct ioq_uring *ring = &q->ring;
+
+    unsigned tail = *ring->sq_tail;
+    const unsigned mask = *ring->sq_mask;
+    unsigned queued = 0;
+    for (size_t i = 0; i < n; ++i) {
+        struct ioq_req *r = &reqs[i];
+        const unsigned index = tail & mask;
+
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->fd = q->u->dev->fd;
+        sqe->off = (uint64_t) r->sector * SECTOR_SIZE;
+        if (r->iov != NULL) {
+            sqe->opcode = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->addr = (uint64_t) (uintptr_t) r->iov;
+            sqe->len = (uint32_t) r->iovcnt;
+        } else {
+            sqe->opcode = r->write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->addr = (uint64_t) (uintptr_t) r->data;
+            sqe->len = r->count * SECTOR_SIZE;
+        }
+        sqe->user_data = (uint64_t) (uintptr_t) r;
+
+        ring->sq_array[index] = index;
+        tail += 1;
+        queued += 1;
+    }
+    // The kernel shall see the entries before the new tail.
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    while (queued > 0) {
+        int submitted = ioq_uring_enter(q, queued, 0, 0);
+        if (submitted <= 0) {
+            break;
+        }
+        queued -= (unsigned) submitted;
+    }
+
+    // The entries the kernel did not consume are taken back (only a submit,
+    // under the lock, makes it consume any) and done the usual way.
+    const unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    for (unsigned i = head; i != tail; ++i) {
+        struct ioq_req *r = (struct ioq_req *) (uintptr_t) ring->sqes[ring->sq_array[i & mask]].user_data;
+        ioq_do(q, r);
+        ioq_complete(q, r);
+    }
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief complete the requests the ring has completions for, the lock of the
+ *        queue held
+ */
+static void ioq_uring_collect(struct ioq *q)
+{
+    struct ioq_uring *ring = &q->ring;
+
+    unsigned head = *ring->cq_head;
+    const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        struct ioq_req *r = (struct ioq_req *) (uintptr_t) cqe->user_data;
+
+        // A short or failed transfer (e.g. past the end of a growing image,
+        // or an old kernel without these opcodes) is done again the usual way.
+        if (cqe->res == (int32_t) (r->count * SECTOR_SIZE)) {
+            r->result = 0;
+        } else {
+            ioq_do(q, r);
+        }
+        ioq_complete(q, r);
+
+        head += 1;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+/**
+ * @brief wait until some request completes, the lock of the queue held (and
+ *        released meanwhile); on io_uring, one of the threads waiting
+ *        collects the completions of all
+ */
+static void ioq_wait(struct ioq *q)
+{
+#ifdef IOQ_HAVE_URING
+    if (q->engine == IOQ_ENGINE_URING && !q->inline_io) {
+        if (q->collecting) {
+            pthread_cond_wait(&q->completed, &q->lock);
+            return;
+        }
+
+        q->collecting = 1;
+        pthread_mutex_unlock(&q->lock);
+        // Should the kernel refuse to let us wait, the ring is polled instead:
+        // what is in flight may still write to the memory of its requests.
+        if (ioq_uring_enter(q, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+            sched_yield();
+        }
+        pthread_mutex_lock(&q->lock);
+        ioq_uring_collect(q);
+        q->collecting = 0;
+        pthread_cond_broadcast(&q->completed);
+        return;
+    }
+#endif
+    pthread_cond_wait(&q->completed, &q->lock);
+}
+
+/**
+ * @brief start requests, the lock of the queue held (n fits in its depth)
+ */
+static void ioq_start(struct ioq *q, struct ioq_req *reqs, size_t n)
+{
+    q->inflight += n;
+
+    // An image in memory is only a memcpy away: nothing is worth waiting for.
+    if (q->inline_io) {
+        for (size_t i = 0; i < n; ++i) {
+            ioq_do(q, &reqs[i]);
+            ioq_complete(q, &reqs[i]);
+        }
+        return;
+    }
+
+#ifdef IOQ_HAVE_URING
+    if (q->engine == IOQ_ENGINE_URING) {
+        ioq_uring_submit(q, reqs, n);
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < n; ++i) {
+        ioq_push(&q->pending, &q->pending_tail, &reqs[i]);
+    }
+    pthread_cond_broadcast(&q->work);
+}
+
+/**
+ * @brief allocate a new queue for the image of u (u->dev opened)
+ * @param u the filesystem
+ * @param depth the number of requests it keeps in flight at most (>0)
+ * @return a pointer to the new queue or NULL on failure
+ */
+struct ioq *ioq_alloc(const struct unix_filesystem *u, unsigned depth)
+{
+    return ioq_alloc_engine(u, depth, IOQ_ENGINE_URING);
+}
+
+/**
+ * @brief ioq_alloc() with the engine wanted; IOQ_ENGINE_URING falls back to
+ *        IOQ_ENGINE_THREADS if the kernel does not have it
+ * @param u the filesystem
+ * @param depth the number of requests it keeps in flight at most (>0)
+ * @param engine the engine wanted
+ * @return a pointer to the new queue (see ioq_engine()) or NULL on failure
+ */
+struct ioq *ioq_alloc_engine(const struct unix_filesystem *u, unsigned depth, enum ioq_engine engine)
+{
+    if (u == NULL || u->dev == NULL || depth == 0) {
+        return NULL;
+    }
+
+    struct ioq *q = calloc(1, sizeof(struct ioq));
+    if (q == NULL) {
+        return NULL;
+    }
+
+    q->u = u;
+    q->depth = depth;
+    q->inline_io = u->dev->ops->borrow != NULL;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->work, NULL);
+    pthread_cond_init(&q->completed, NULL);
+
+#ifdef IOQ_HAVE_URING
+    if (engine == IOQ_ENGINE_URING && ioq_uring_open(q) == 0) {
+        q->engine = IOQ_ENGINE_URING;
+        return q;
+    }
+#else
+    (void) engine;
+#endif
+
+    // No io_uring: the pool does the same synchronously, a few requests at a time.
+    q->engine = IOQ_ENGINE_THREADS;
+    while (q->nthreads < IOQ_THREADS
+           && pthread_create(&q->threads[q->nthreads], NULL, ioq_worker, q) == 0) {
+        q->nthreads += 1;
+    }
+    if (q->nthreads == 0) {
+        ioq_free(q);
+        return NULL;
+    }
+
+    return q;
+}
+
+/**
+ * @brief release a queue; requests still in flight are waited for first
+ * @param q the queue (may be NULL)
+ */
+void ioq_free(struct ioq *q)
+{
+    if (q == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (ioq_pop(&q->done, &q->done_tail) != NULL) {
+            q->inflight -= 1;
+        }
+        if (q->inflight == 0) {
+            break;
+        }
+        ioq_wait(q);
+    }
+
+    q->stopping = 1;
+    pthread_cond_broadcast(&q->work);
+    pthread_mutex_unlock(&q->lock);
+    for (size_t i = 0; i < q->nthreads; ++i) {
+        pthread_join(q->threads[i], NULL);
+    }
+
+#ifdef IOQ_HAVE_URING
+    if (q->engine == IOQ_ENGINE_URING) {
+        ioq_uring_close(&q->ring);
+    }
+#endif
+
+    pthread_cond_destroy(&q->completed);
+    pthread_cond_destroy(&q->work);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+
+/**
+ * @brief which engine a queue uses
+ * @param q the queue
+ * @return its engine
+ */
+enum ioq_engine ioq_engine(const struct ioq *q)
+{
+    return q->engine;
+}
+
+/**
+ * @brief start a batch of requests, as many as the depth of the queue allows;
+ *        submit and reap are meant for a single thread (see ioq_run())
+ * @param q the queue
+ * @param reqs the requests, not to be touched until they are reaped
+ * @param n the number of requests
+ * @return the number of requests started (the first ones; >=0); <0 on error
+ */
+int ioq_submit(struct ioq *q, struct ioq_req *reqs, size_t n)
+{
+    M_REQUIRE_NON_NULL(q);
+    M_REQUIRE_NON_NULL(reqs);
+
+    pthread_mutex_lock(&q->lock);
+    if (n > q->depth - q->inflight) {
+        n = q->depth - q->inflight;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        reqs[i].left = NULL;
+    }
+    if (n > 0) {
+        ioq_start(q, reqs, n);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return (int) n;
+}
+
+/**
+ * @brief collect completed requests, waiting until at least min of them are
+ * @param q the queue
+ * @param done where the completed requests are stored (OUT)
+ * @param max the number of pointers done can hold
+ * @param min the number of completions to wait for (at most those in flight)
+ * @return the number of requests stored in done (>=0); <0 on error
+ */
+int ioq_reap(struct ioq *q, struct ioq_req **done, size_t max, size_t min)
+{
+    M_REQUIRE_NON_NULL(q);
+    M_REQUIRE_NON_NULL(done);
+
+    size_t reaped = 0;
+    pthread_mutex_lock(&q->lock);
+    if (min > max) {
+        min = max;
+    }
+    if (min > q->inflight) {
+        min = q->inflight;
+    }
+
+    for (;;) {
+        while (reaped < max && q->done != NULL) {
+            done[reaped] = ioq_pop(&q->done, &q->done_tail);
+            reaped += 1;
+        }
+        if (reaped >= min || reaped == max) {
+            break;
+        }
+        ioq_wait(q);
+    }
+    q->inflight -= reaped;
+    pthread_mutex_unlock(&q->lock);
+
+    return (int) reaped;
+}
+
+/**
+ * @brief submit a batch of requests and wait for all of them; several
+ *        threads may share a queue through it
+ * @param q the queue
+ * @param reqs the requests; their result is set (IN-OUT)
+ * @param n the number of requests
+ * @return 0 if they all succeeded; the first error otherwise
+ */
+int ioq_run(struct ioq *q, struct ioq_req *reqs, size_t n)
+{
+    M_REQUIRE_NON_NULL(q);
+    M_REQUIRE_NON_NULL(reqs);
+
+    // Each completion counts down left: we return once it is 0, never while
+    // the kernel may still write to the buffers of the batch.
+    size_t left = n;
+    for (size_t i = 0; i < n; ++i) {
+        reqs[i].left = &left;
+        reqs[i].result = 0;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    size_t started = 0;
+    while (left > 0) {
+        // The depth is shared with the other threads running batches.
+        if (started < n && q->inflight < q->depth) {
+            const size_t room = q->depth - q->inflight;
+            const size_t count = n - started < room ? n - started : room;
+            ioq_start(q, &reqs[started], count);
+            started += count;
+        } else {
+            ioq_wait(q);
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    int err = 0;
+    for (size_t i = 0; i < n && err == 0; ++i) {
+        err = reqs[i].result;
+    }
+
+    return err;
+}
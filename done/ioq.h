@@ -0,0 +1,113 @@
+#pragma once
+
+/**
+ * @file ioq.h
+ * @brief asynchronous sector I/O: a batch of reads and writes is submitted
+ *        at once, then their completions are reaped. Backed by io_uring when
+ *        the kernel has it, else by a small pool of threads doing pread/pwrite.
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <sys/uio.h> // for struct iovec
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IOQ_DEFAULT_DEPTH (32)     // requests in flight at most per queue
+#define IOQ_THREADS (4)            // threads of the fallback engine
+
+struct unix_filesystem;
+
+/**
+ * @brief the ways an ioq can carry out its requests
+ */
+enum ioq_engine {
+    IOQ_ENGINE_URING = 0,          // io_uring, without liburing
+    IOQ_ENGINE_THREADS             // IOQ_THREADS threads doing synchronous I/O
+};
+
+/**
+ * @brief one request: count consecutive sectors, straight from/to the
+ *        backend (the buffer cache is the caller's business)
+ */
+struct ioq_req {
+    uint32_t sector;               // the first sector
+    uint32_t count;                // the number of sectors (>0)
+    void *data;                    // count * 512 bytes (OUT for a read, IN for a write)
+    const struct iovec *iov;       // if not NULL, the buffers of the count sectors instead of data
+    int iovcnt;                    // the number of buffers in iov
+    int write;                     // 1 for a write, 0 for a read
+    int result;                    // once reaped: 0 on success; <0 on error
+    size_t *left;                  // used by ioq_run(): the requests of its batch not completed yet
+    struct ioq_req *next;          // used by the queue until the request is reaped
+};
+
+struct ioq;
+
+/**
+ * @brief allocate a new queue for the image of u (u->dev opened)
+ * @param u the filesystem
+ * @param depth the number of requests it keeps in flight at most (>0)
+ * @return a pointer to the new queue or NULL on failure
+ */
+struct ioq *ioq_alloc(const struct unix_filesystem *u, unsigned depth);
+
+/**
+ * @brief ioq_alloc() with the engine wanted; IOQ_ENGINE_URING falls back to
+ *        IOQ_ENGINE_THREADS if the kernel does not have it
+ * @param u the filesystem
+ * @param depth the number of requests it keeps in flight at most (>0)
+ * @param engine the engine wanted
+ * @return a pointer to the new queue (see ioq_engine()) or NULL on failure
+ */
+struct ioq *ioq_alloc_engine(const struct unix_filesystem *u, unsigned depth, enum ioq_engine engine);
+
+/**
+ * @brief release a queue; requests still in flight are waited for first
+ * @param q the queue (may be NULL)
+ */
+void ioq_free(struct ioq *q);
+
+/**
+ * @brief which engine a queue uses
+ * @param q the queue
+ * @return its engine
+ */
+enum ioq_engine ioq_engine(const struct ioq *q);
+
+/**
+ * @brief start a batch of requests, as many as the depth of the queue allows;
+ *        submit and reap are meant for a single thread (see ioq_run())
+ * @param q the queue
+ * @param reqs the requests, not to be touched until they are reaped
+ * @param n the number of requests
+ * @return the number of requests started (the first ones; >=0); <0 on error
+ */
+int ioq_submit(struct ioq *q, struct ioq_req *reqs, size_t n);
+
+/**
+ * @brief collect completed requests, waiting until at least min of them are
+ * @param q the queue
+ * @param done where the completed requests are stored (OUT)
+ * @param max the number of pointers done can hold
+ * @param min the number of completions to wait for (at most those in flight)
+ * @return the number of requests stored in done (>=0); <0 on error
+ */
+int ioq_reap(struct ioq *q, struct ioq_req **done, size_t max, size_t min);
+
+/**
+ * @brief submit a batch of requests and wait for all of them; several
+ *        threads may share a queue through it, their batches in flight
+ *        side by side (within the depth of the queue)
+ * @param q the queue
+ * @param reqs the requests; their result is set (IN-OUT)
+ * @param n the number of requests
+ * @return 0 if they all succeeded; the first error otherwise
+ */
+int ioq_run(struct ioq *q, struct ioq_req *reqs, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,385 @@
+/**
+ * @file itable.c
+ * @brief in-core inode table (like inode[NINODE] of UNIX v6)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "itable.h"
+#include "mount.h"
+#include "sector.h"
+#include "error.h"
+
+/**
+ * @brief allocate a new (empty) inode table
+ * @param size the number of inodes it can hold (>0)
+ * @return a pointer to the new table or NULL on failure
+ */
+struct itable *itable_alloc(size_t size)
+{
+    if (size == 0) {
+        return NULL;
+    }
+
+    struct itable *t = calloc(1, sizeof(struct itable));
+    if (t == NULL) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&t->lock, NULL) != 0) {
+        free(t);
+        return NULL;
+    }
+
+    t->entries = calloc(size, sizeof(struct itable_entry));
+    t->buckets = calloc(size, sizeof(struct itable_entry *));
+    if (t->entries == NULL || t->buckets == NULL) {
+        itable_free(t);
+        return NULL;
+    }
+
+    // The lock of an entry lives as long as the table: slots are recycled, not freed.
+    for (; t->size < size; ++t->size) {
+        if (pthread_rwlock_init(&t->entries[t->size].lock, NULL) != 0) {
+            itable_free(t);
+            return NULL;
+        }
+    }
+
+    return t;
+}
+
+/**
+ * @brief release an inode table (dirty inodes are lost: see itable_sync)
+ * @param t the table
+ */
+void itable_free(struct itable *t)
+{
+    if (t != NULL) {
+        for (size_t i = 0; i < t->size; ++i) {
+            pthread_rwlock_destroy(&t->entries[i].lock);
+        }
+        pthread_mutex_destroy(&t->lock);
+        free(t->entries);
+        free(t->buckets);
+        free(t);
+    }
+}
+
+/**
+ * @brief the sector on disk holding the given inode
+ */
+static uint32_t itable_sector(const struct unix_filesystem *u, uint16_t inr)
+{
+    return (uint32_t) (u->s.s_inode_start + inr / INODES_PER_SECTOR);
+}
+
+/**
+ * @brief write back all the dirty inodes living in the given sector
+ *        (one read-modify-write of the sector)
+ * @param u the filesystem
+ * @param sector an inode sector
+ * @return 0 on success; <0 on error (the lock of the table is held by the caller)
+ */
+static int itable_sync_sector(const struct unix_filesystem *u, uint32_t sector)
+{
+    struct itable *t = u->itable;
+
+    struct inode inodes[INODES_PER_SECTOR];
+    int err = sector_read(u, sector, inodes);
+    if (err != 0) {
+        return err;
+    }
+
+    for (size_t i = 0; i < t->size; ++i) {
+        struct itable_entry *e = &t->entries[i];
+        if (e->inr != 0 && e->dirty && itable_sector(u, e->inr) == sector) {
+            memcpy(&inodes[e->inr % INODES_PER_SECTOR], &e->inode, sizeof(struct inode));
+        }
+    }
+
+    err = sector_write(u, sector, inodes);
+    if (err != 0) {
+        return err;
+    }
+
+    for (size_t i = 0; i < t->size; ++i) {
+        struct itable_entry *e = &t->entries[i];
+        if (e->inr != 0 && itable_sector(u, e->inr) == sector) {
+            e->dirty = 0;
+        }
+    }
+    t->writebacks += 1;
+
+    return 0;
+}
+
+/**
+ * @brief find a slot for a new inode: a free one or else the least
+ *        recently used unreferenced one (written back if dirty)
+ * @param u the filesystem
+ * @param e the slot, removed from the hash table (OUT)
+ * @return 0 on success; <0 on error (the lock of the table is held by the caller)
+ */
+static int itable_victim(const struct unix_filesystem *u, struct itable_entry **e)
+{
+    struct itable *t = u->itable;
+
+    struct itable_entry *victim = NULL;
+    for (size_t i = 0; i < t->size; ++i) {
+        struct itable_entry *c = &t->entries[i];
+        if (c->inr == 0) {
+            victim = c;
+            break;
+        }
+        if (c->count == 0 && (victim == NULL || c->used < victim->used)) {
+            victim = c;
+        }
+    }
+
+    if (victim == NULL) {
+        return ERR_NOMEM;
+    }
+
+    if (victim->inr != 0) {
+        if (victim->dirty) {
+            int err = itable_sync_sector(u, itable_sector(u, victim->inr));
+            if (err != 0) {
+                return err;
+            }
+        }
+
+        struct itable_entry **p = &t->buckets[victim->inr % t->size];
+        while (*p != NULL && *p != victim) {
+            p = &(*p)->hash_next;
+        }
+        if (*p == victim) {
+            *p = victim->hash_next;
+        }
+    }
+
+    // Unreferenced, hence unlocked: the lock of the slot is kept as it is.
+    victim->inr = 0;
+    victim->count = 0;
+    victim->dirty = 0;
+    victim->used = 0;
+    victim->hash_next = NULL;
+    memset(&victim->inode, 0, sizeof(struct inode));
+    *e = victim;
+
+    return 0;
+}
+
+/**
+ * @brief get a referenced in-core inode, reading it from disk if needed
+ *        (allocated or not: it is up to the caller to check i_mode)
+ * @param u the filesystem (u->itable non NULL)
+ * @param inr the inode number
+ * @param e the entry, to be released with itable_put() (OUT)
+ * @return 0 on success; <0 on error
+ */
+int itable_get(const struct unix_filesystem *u, uint16_t inr, struct itable_entry **e)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->itable);
+    M_REQUIRE_NON_NULL(e);
+
+    if (inr < 1) { // 0 marks the free slots, it is never a valid inode anyway.
+        return ERR_BAD_PARAMETER;
+    }
+
+    struct itable *t = u->itable;
+    pthread_mutex_lock(&t->lock);
+    t->tick += 1;
+
+    for (struct itable_entry *p = t->buckets[inr % t->size]; p != NULL; p = p->hash_next) {
+        if (p->inr == inr) {
+            t->hits += 1;
+            p->count += 1;
+            p->used = t->tick;
+            *e = p;
+            pthread_mutex_unlock(&t->lock);
+
+            return 0;
+        }
+    }
+
+    t->misses += 1;
+
+    struct itable_entry *victim = NULL;
+    int err = itable_victim(u, &victim);
+    if (err != 0) {
+        pthread_mutex_unlock(&t->lock);
+        return err;
+    }
+
+    const uint32_t sector = itable_sector(u, inr);
+    const struct inode *inodes = sector_borrow(u, sector);
+    if (inodes != NULL) {
+        memcpy(&victim->inode, &inodes[inr % INODES_PER_SECTOR], sizeof(struct inode));
+    } else {
+        struct inode tempInodes[INODES_PER_SECTOR];
+        err = sector_read(u, sector, tempInodes);
+        if (err != 0) {
+            pthread_mutex_unlock(&t->lock);
+            return err;
+        }
+        memcpy(&victim->inode, &tempInodes[inr % INODES_PER_SECTOR], sizeof(struct inode));
+    }
+
+    victim->inr = inr;
+    victim->count = 1;
+    victim->used = t->tick;
+    victim->hash_next = t->buckets[inr % t->size];
+    t->buckets[inr % t->size] = victim;
+    *e = victim;
+    pthread_mutex_unlock(&t->lock);
+
+    return 0;
+}
+
+/**
+ * @brief release a reference taken by itable_get()
+ * @param u the filesystem
+ * @param e the entry
+ */
+void itable_put(const struct unix_filesystem *u, struct itable_entry *e)
+{
+    if (u != NULL && u->itable != NULL && e != NULL) {
+        pthread_mutex_lock(&u->itable->lock);
+        if (e->count > 0) {
+            e->count -= 1;
+        }
+        pthread_mutex_unlock(&u->itable->lock);
+    }
+}
+
+/**
+ * @brief copy out the in-core inode of a referenced entry
+ * @param u the filesystem
+ * @param e the entry
+ * @param inode the copy (OUT)
+ */
+void itable_load(const struct unix_filesystem *u, const struct itable_entry *e, struct inode *inode)
+{
+    pthread_mutex_lock(&u->itable->lock);
+    memcpy(inode, &e->inode, sizeof(struct inode));
+    pthread_mutex_unlock(&u->itable->lock);
+}
+
+/**
+ * @brief replace the in-core inode of a referenced entry and mark it dirty
+ * @param u the filesystem
+ * @param e the entry
+ * @param inode the new content (IN)
+ */
+void itable_store(const struct unix_filesystem *u, struct itable_entry *e, const struct inode *inode)
+{
+    pthread_mutex_lock(&u->itable->lock);
+    memcpy(&e->inode, inode, sizeof(struct inode));
+    e->dirty = 1;
+    pthread_mutex_unlock(&u->itable->lock);
+}
+
+/**
+ * @brief get a referenced in-core inode, locked for reading (shared) or for
+ *        writing (exclusive) the content of the file
+ * @param u the filesystem
+ * @param inr the inode number
+ * @param write 1 for an exclusive lock; 0 for a shared one
+ * @param e the entry, to be released with itable_unlock() (OUT)
+ * @return 0 on success; <0 on error
+ */
+int itable_lock(const struct unix_filesystem *u, uint16_t inr, int write, struct itable_entry **e)
+{
+    // The reference keeps the slot (and so its lock) from being recycled.
+    int err = itable_get(u, inr, e);
+    if (err != 0) {
+        return err;
+    }
+
+    if (write) {
+        pthread_rwlock_wrlock(&(*e)->lock);
+    } else {
+        pthread_rwlock_rdlock(&(*e)->lock);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief release a lock and the reference taken by itable_lock()
+ * @param u the filesystem
+ * @param e the entry
+ */
+void itable_unlock(const struct unix_filesystem *u, struct itable_entry *e)
+{
+    if (e != NULL) {
+        pthread_rwlock_unlock(&e->lock);
+        itable_put(u, e);
+    }
+}
+
+/**
+ * @brief write all the dirty in-core inodes to disk, one write per inode sector
+ * @param u the filesystem
+ * @return 0 on success; <0 on error
+ */
+int itable_sync(const struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+
+    struct itable *t = u->itable;
+    if (t == NULL) {
+        return 0;
+    }
+
+    int err = 0;
+    pthread_mutex_lock(&t->lock);
+    for (size_t i = 0; i < t->size; ++i) {
+        struct itable_entry *e = &t->entries[i];
+        // itable_sync_sector() cleans every inode of the sector at once.
+        if (e->inr != 0 && e->dirty) {
+            int feedback = itable_sync_sector(u, itable_sector(u, e->inr));
+            if (feedback != 0) {
+                err = feedback;
+            }
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    return err;
+}
+
+/**
+ * @brief print the counters of an inode table
+ * @param t the table
+ */
+void itable_print(const struct itable *t)
+{
+    printf("**********Inode Table START**********\n");
+
+    if (t != NULL) {
+        size_t used = 0;
+        size_t dirty = 0;
+        for (size_t i = 0; i < t->size; ++i) {
+            used += t->entries[i].inr != 0 ? 1 : 0;
+            dirty += t->entries[i].dirty ? 1 : 0;
+        }
+
+        printf("%-20s: %zu\n", "size", t->size);
+        printf("%-20s: %zu\n", "used", used);
+        printf("%-20s: %zu\n", "dirty", dirty);
+        printf("%-20s: %" PRIu64 "\n", "hits", t->hits);
+        printf("%-20s: %" PRIu64 "\n", "misses", t->misses);
+        printf("%-20s: %" PRIu64 "\n", "writebacks", t->writebacks);
+    } else {
+        printf("NULL ptr");
+    }
+
+    printf("**********Inode Table END************\n");
+
+    fflush(stdout);
+}
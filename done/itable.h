@@ -0,0 +1,122 @@
+#pragma once
+
+/**
+ * @file itable.h
+ * @brief in-core inode table (like inode[NINODE] of UNIX v6): a bounded set
+ *        of inodes kept in memory, with reference counts and dirty flags.
+ */
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+#include <pthread.h>
+#include "unixv6fs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NINODE (128)   // default number of in-core inodes per mount
+
+struct unix_filesystem;
+
+struct itable_entry {
+    uint16_t inr;                     // the inode number; 0 if the slot is free
+    int count;                        // references held through itable_get()
+    int dirty;                        // 1 if inode is newer than the disk
+    uint64_t used;                    // tick of the last use, for LRU replacement
+    struct itable_entry *hash_next;   // next entry in the same hash bucket
+    pthread_rwlock_t lock;            // itable_lock(): readers or one writer of the file
+    struct inode inode;               // the in-core copy of the on-disk inode
+};
+
+struct itable {
+    pthread_mutex_t lock;             // protects the table and the entries but their lock
+    size_t size;
+    uint64_t tick;
+    struct itable_entry *entries;     // the size entries
+    struct itable_entry **buckets;    // size hash buckets, keyed by inode number
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;              // inode sectors written by itable_sync()
+};
+
+/**
+ * @brief allocate a new (empty) inode table
+ * @param size the number of inodes it can hold (>0)
+ * @return a pointer to the new table or NULL on failure
+ */
+struct itable *itable_alloc(size_t size);
+
+/**
+ * @brief release an inode table (dirty inodes are lost: see itable_sync)
+ * @param t the table
+ */
+void itable_free(struct itable *t);
+
+/**
+ * @brief get a referenced in-core inode, reading it from disk if needed
+ *        (allocated or not: it is up to the caller to check i_mode)
+ * @param u the filesystem (u->itable non NULL)
+ * @param inr the inode number
+ * @param e the entry, to be released with itable_put() (OUT)
+ * @return 0 on success; <0 on error
+ */
+int itable_get(const struct unix_filesystem *u, uint16_t inr, struct itable_entry **e);
+
+/**
+ * @brief release a reference taken by itable_get()
+ * @param u the filesystem
+ * @param e the entry
+ */
+void itable_put(const struct unix_filesystem *u, struct itable_entry *e);
+
+/**
+ * @brief copy out the in-core inode of a referenced entry
+ * @param u the filesystem
+ * @param e the entry
+ * @param inode the copy (OUT)
+ */
+void itable_load(const struct unix_filesystem *u, const struct itable_entry *e, struct inode *inode);
+
+/**
+ * @brief replace the in-core inode of a referenced entry and mark it dirty
+ * @param u the filesystem
+ * @param e the entry
+ * @param inode the new content (IN)
+ */
+void itable_store(const struct unix_filesystem *u, struct itable_entry *e, const struct inode *inode);
+
+/**
+ * @brief get a referenced in-core inode, locked for reading (shared) or for
+ *        writing (exclusive) the content of the file
+ * @param u the filesystem
+ * @param inr the inode number
+ * @param write 1 for an exclusive lock; 0 for a shared one
+ * @param e the entry, to be released with itable_unlock() (OUT)
+ * @return 0 on success; <0 on error
+ */
+int itable_lock(const struct unix_filesystem *u, uint16_t inr, int write, struct itable_entry **e);
+
+/**
+ * @brief release a lock and the reference taken by itable_lock()
+ * @param u the filesystem
+ * @param e the entry
+ */
+void itable_unlock(const struct unix_filesystem *u, struct itable_entry *e);
+
+/**
+ * @brief write all the dirty in-core inodes to disk, one write per inode sector
+ * @param u the filesystem
+ * @return 0 on success; <0 on error
+ */
+int itable_sync(const struct unix_filesystem *u);
+
+/**
+ * @brief print the counters of an inode table
+ * @param t the table
+ */
+void itable_print(const struct itable *t);
+
+#ifdef __cplusplus
+}
+#endif
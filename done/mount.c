@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "mount.h"
 #include "error.h"
 #include "sector.h"
@@ -11,11 +13,149 @@
 #define BYTE_SIZE (8)
 #define NAMES_LENGTH (14)
 #define ONE_BYTE (1)
+#define BITS_PER_SECTOR (SECTOR_SIZE * BYTE_SIZE)
+#define REBUILD_MAX_THREADS (8)
+#define REBUILD_CHUNK (32)          // inode sectors read at once by a worker of the rebuild
+#define REBUILD_RUN (16)            // indirect sectors read at once by a worker of the rebuild
+#define IBM_FIRST (ROOT_INUMBER + 1) // the first inode of the ibm: the root directory is never freed
 
 /**
- * @brief  mount a unix v6 filesystem
+ * @brief whether the superblock has regions large enough for the bitmaps of u
+ */
+static int mountv6_has_bitmaps(const struct unix_filesystem *u)
+{
+    return u->fbm != NULL && u->ibm != NULL
+           && u->s.s_fbm_start > SUPERBLOCK_SECTOR && u->s.s_ibm_start > SUPERBLOCK_SECTOR
+           && bm_bytes(u->fbm) <= (size_t) u->s.s_fbmsize * SECTOR_SIZE
+           && bm_bytes(u->ibm) <= (size_t) u->s.s_ibmsize * SECTOR_SIZE;
+}
+
+/**
+ * @brief load a bitmap from its region on disk
+ * @param u the filesystem
+ * @param bm the bitmap
+ * @param start the first sector of its region
+ * @return 0 on success; <0 on error
+ */
+static int mountv6_load_bitmap(struct unix_filesystem *u, struct bmblock_array *bm, uint16_t start)
+{
+    const uint32_t sectors = (uint32_t) ((bm_bytes(bm) + SECTOR_SIZE - 1) / SECTOR_SIZE);
+    uint8_t *buf = malloc((size_t) sectors * SECTOR_SIZE);
+    if (buf == NULL) {
+        return ERR_NOMEM;
+    }
+
+    int err = sector_read_run(u, start, sectors, buf);
+    if (err == 0) {
+        bm_import(bm, buf);
+    }
+    free(buf);
+
+    return err;
+}
+
+/**
+ * @brief save a bitmap in its region on disk
+ * @param u the filesystem
+ * @param bm the bitmap
+ * @param start the first sector of its region
+ * @return 0 on success; <0 on error
+ */
+static int mountv6_store_bitmap(struct unix_filesystem *u, struct bmblock_array *bm, uint16_t start)
+{
+    const uint32_t sectors = (uint32_t) ((bm_bytes(bm) + SECTOR_SIZE - 1) / SECTOR_SIZE);
+    uint8_t *buf = calloc(sectors, SECTOR_SIZE);
+    if (buf == NULL) {
+        return ERR_NOMEM;
+    }
+
+    bm_export(bm, buf);
+
+    int err = 0;
+    for (uint32_t i = 0; i < sectors && err == 0; ++i) {
+        err = sector_write(u, start + i, buf + (size_t) i * SECTOR_SIZE);
+    }
+    free(buf);
+
+    return err;
+}
+
+/**
+ * @brief build u->fbm and u->ibm: loaded from disk after a clean umount,
+ *        rebuilt from the inodes otherwise; then the superblock is marked dirty
+ * @param u the filesystem, u->bitmaps_lock held
+ * @return 0 on success; <0 on error (u->fbm and u->ibm stay NULL)
+ */
+static int mountv6_build_bitmaps(struct unix_filesystem *u)
+{
+    struct bmblock_array *fbm = bm_alloc((uint64_t) u->s.s_block_start + 1, (uint64_t) (u->s.s_fsize - 1));
+    struct bmblock_array *ibm = bm_alloc(IBM_FIRST, (uint64_t) (u->s.s_isize * INODES_PER_SECTOR - 1));
+    if (fbm == NULL || ibm == NULL) {
+        bm_free(fbm);
+        bm_free(ibm);
+
+        return ERR_BAD_PARAMETER;
+    }
+    u->fbm = fbm;
+    u->ibm = ibm;
+
+    int loaded = 0;
+    if (mountv6_has_bitmaps(u) && u->s.s_fmod == SUPERBLOCK_BITMAPS_CLEAN) {
+        loaded = mountv6_load_bitmap(u, u->fbm, u->s.s_fbm_start) == 0
+                 && mountv6_load_bitmap(u, u->ibm, u->s.s_ibm_start) == 0;
+    }
+
+    int err = 0;
+    if (!loaded) {
+        err = fill_bitmaps(u);
+    }
+
+    if (err == 0 && mountv6_has_bitmaps(u)) {
+        // Until umountv6() saves them, the bitmaps on disk may get out of date:
+        // this shall reach the disk before anything else does.
+        u->s.s_fmod = SUPERBLOCK_BITMAPS_DIRTY;
+        err = sector_dev_write(u, SUPERBLOCK_SECTOR, &u->s);
+    }
+
+    if (err != 0) {
+        bm_free(u->fbm);
+        u->fbm = NULL;
+        bm_free(u->ibm);
+        u->ibm = NULL;
+    }
+
+    return err;
+}
+
+/**
+ * @brief make sure u->fbm and u->ibm are built (see mountv6()); to be called
+ *        before anything allocates, frees or writes
+ * @param u the mounted filesystem
+ * @return 0 on success; ERR_READ_ONLY if u->readonly; <0 on other errors
+ */
+int mountv6_bitmaps(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+
+    if (u->readonly) {
+        return ERR_READ_ONLY;
+    }
+
+    int err = 0;
+    pthread_mutex_lock(&u->bitmaps_lock);
+    if (u->fbm == NULL || u->ibm == NULL) {
+        err = mountv6_build_bitmaps(u);
+    }
+    pthread_mutex_unlock(&u->bitmaps_lock);
+
+    return err;
+}
+
+/**
+ * @brief  mount a unix v6 filesystem; its bitmaps are only built by the first
+ *         mountv6_bitmaps() (i.e. the first allocation or write), never if u->readonly
  * @param filename name of the unixv6 filesystem on the underlying disk (IN)
- * @param u the filesystem (OUT)
+ * @param u the filesystem; u->backend, u->multithreaded and u->readonly are kept, the rest is overwritten (IN-OUT)
  * @return 0 on success; <0 on error
  */
 int mountv6(const char *filename, struct unix_filesystem *u)
@@ -23,24 +163,31 @@ int mountv6(const char *filename, struct unix_filesystem *u)
     M_REQUIRE_NON_NULL(filename);
     M_REQUIRE_NON_NULL(u);
 
+    const enum sector_backend backend = u->backend;
+    const int multithreaded = u->multithreaded;
+    const int readonly = u->readonly;
     memset(u, 0, sizeof(struct unix_filesystem));
+    u->backend = backend;
+    u->multithreaded = multithreaded;
+    u->readonly = readonly;
+    pthread_mutex_init(&u->bitmaps_lock, NULL);
 
-    u->f = fopen(filename, "r+");
-    if (u->f == NULL) { // Maybe there was just a PATH_TOKEN in the way...
+    int readFeedback = sector_backend_open(u, filename);
+    if (readFeedback != 0) { // Maybe there was just a PATH_TOKEN in the way...
         while (*filename == PATH_TOKEN) {
             filename += 1;
         }
 
         // We retry without the PATH_TOKENs.
-        u->f = fopen(filename, "r+");
-        if (u->f == NULL) { // Here we really have to return an error.
-            return ERR_IO;
+        readFeedback = sector_backend_open(u, filename);
+        if (readFeedback != 0) { // Here we really have to return an error.
+            return readFeedback;
         }
     }
 
     uint8_t temp[SECTOR_SIZE];
 
-    int readFeedback = sector_read(u->f, BOOTBLOCK_SECTOR, temp);
+    readFeedback = sector_read(u, BOOTBLOCK_SECTOR, temp);
     if (readFeedback != 0) {
         umountv6(u);
 
@@ -53,7 +200,7 @@ int mountv6(const char *filename, struct unix_filesystem *u)
         return ERR_BADBOOTSECTOR;
     }
 
-    readFeedback = sector_read(u->f, SUPERBLOCK_SECTOR, temp);
+    readFeedback = sector_read(u, SUPERBLOCK_SECTOR, temp);
     if (readFeedback != 0) {
         umountv6(u);
 
@@ -62,17 +209,16 @@ int mountv6(const char *filename, struct unix_filesystem *u)
 
     memcpy(&u->s, temp, SECTOR_SIZE);
 
-    u->fbm = bm_alloc((uint64_t) u->s.s_block_start + 1, (uint64_t) (u->s.s_fsize - 1));
-    u->ibm = bm_alloc((uint64_t) u->s.s_inode_start, (uint64_t) (u->s.s_isize * INODES_PER_SECTOR - 1));
-    if (u->fbm == NULL || u->ibm == NULL) {
+    u->cache = bcache_alloc(BCACHE_DEFAULT_NBUFS);
+    u->itable = itable_alloc(NINODE);
+    u->dindex = dindex_alloc(DINDEX_DEFAULT_NDIRS);
+    u->dcache = dcache_alloc(DCACHE_DEFAULT_SIZE);
+    if (u->cache == NULL || u->itable == NULL || u->dindex == NULL || u->dcache == NULL) {
         umountv6(u);
 
-        return ERR_BAD_PARAMETER;
+        return ERR_NOMEM;
     }
 
-    fill_fbm(u);
-    fill_ibm(u);
-
     return 0;
 }
 
@@ -108,156 +254,449 @@ void mountv6_print_superblock(const struct unix_filesystem *u)
 }
 
 /**
- * @brief umount the given filesystem
+ * @brief write the in-core inodes and the dirty sectors to the image, and sync
+ *        the backend; with SECTOR_BACKEND_RAM, the image changes only then (the
+ *        superblock still says the bitmaps must be rebuilt by the next mount)
+ * @param u - the mounted filesytem
+ * @return 0 on success; <0 on error
+ */
+int mountv6_sync(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->dev);
+
+    if (u->readonly) {
+        return 0;
+    }
+
+    int err = itable_sync(u);
+    int feedback = bcache_flush(u);
+    if (feedback != 0 && err == 0) {
+        err = feedback;
+    }
+
+    // Only what reached the backend can go to the image.
+    if (err != 0) {
+        return err;
+    }
+
+    return sector_backend_sync(u);
+}
+
+/**
+ * @brief umount the given filesystem; the bitmaps are saved in their regions
+ *        on disk, if any, and the superblock marked clean
+ *        (with SECTOR_BACKEND_RAM, all this and whatever was written since the
+ *        last mountv6_sync() is discarded)
  * @param u - the mounted filesytem
  * @return 0 on success; <0 on error
  */
 int umountv6(struct unix_filesystem *u)
 {
     M_REQUIRE_NON_NULL(u);
-    M_REQUIRE_NON_NULL(u->f);
+    M_REQUIRE_NON_NULL(u->dev);
+
+    dcache_free(u->dcache);
+    u->dcache = NULL;
+    dindex_free(u->dindex);
+    u->dindex = NULL;
+
+    // In-core inodes go to the buffer cache, which goes to the backend.
+    int err = itable_sync(u);
+    itable_free(u->itable);
+    u->itable = NULL;
+
+    // So do the bitmaps, if they were ever built; the superblock is marked
+    // clean once they are all on disk.
+    const int bitmaps = mountv6_has_bitmaps(u);
+    int feedback = 0;
+    if (bitmaps) {
+        feedback = mountv6_store_bitmap(u, u->fbm, u->s.s_fbm_start);
+        if (feedback == 0) {
+            feedback = mountv6_store_bitmap(u, u->ibm, u->s.s_ibm_start);
+        }
+        if (feedback != 0) {
+            err = feedback;
+        }
+    }
 
-    free(u->fbm);
+    bm_free(u->fbm);
     u->fbm = NULL;
-    free(u->ibm);
+    bm_free(u->ibm);
     u->ibm = NULL;
 
-    if (!ferror(u->f) || fclose(u->f) != 0) {
-        return ERR_IO;
+    feedback = bcache_flush(u);
+    if (feedback != 0) {
+        err = feedback;
     }
-    u->f = NULL;
+    bcache_free(u->cache);
+    u->cache = NULL;
 
-    return 0;
+    if (bitmaps && err == 0) {
+        u->s.s_fmod = SUPERBLOCK_BITMAPS_CLEAN;
+        err = sector_dev_write(u, SUPERBLOCK_SECTOR, &u->s);
+    }
+
+    feedback = sector_backend_close(u);
+    if (feedback != 0) {
+        err = feedback;
+    }
+    pthread_mutex_destroy(&u->bitmaps_lock);
+
+    return err;
 }
 
 /**
- * @brief read inodes and fill u bmblock array
- * @param u to fill
+ * @brief one indirect sector to read during the rebuild of the bitmaps
  */
-void fill_ibm(struct unix_filesystem *u)
+struct rebuild_indirect {
+    uint16_t sector;                 // the indirect sector
+    uint16_t entries;                // how many of its addresses are sectors of the file
+};
+
+/**
+ * @brief a worker of the rebuild: a slice of the inode sectors, its own bitmaps
+ */
+struct rebuild_worker {
+    struct unix_filesystem *u;
+    uint32_t first;                  // first inode sector of its slice (0 is s_inode_start)
+    uint32_t count;                  // number of inode sectors in its slice
+    struct bmblock_array *fbm;       // what it found, merged at the end
+    struct bmblock_array *ibm;
+    struct inode inodes[REBUILD_CHUNK * INODES_PER_SECTOR];
+    struct rebuild_indirect indirect[REBUILD_CHUNK * INODES_PER_SECTOR * ADDR_SMALL_LENGTH];
+    uint16_t addr[REBUILD_RUN * ADDRESSES_PER_SECTOR];
+    int err;                         // the first sector it could not read (OUT)
+};
+
+/**
+ * @brief order of the indirect sectors (by sector)
+ */
+static int rebuild_indirect_cmp(const void *a, const void *b)
 {
-    if (u != NULL) {
-        size_t sectStart = u->s.s_inode_start;
-        size_t nbrSect = u->s.s_isize;
+    const struct rebuild_indirect *x = a;
+    const struct rebuild_indirect *y = b;
+
+    return (int) x->sector - (int) y->sector;
+}
 
-        struct inode tempInodes[INODES_PER_SECTOR];
+/**
+ * @brief read a batch of runs of indirect sectors (all in flight together)
+ *        and mark in the fbm of a worker the data sectors they list
+ * @param w the worker
+ * @param runs the runs, read into w->addr
+ * @param first the index in w->indirect of the first sector of each run
+ * @param n the number of runs
+ */
+static void rebuild_indirect_batch(struct rebuild_worker *w, struct ioq_req *runs, const size_t *first, size_t n)
+{
+    sector_read_runs(w->u, runs, n);
 
-        size_t sectCount = 0;
-        while (sectCount < nbrSect) {
-            int readFeedback = sector_read(u->f, (uint32_t) (sectStart + sectCount), tempInodes);
-            for (size_t i = 0; i < INODES_PER_SECTOR; ++i) {
-                if (readFeedback || (tempInodes[i].i_mode & IALLOC)) {
-                    bm_set(u->ibm, (uint64_t) (i + sectCount * INODES_PER_SECTOR));
-                }
+    for (size_t r = 0; r < n; ++r) {
+        if (runs[r].result != 0) {
+            w->err = w->err == 0 ? runs[r].result : w->err;
+            continue;
+        }
+        for (size_t k = 0; k < runs[r].count; ++k) {
+            const uint16_t *addr = (const uint16_t *) runs[r].data + k * ADDRESSES_PER_SECTOR;
+            for (size_t e = 0; e < w->indirect[first[r] + k].entries; ++e) {
+                bm_set(w->fbm, addr[e]);
             }
+        }
+    }
+}
+
+/**
+ * @brief mark in the fbm of a worker the data sectors listed in indirect
+ *        sectors; physically contiguous ones are read at once, and up to
+ *        REBUILD_RUN sectors of such runs in one batch
+ * @param w the worker
+ * @param count the number of indirect sectors in w->indirect
+ */
+static void rebuild_indirect(struct rebuild_worker *w, size_t count)
+{
+    qsort(w->indirect, count, sizeof(struct rebuild_indirect), rebuild_indirect_cmp);
+
+    struct ioq_req runs[REBUILD_RUN];
+    size_t first[REBUILD_RUN];
+    size_t nruns = 0;
+    size_t used = 0;                 // sectors of w->addr the batch uses
+
+    size_t i = 0;
+    while (i < count) {
+        size_t run = 1;
+        while (i + run < count && run < REBUILD_RUN
+               && w->indirect[i + run].sector == w->indirect[i].sector + run) {
+            run += 1;
+        }
 
-            sectCount += 1;
+        if (used + run > REBUILD_RUN) {
+            rebuild_indirect_batch(w, runs, first, nruns);
+            nruns = 0;
+            used = 0;
         }
+
+        memset(&runs[nruns], 0, sizeof(struct ioq_req));
+        runs[nruns].sector = w->indirect[i].sector;
+        runs[nruns].count = (uint32_t) run;
+        runs[nruns].data = &w->addr[used * ADDRESSES_PER_SECTOR];
+        first[nruns] = i;
+        nruns += 1;
+        used += run;
+        i += run;
     }
+
+    rebuild_indirect_batch(w, runs, first, nruns);
 }
 
 /**
- * @brief helper function to fill the fbm
- * @param inr the inode number
- * @param inode pointer to the inode struct to fill
+ * @brief mark in the fbm of a worker an indirect sector, and list it to be
+ *        read (the list is processed first if it is full)
+ * @param w the worker
+ * @param count the number of indirect sectors in w->indirect (IN-OUT)
+ * @param sector the indirect sector
+ * @param left the number of sectors of the file from its first entry on
  */
-void fill_fbm_helper(struct unix_filesystem *u, struct inode* inode, const uint16_t inr)
+static void rebuild_push(struct rebuild_worker *w, size_t *count, uint16_t sector, int32_t left)
 {
-    if (!inode_read(u, inr, inode)) {
-        int sector = 0;
-        int32_t offset = 0;
+    bm_set(w->fbm, sector);
 
-        while ((sector = inode_findsector(u, inode, offset)) > 0) {
-            if (inode_getsize(inode) > SECT_DOWN_LIM) {
+    if (*count == sizeof(w->indirect) / sizeof(w->indirect[0])) {
+        rebuild_indirect(w, *count);
+        *count = 0;
+    }
 
-                // We are using indirect sectors
-                int32_t offsetIAddr = offset / ADDRESSES_PER_SECTOR;
-                if (0 <= offsetIAddr && offsetIAddr < ADDR_SMALL_LENGTH) {
-                    bm_set(u->fbm, inode->i_addr[offsetIAddr]);
-                }
-            }
-            bm_set(u->fbm, (uint64_t) sector);
+    w->indirect[*count].sector = sector;
+    w->indirect[*count].entries = (uint16_t) (left < ADDRESSES_PER_SECTOR ? left : ADDRESSES_PER_SECTOR);
+    *count += 1;
+}
 
-            offset += 1;
+/**
+ * @brief mark in the fbm of a worker the sectors of an IEXTENT inode, a run
+ *        at a time
+ * @param w the worker
+ * @param inode the inode
+ */
+static void rebuild_extents(struct rebuild_worker *w, const struct inode *inode)
+{
+    int32_t count = inode->i_addr[ADDR_EXTENT_COUNT];
+    if (count > EXTENTS_MAX) {
+        count = EXTENTS_MAX;
+    }
+
+    for (int32_t k = 0; k < count && k < EXTENTS_IN_INODE; ++k) {
+        bm_set_range(w->fbm, inode->i_addr[2 * k], inode->i_addr[2 * k + 1]);
+    }
+
+    if (count > EXTENTS_IN_INODE) {
+        bm_set(w->fbm, inode->i_addr[ADDR_EXTENT_BLOCK]);
+
+        uint16_t overflow[ADDRESSES_PER_SECTOR];
+        const int err = sector_read(w->u, inode->i_addr[ADDR_EXTENT_BLOCK], overflow);
+        if (err != 0) {
+            w->err = w->err == 0 ? err : w->err;
+            return;
+        }
+        for (int32_t k = 0; k < count - EXTENTS_IN_INODE; ++k) {
+            bm_set_range(w->fbm, overflow[2 * k], overflow[2 * k + 1]);
         }
     }
 }
 
 /**
- * @brief read sectors and fill u bmblock array
- * @param u to fill
+ * @brief rebuild the part of the bitmaps described by the inodes of a chunk
+ * @param w the worker, its inodes read
+ * @param sector the first inode sector of the chunk (0 is s_inode_start)
+ * @param inodes the number of inodes of the chunk
  */
-void fill_fbm(struct unix_filesystem *u)
+static void rebuild_chunk(struct rebuild_worker *w, uint32_t sector, size_t inodes)
 {
-    if (u != NULL) {
-        struct inode inode;
-        memset(&inode, 0, sizeof(struct inode));
+    size_t indirect = 0;
 
-        // Root not in our ibm bitmap, we're adding sectors used by hand.
-        fill_fbm_helper(u, &inode, ROOT_INUMBER);
+    for (size_t i = 0; i < inodes; ++i) {
+        const uint64_t inr = (uint64_t) sector * INODES_PER_SECTOR + i;
+        const struct inode *inode = &w->inodes[i];
+        if (inr == 0 || !(inode->i_mode & IALLOC)) {
+            continue;
+        }
 
-        memset(&inode, 0, sizeof(struct inode));
-        for (uint64_t j = u->ibm->min; j <= u->ibm->max; ++j) {
-            fill_fbm_helper(u, &inode, (uint16_t) j);
+        bm_set(w->ibm, inr);
 
-            memset(&inode, 0, sizeof(struct inode));
+        const int32_t size = inode_getsize(inode);
+        if (size > SECT_HUGE_LIM) {
+            continue;
+        }
+        if (inode_has_extents(w->u, inode)) {
+            rebuild_extents(w, inode);
+            continue;
+        }
+        const int32_t sectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+        if (size <= SECT_DOWN_LIM) {
+            for (int32_t k = 0; k < sectors && inode->i_addr[k] != 0; ++k) {
+                bm_set(w->fbm, inode->i_addr[k]);
+            }
+        } else {
+            // The indirect sectors of the whole chunk are read together afterwards;
+            // like the readers of the file, we follow every one its size covers.
+            for (int32_t k = 0; k < ADDR_DOUBLE && k * ADDRESSES_PER_SECTOR < sectors; ++k) {
+                rebuild_push(w, &indirect, inode->i_addr[k], sectors - k * ADDRESSES_PER_SECTOR);
+            }
+
+            // Past them, the other indirect sectors are listed in the double indirect one.
+            if (sectors > ADDR_DOUBLE * ADDRESSES_PER_SECTOR) {
+                bm_set(w->fbm, inode->i_addr[ADDR_DOUBLE]);
+
+                uint16_t dind[ADDRESSES_PER_SECTOR];
+                const int err = sector_read(w->u, inode->i_addr[ADDR_DOUBLE], dind);
+                if (err != 0) {
+                    w->err = w->err == 0 ? err : w->err;
+                    continue;
+                }
+                for (int32_t k = ADDR_DOUBLE; k * ADDRESSES_PER_SECTOR < sectors; ++k) {
+                    rebuild_push(w, &indirect, dind[k - ADDR_DOUBLE], sectors - k * ADDRESSES_PER_SECTOR);
+                }
+            }
         }
     }
+
+    rebuild_indirect(w, indirect);
 }
 
 /**
- * @brief create a new filesystem
- * @param num_blocks the total number of blocks (= max size of disk), in sectors
- * @param num_inodes the total number of inodes
- * @return 0 on success, <0 on error
+ * @brief body of a worker: its slice of the inode region, REBUILD_CHUNK sectors
+ *        at a time, until a sector cannot be read (w->err)
+ * @param arg the worker
+ * @return NULL
  */
-int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes)
+static void *rebuild_run(void *arg)
 {
-    M_REQUIRE_NON_NULL(filename);
+    struct rebuild_worker *w = arg;
 
-    // Creation of the superblock.
-    struct superblock s;
-    memset(&s, 0, sizeof(struct superblock));
-    s.s_isize = num_inodes / INODES_PER_SECTOR;
-    if (num_inodes % INODES_PER_SECTOR != 0) {
-        s.s_isize = (uint16_t) (s.s_isize + 1);
+    for (uint32_t s = w->first; s < w->first + w->count && w->err == 0; s += REBUILD_CHUNK) {
+        const uint32_t n = w->first + w->count - s < REBUILD_CHUNK ? w->first + w->count - s : REBUILD_CHUNK;
+
+        w->err = sector_read_run(w->u, w->u->s.s_inode_start + s, n, w->inodes);
+        if (w->err == 0) {
+            rebuild_chunk(w, s, (size_t) n * INODES_PER_SECTOR);
+        }
     }
-    s.s_fsize = num_blocks;
-    s.s_inode_start = SUPERBLOCK_SECTOR + 1;
-    s.s_block_start = (uint16_t) (s.s_inode_start + s.s_isize);
 
-    // Check if the sizes are correct.
-    if (s.s_fsize < s.s_isize + num_inodes) {
-        return ERR_NOT_ENOUGH_BLOCS;
+    return NULL;
+}
+
+/**
+ * @brief rebuild u->fbm and u->ibm from the inodes, in a single pass over the
+ *        inode region split among a few threads
+ * @param u the filesystem, its (empty) bitmaps allocated
+ * @return 0 on success; <0 on error (e.g. an inode or indirect sector that
+ *         cannot be read: the sectors it lists would look free)
+ */
+int fill_bitmaps(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->fbm);
+    M_REQUIRE_NON_NULL(u->ibm);
+
+    const uint32_t sectors = u->s.s_isize;
+
+    // A few chunks per worker at least: threads are not free either.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nworkers = cpus > 0 ? (size_t) cpus : 1;
+    if (nworkers > REBUILD_MAX_THREADS) {
+        nworkers = REBUILD_MAX_THREADS;
+    }
+    if (nworkers > sectors / (2 * REBUILD_CHUNK)) {
+        nworkers = sectors / (2 * REBUILD_CHUNK) > 0 ? sectors / (2 * REBUILD_CHUNK) : 1;
     }
 
-    // Creation of a new binary file that is the new file system.
-    while (*filename == PATH_TOKEN) {
-        filename += 1;
+    struct rebuild_worker *workers = calloc(nworkers, sizeof(struct rebuild_worker));
+    pthread_t threads[REBUILD_MAX_THREADS];
+    int started[REBUILD_MAX_THREADS] = {0};
+    if (workers == NULL) {
+        return ERR_NOMEM;
     }
 
-    FILE* newFileSystem = fopen(filename, "wb");
-    if (newFileSystem == NULL) {
-        return ERR_IO;
+    int err = 0;
+    const uint32_t slice = (sectors + (uint32_t) nworkers - 1) / (uint32_t) nworkers;
+    for (size_t i = 0; i < nworkers && err == 0; ++i) {
+        struct rebuild_worker *w = &workers[i];
+        w->u = u;
+        w->first = (uint32_t) i * slice < sectors ? (uint32_t) i * slice : sectors;
+        w->count = w->first + slice < sectors ? slice : sectors - w->first;
+        w->fbm = bm_alloc(u->fbm->min, u->fbm->max);
+        w->ibm = bm_alloc(u->ibm->min, u->ibm->max);
+        if (w->fbm == NULL || w->ibm == NULL) {
+            err = ERR_NOMEM;
+        }
+    }
+
+    // The first slice is ours; a worker that cannot be started is run by us too.
+    for (size_t i = 1; i < nworkers && err == 0; ++i) {
+        started[i] = pthread_create(&threads[i], NULL, rebuild_run, &workers[i]) == 0;
+    }
+    for (size_t i = 0; i < nworkers && err == 0; ++i) {
+        if (!started[i]) {
+            rebuild_run(&workers[i]);
+        }
     }
 
+    for (size_t i = 0; i < nworkers; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        if (err == 0) {
+            err = workers[i].err;
+        }
+        if (err == 0) {
+            err = bm_merge(u->fbm, workers[i].fbm);
+        }
+        if (err == 0) {
+            err = bm_merge(u->ibm, workers[i].ibm);
+        }
+        bm_free(workers[i].fbm);
+        bm_free(workers[i].ibm);
+    }
+    free(workers);
+
+    return err;
+}
+
+/**
+ * @brief write the sectors of a new filesystem: boot sector, superblock,
+ *        empty bitmaps and inodes (only the root directory allocated)
+ * @param u the new filesystem, not mounted: its device only
+ * @param s its superblock
+ * @return 0 on success, <0 on error
+ */
+static int mountv6_mkfs_write(struct unix_filesystem *u, const struct superblock *s)
+{
     // Bootblock initialization and writing.
     unsigned char tempSector[SECTOR_SIZE];
     memset(tempSector, 0, SECTOR_SIZE);
     tempSector[BOOTBLOCK_MAGIC_NUM_OFFSET] = BOOTBLOCK_MAGIC_NUM;
-    int feedback = sector_write(newFileSystem, BOOTBLOCK_SECTOR, tempSector);
+    int feedback = sector_write(u, BOOTBLOCK_SECTOR, tempSector);
     if (feedback != 0) {
         return feedback;
     }
 
     // Put the superblock created earlier.
     memset(tempSector, 0, SECTOR_SIZE);
-    memcpy(tempSector, &s, sizeof(struct superblock));
-    feedback = sector_write(newFileSystem, SUPERBLOCK_SECTOR, tempSector);
+    memcpy(tempSector, s, sizeof(struct superblock));
+    feedback = sector_write(u, SUPERBLOCK_SECTOR, tempSector);
     if (feedback != 0) {
         return feedback;
     }
 
+    // Empty bitmaps: s_fmod is not SUPERBLOCK_BITMAPS_CLEAN, the first mount rebuilds them.
+    memset(tempSector, 0, SECTOR_SIZE);
+    for (uint32_t block = s->s_fbm_start; block < s->s_inode_start; ++block) {
+        feedback = sector_write(u, block, tempSector);
+        if (feedback != 0) {
+            return feedback;
+        }
+    }
+
     // We write the inode for the ROOT directory.
     struct inode rootInode;
     memset(&rootInode, 0, sizeof(struct inode));
@@ -267,22 +706,73 @@ int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes)
     memset(tempInodes, 0, sizeof(tempInodes));
     memcpy(&tempInodes[ROOT_INUMBER], &rootInode, sizeof(struct inode));
 
-    feedback = sector_write(newFileSystem, s.s_inode_start, tempInodes);
+    feedback = sector_write(u, s->s_inode_start, tempInodes);
     if (feedback != 0) {
         return feedback;
     }
 
     // Fill with empty inodes.
     memset(tempInodes, 0, sizeof(tempInodes));
-    for (uint32_t block = (uint32_t) (s.s_inode_start + 1); block < s.s_inode_start + s.s_isize; ++block) {
-        feedback = sector_write(newFileSystem, block, tempInodes);
+    for (uint32_t block = (uint32_t) (s->s_inode_start + 1); block < s->s_inode_start + s->s_isize; ++block) {
+        feedback = sector_write(u, block, tempInodes);
         if (feedback != 0) {
             return feedback;
         }
     }
 
-    fclose(newFileSystem);
-    newFileSystem = NULL;
-
     return 0;
 }
+
+/**
+ * @brief create a new filesystem
+ * @param num_blocks the total number of blocks (= max size of disk), in sectors
+ * @param num_inodes the total number of inodes
+ * @return 0 on success, <0 on error
+ */
+int mountv6_mkfs(const char *filename, uint16_t num_blocks, uint16_t num_inodes)
+{
+    M_REQUIRE_NON_NULL(filename);
+
+    // Creation of the superblock.
+    struct superblock s;
+    memset(&s, 0, sizeof(struct superblock));
+    s.s_isize = num_inodes / INODES_PER_SECTOR;
+    if (num_inodes % INODES_PER_SECTOR != 0) {
+        s.s_isize = (uint16_t) (s.s_isize + 1);
+    }
+    s.s_fsize = num_blocks;
+
+    // The bitmaps (one bit per sector, one per inode) come first, then the inodes.
+    s.s_fbmsize = (uint16_t) ((num_blocks + BITS_PER_SECTOR - 1) / BITS_PER_SECTOR);
+    s.s_ibmsize = (uint16_t) ((s.s_isize * INODES_PER_SECTOR + BITS_PER_SECTOR - 1) / BITS_PER_SECTOR);
+    s.s_fbm_start = SUPERBLOCK_SECTOR + 1;
+    s.s_ibm_start = (uint16_t) (s.s_fbm_start + s.s_fbmsize);
+    s.s_inode_start = (uint16_t) (s.s_ibm_start + s.s_ibmsize);
+    s.s_block_start = (uint16_t) (s.s_inode_start + s.s_isize);
+    s.s_features = SUPERBLOCK_FEATURE_EXTENTS;
+
+    // Check if the sizes are correct (the bitmaps take sectors too).
+    if (s.s_fsize < (uint32_t) s.s_fbmsize + s.s_ibmsize + s.s_isize + num_inodes) {
+        return ERR_NOT_ENOUGH_BLOCS;
+    }
+
+    // Creation of a new binary file that is the new file system.
+    while (*filename == PATH_TOKEN) {
+        filename += 1;
+    }
+
+    struct blkdev *newFileSystem = blkdev_create(filename);
+    if (newFileSystem == NULL) {
+        return ERR_IO;
+    }
+
+    // Not mounted: the sectors of the new image are written straight to the device.
+    struct unix_filesystem newU;
+    memset(&newU, 0, sizeof(struct unix_filesystem));
+    newU.dev = newFileSystem;
+
+    int err = mountv6_mkfs_write(&newU, &s);
+    const int closed = blkdev_close(newFileSystem);
+
+    return err != 0 ? err : closed;
+}
@@ -9,28 +9,62 @@
  */
 
 #include <stdio.h>
+#include <pthread.h>
 #include "unixv6fs.h"
 #include "bmblock.h"
+#include "sector.h"
+#include "blkdev.h"
+#include "bcache.h"
+#include "itable.h"
+#include "dindex.h"
+#include "dcache.h"
+#include "ioq.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// s_fmod of a filesystem with bitmap regions (s_fbmsize and s_ibmsize > 0):
+#define SUPERBLOCK_BITMAPS_CLEAN (0xB1)  // cleanly unmounted: the bitmaps on disk are up to date
+#define SUPERBLOCK_BITMAPS_DIRTY (1)     // mounted (or crashed): the bitmaps must be rebuilt
+
+// s_features, set by mountv6_mkfs() only:
+#define SUPERBLOCK_FEATURE_EXTENTS (0x0001) // IEXTENT on a file means extents, not ISVTX
+
 struct unix_filesystem {
-    FILE *f;
+    struct blkdev *dev;            /* the image, accessed through its backend */
+    enum sector_backend backend;   /* how sectors are accessed -- set before mountv6 */
+    int multithreaded;             /* 1 if several threads use u -- set before mountv6 */
+    int readonly;                  /* 1 to never write to the image -- set before mountv6 */
+    struct ioq *ioq;               /* batches of requests in flight -- NULL if synchronous (e.g. in memory) */
+    struct bcache *cache;          /* sector buffer cache, flushed on umountv6 */
+    struct itable *itable;         /* in-core inodes, synced on umountv6 */
+    struct dindex *dindex;         /* hash index of the recently looked up directories */
+    struct dcache *dcache;         /* results of the recent path lookups */
     struct superblock s;           /* copy of the superblock */
-    struct bmblock_array *fbm;     /* block bitmmap -- ignore before WEEK 10 */
-    struct bmblock_array *ibm;     /* inode bitmap  -- ignore before WEEK 10 */
+    pthread_mutex_t bitmaps_lock;  /* held while mountv6_bitmaps() builds fbm and ibm */
+    struct bmblock_array *fbm;     /* block bitmmap -- NULL until mountv6_bitmaps() */
+    struct bmblock_array *ibm;     /* inode bitmap  -- NULL until mountv6_bitmaps() */
 };
 
 /**
- * @brief  mount a unix v6 filesystem
+ * @brief  mount a unix v6 filesystem; its bitmaps are only built by the first
+ *         mountv6_bitmaps() (i.e. the first allocation or write), never if u->readonly
  * @param filename name of the unixv6 filesystem on the underlying disk (IN)
- * @param u the filesystem (OUT)
+ * @param u the filesystem; u->backend, u->multithreaded and u->readonly are kept, the rest is overwritten (IN-OUT)
  * @return 0 on success; <0 on error
  */
 int mountv6(const char *filename, struct unix_filesystem *u);
 
+/**
+ * @brief make sure u->fbm and u->ibm are built: loaded from disk after a clean
+ *        umount, rebuilt from the inodes otherwise; to be called before
+ *        anything allocates, frees or writes
+ * @param u the mounted filesystem
+ * @return 0 on success; ERR_READ_ONLY if u->readonly; <0 on other errors
+ */
+int mountv6_bitmaps(struct unix_filesystem *u);
+
 /**
  * @brief print to stdout the content of the superblock
  * @param u - the mounted filesytem
@@ -38,26 +72,35 @@ int mountv6(const char *filename, struct unix_filesystem *u);
 void mountv6_print_superblock(const struct unix_filesystem *u);
 
 /**
- * @brief umount the given filesystem
+ * @brief write the in-core inodes and the dirty sectors to the image, and sync
+ *        the backend; with SECTOR_BACKEND_RAM, the image changes only then (the
+ *        superblock still says the bitmaps must be rebuilt by the next mount)
  * @param u - the mounted filesytem
  * @return 0 on success; <0 on error
  */
-int umountv6(struct unix_filesystem *u);
+int mountv6_sync(struct unix_filesystem *u);
 
 /**
- * @brief read inodes and fill u bmblock array
- * @param u to fill
+ * @brief umount the given filesystem; the bitmaps, if they were built, are
+ *        saved in their regions on disk, if any, and the superblock marked clean
+ *        (with SECTOR_BACKEND_RAM, all this and whatever was written since the
+ *        last mountv6_sync() is discarded)
+ * @param u - the mounted filesytem
+ * @return 0 on success; <0 on error
  */
-void fill_ibm(struct unix_filesystem * u);
+int umountv6(struct unix_filesystem *u);
 
 /**
- * @brief read sectors and fill u bmblock array
- * @param u to fill
+ * @brief rebuild u->fbm and u->ibm from the inodes, in a single pass over the
+ *        inode region split among a few threads
+ * @param u the filesystem, its (empty) bitmaps allocated
+ * @return 0 on success; <0 on error (e.g. an inode or indirect sector that
+ *         cannot be read: the sectors it lists would look free)
  */
-void fill_fbm(struct unix_filesystem * u);
+int fill_bitmaps(struct unix_filesystem *u);
 
 /**
- * @brief create a new filesystem
+ * @brief create a new filesystem, with regions for the bitmaps
  * @param num_blocks the total number of blocks (= max size of disk), in sectors
  * @param num_inodes the total number of inodes
  * @return 0 on success, <0 on error
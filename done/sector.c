@@ -1,48 +1,458 @@
 #include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
 #include "error.h"
 #include "sector.h"
+#include "mount.h"
+#include "blkdev.h"
+#include "bcache.h"
+#include "ioq.h"
 #include "unixv6fs.h"
-#include <errno.h>
 
 #define SECTORS_TO_READ (1)
 #define SECTORS_TO_WRITE (1)
+#define SECTOR_BATCH (IOQ_DEFAULT_DEPTH) // uncached pieces read by one batch
 
 /**
  * @brief read one 512-byte sector from the virtual disk
- * @param f open file of the virtual disk
+ * @param u the filesystem (its buffer cache or block device)
  * @param sector the location (in sector units, not bytes) within the virtual disk
  * @param data a pointer to 512-bytes of memory (OUT)
  * @return 0 on success; <0 on error
  */
-int sector_read(FILE *f, uint32_t sector, void *data)
+int sector_read(const struct unix_filesystem *u, uint32_t sector, void *data)
 {
-    M_REQUIRE_NON_NULL(f);
-    M_REQUIRE_NON_NULL(data);
+    M_REQUIRE_NON_NULL(u);
 
-    if ((ferror(f) == 0) && (fseek(f, SECTOR_SIZE * sector, SEEK_SET) == 0)
-            && fread(data, SECTOR_SIZE , SECTORS_TO_READ, f) == SECTORS_TO_READ) {
-        return 0;
+    if (u->cache != NULL) {
+        return bcache_read(u, sector, data);
     }
 
-    return ERR_IO;
+    return sector_dev_read(u, sector, data);
 }
 
 /**
  * @brief write one 512-byte sector to the virtual disk
- * @param f open file of the virtual disk
+ * @param u the filesystem (its buffer cache or block device)
  * @param sector the location (in sector units, not bytes) within the virtual disk
  * @param data a pointer to 512-bytes of memory (IN)
  * @return 0 on success; <0 on error
  */
-int sector_write(FILE *f, uint32_t sector, const void *data)
+int sector_write(const struct unix_filesystem *u, uint32_t sector, const void *data)
+{
+    M_REQUIRE_NON_NULL(u);
+
+    if (u->readonly) {
+        return ERR_READ_ONLY;
+    }
+
+    if (u->cache != NULL) {
+        return bcache_write(u, sector, data);
+    }
+
+    return sector_dev_write(u, sector, data);
+}
+
+/**
+ * @brief read count consecutive sectors from the virtual disk into one buffer;
+ *        sectors not in the buffer cache are read in as few requests as possible
+ *        (and are not added to the cache)
+ * @param u the filesystem
+ * @param sector the location of the first sector within the virtual disk
+ * @param count the number of sectors
+ * @param data a pointer to count * 512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_read_run(const struct unix_filesystem *u, uint32_t sector, uint32_t count, void *data)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(data);
+
+    struct ioq_req run;
+    memset(&run, 0, sizeof(struct ioq_req));
+    run.sector = sector;
+    run.count = count;
+    run.data = data;
+
+    return sector_read_runs(u, &run, 1);
+}
+
+/**
+ * @brief read a batch of pieces of runs, and report their errors to the runs
+ * @param u the filesystem
+ * @param gaps the pieces
+ * @param owner the index in runs of the run of each piece
+ * @param n the number of pieces
+ * @param runs the runs (IN-OUT; result set on error)
+ * @return 0 on success; the first error otherwise
+ */
+static int sector_read_gaps(const struct unix_filesystem *u, struct ioq_req *gaps, const size_t *owner,
+                            size_t n, struct ioq_req *runs)
+{
+    int err = sector_dev_batch(u, gaps, n);
+    for (size_t g = 0; g < n; ++g) {
+        if (gaps[g].result != 0) {
+            runs[owner[g]].result = gaps[g].result;
+        }
+    }
+
+    return err;
+}
+
+/**
+ * @brief read several runs of consecutive sectors, as sector_read_run() does,
+ *        with the pieces missing from the buffer cache in flight together
+ * @param u the filesystem
+ * @param runs the runs to read (sector, count, data); their result is set (IN-OUT)
+ * @param n the number of runs
+ * @return 0 if they were all read; the first error otherwise
+ */
+int sector_read_runs(const struct unix_filesystem *u, struct ioq_req *runs, size_t n)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(runs);
+
+    struct ioq_req gaps[SECTOR_BATCH];
+    size_t owner[SECTOR_BATCH];         // the run of each gap
+    size_t ngaps = 0;
+    int err = 0;
+
+    for (size_t r = 0; r < n; ++r) {
+        uint8_t *out = runs[r].data;
+        const uint32_t sector = runs[r].sector;
+        const uint32_t count = runs[r].count;
+        runs[r].result = 0;
+
+        uint32_t i = 0;
+        while (i < count) {
+            // A cached copy may be newer than the disk: it wins.
+            if (bcache_peek(u->cache, sector + i, out + (size_t) i * SECTOR_SIZE)) {
+                i += 1;
+                continue;
+            }
+
+            uint32_t j = i + 1;
+            while (j < count && !bcache_peek(u->cache, sector + j, NULL)) {
+                j += 1;
+            }
+
+            if (ngaps == SECTOR_BATCH) {
+                int feedback = sector_read_gaps(u, gaps, owner, ngaps, runs);
+                err = err != 0 ? err : feedback;
+                ngaps = 0;
+            }
+
+            memset(&gaps[ngaps], 0, sizeof(struct ioq_req));
+            gaps[ngaps].sector = sector + i;
+            gaps[ngaps].count = j - i;
+            gaps[ngaps].data = out + (size_t) i * SECTOR_SIZE;
+            owner[ngaps] = r;
+            ngaps += 1;
+            i = j;
+        }
+    }
+
+    if (ngaps > 0) {
+        int feedback = sector_read_gaps(u, gaps, owner, ngaps, runs);
+        err = err != 0 ? err : feedback;
+    }
+
+    return err;
+}
+
+/**
+ * @brief write count consecutive sectors from one buffer to the virtual disk
+ *        in one request; the copies in the buffer cache, if any, are updated
+ *        (no sector is added to the cache)
+ * @param u the filesystem
+ * @param sector the location of the first sector within the virtual disk
+ * @param count the number of sectors
+ * @param data a pointer to count * 512 bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sector_write_run(const struct unix_filesystem *u, uint32_t sector, uint32_t count, const void *data)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(data);
+
+    if (u->readonly) {
+        return ERR_READ_ONLY;
+    }
+
+    // The cached copies are replaced first: an older dirty one shall never
+    // be written back over what we write.
+    const uint8_t *in = data;
+    for (uint32_t i = 0; i < count; ++i) {
+        bcache_update(u->cache, sector + i, in + (size_t) i * SECTOR_SIZE);
+    }
+
+    return sector_dev_write_run(u, sector, count, data);
+}
+
+/**
+ * @brief hint that count consecutive sectors will be read soon: those not
+ *        cached yet are read ahead into the buffer cache (if any)
+ * @param u the filesystem
+ * @param sector the location of the first sector within the virtual disk
+ * @param count the number of sectors
+ * @return 0 on success; <0 on error
+ */
+int sector_prefetch(const struct unix_filesystem *u, uint32_t sector, uint32_t count)
+{
+    M_REQUIRE_NON_NULL(u);
+
+    if (u->cache == NULL || count == 0) {
+        return 0;
+    }
+
+    return bcache_prefetch(u, sector, count);
+}
+
+/**
+ * @brief read one 512-byte sector from the backend, bypassing the buffer cache
+ * @param u the filesystem (its block device)
+ * @param sector the location (in sector units, not bytes) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_dev_read(const struct unix_filesystem *u, uint32_t sector, void *data)
+{
+    return sector_dev_read_run(u, sector, SECTORS_TO_READ, data);
+}
+
+/**
+ * @brief read count consecutive sectors from the backend, bypassing the buffer cache
+ * @param u the filesystem (its block device)
+ * @param sector the location of the first sector within the virtual disk
+ * @param count the number of sectors
+ * @param data a pointer to count * 512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_dev_read_run(const struct unix_filesystem *u, uint32_t sector, uint32_t count, void *data)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->dev);
+    M_REQUIRE_NON_NULL(data);
+
+    if (count == 0) {
+        return 0;
+    }
+
+    return u->dev->ops->read(u->dev, sector, count, data);
+}
+
+/**
+ * @brief write count consecutive sectors to the backend, bypassing the buffer cache
+ * @param u the filesystem (its block device)
+ * @param sector the location of the first sector within the virtual disk
+ * @param count the number of sectors
+ * @param data a pointer to count * 512 bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sector_dev_write_run(const struct unix_filesystem *u, uint32_t sector, uint32_t count, const void *data)
 {
-    M_REQUIRE_NON_NULL(f);
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->dev);
     M_REQUIRE_NON_NULL(data);
 
-    if ((ferror(f) == 0) && (fseek(f, SECTOR_SIZE * sector, SEEK_SET) == 0)
-            && fwrite(data, SECTOR_SIZE , SECTORS_TO_WRITE, f) == SECTORS_TO_WRITE) {
+    if (u->readonly) {
+        return ERR_READ_ONLY;
+    }
+
+    if (count == 0) {
         return 0;
     }
 
-    return ERR_IO;
+    return u->dev->ops->write(u->dev, sector, count, data);
+}
+
+/**
+ * @brief write one 512-byte sector to the backend, bypassing the buffer cache
+ * @param u the filesystem (its block device)
+ * @param sector the location (in sector units, not bytes) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sector_dev_write(const struct unix_filesystem *u, uint32_t sector, const void *data)
+{
+    return sector_dev_write_run(u, sector, SECTORS_TO_WRITE, data);
+}
+
+/**
+ * @brief read consecutive sectors from the backend into several buffers,
+ *        bypassing the buffer cache
+ * @param u the filesystem (its block device)
+ * @param sector the location of the first sector within the virtual disk
+ * @param iov the buffers, each of a whole number of sectors (OUT)
+ * @param iovcnt the number of buffers
+ * @return 0 on success; <0 on error
+ */
+int sector_dev_readv(const struct unix_filesystem *u, uint32_t sector, const struct iovec *iov, int iovcnt)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->dev);
+    M_REQUIRE_NON_NULL(iov);
+
+    return u->dev->ops->readv(u->dev, sector, iov, iovcnt);
+}
+
+/**
+ * @brief write consecutive sectors to the backend from several buffers,
+ *        bypassing the buffer cache
+ * @param u the filesystem (its block device)
+ * @param sector the location of the first sector within the virtual disk
+ * @param iov the buffers, each of a whole number of sectors (IN)
+ * @param iovcnt the number of buffers
+ * @return 0 on success; <0 on error
+ */
+int sector_dev_writev(const struct unix_filesystem *u, uint32_t sector, const struct iovec *iov, int iovcnt)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->dev);
+    M_REQUIRE_NON_NULL(iov);
+
+    if (u->readonly) {
+        return ERR_READ_ONLY;
+    }
+
+    return u->dev->ops->writev(u->dev, sector, iov, iovcnt);
+}
+
+/**
+ * @brief carry out one request of a batch synchronously
+ * @param u the filesystem (its block device)
+ * @param r the request; its result is set (IN-OUT)
+ * @return the result of the request
+ */
+int sector_dev_do(const struct unix_filesystem *u, struct ioq_req *r)
+{
+    M_REQUIRE_NON_NULL(r);
+
+    if (r->iov != NULL) {
+        r->result = r->write ? sector_dev_writev(u, r->sector, r->iov, r->iovcnt)
+                    : sector_dev_readv(u, r->sector, r->iov, r->iovcnt);
+    } else {
+        r->result = r->write ? sector_dev_write_run(u, r->sector, r->count, r->data)
+                    : sector_dev_read_run(u, r->sector, r->count, r->data);
+    }
+
+    return r->result;
+}
+
+/**
+ * @brief carry out a batch of requests on the backend, bypassing the buffer
+ *        cache; they are all in flight at once through u->ioq, if any
+ * @param u the filesystem (its block device)
+ * @param reqs the requests; their result is set (IN-OUT)
+ * @param n the number of requests
+ * @return 0 if they all succeeded; the first error otherwise
+ */
+int sector_dev_batch(const struct unix_filesystem *u, struct ioq_req *reqs, size_t n)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(reqs);
+
+    if (u->ioq != NULL && n > 1) {
+        return ioq_run(u->ioq, reqs, n);
+    }
+
+    // One request at a time: nothing would overlap anyway.
+    int err = 0;
+    for (size_t i = 0; i < n; ++i) {
+        int feedback = sector_dev_do(u, &reqs[i]);
+        if (feedback != 0 && err == 0) {
+            err = feedback;
+        }
+    }
+
+    return err;
+}
+
+/**
+ * @brief zero-copy access to one sector, from the buffer cache or a block
+ *        device holding the image in memory
+ * @param u the filesystem
+ * @param sector the location (in sector units, not bytes) within the virtual disk
+ * @return a pointer to the 512 bytes of the sector, valid until the next
+ *         sector access on u; NULL if unavailable, e.g. when u->multithreaded
+ *         (the caller shall use sector_read())
+ */
+const void *sector_borrow(const struct unix_filesystem *u, uint32_t sector)
+{
+    // Another thread could recycle the buffer of the cache under our feet.
+    if (u == NULL || u->multithreaded) {
+        return NULL;
+    }
+
+    if (u->cache != NULL) {
+        return bcache_borrow(u, sector);
+    }
+
+    if (u->dev == NULL || u->dev->ops->borrow == NULL) {
+        return NULL;
+    }
+
+    return u->dev->ops->borrow(u->dev, sector);
+}
+
+/**
+ * @brief open the image through the backend requested in u->backend, which
+ *        is updated if it falls back to SECTOR_BACKEND_FD
+ * @param u the filesystem; u->dev and u->ioq are set (IN-OUT)
+ * @param filename the image
+ * @return 0 on success; <0 on error
+ */
+int sector_backend_open(struct unix_filesystem *u, const char *filename)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(filename);
+
+    u->ioq = NULL;
+    u->dev = blkdev_open(filename, u->backend, u->readonly);
+    if (u->dev == NULL) {
+        return ERR_IO;
+    }
+    u->backend = u->dev->backend;
+
+    // Batches of requests to the file may overlap; without a queue they still
+    // work, one at a time. In memory, or through O_DIRECT bounces, nothing would.
+    if (u->backend == SECTOR_BACKEND_FD) {
+        u->ioq = ioq_alloc(u, IOQ_DEFAULT_DEPTH);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief write back to the image what the backend still holds in memory
+ *        (the only way the writes to SECTOR_BACKEND_RAM reach the image)
+ * @param u the filesystem
+ * @return 0 on success; <0 on error
+ */
+int sector_backend_sync(const struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+    M_REQUIRE_NON_NULL(u->dev);
+
+    return u->dev->ops->sync(u->dev);
+}
+
+/**
+ * @brief release what sector_backend_open() set up; the writes to
+ *        SECTOR_BACKEND_RAM since the last sector_backend_sync() are discarded
+ * @param u the filesystem (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_backend_close(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+
+    // Whatever is in flight completes before the image goes away.
+    ioq_free(u->ioq);
+    u->ioq = NULL;
+
+    int err = blkdev_close(u->dev);
+    u->dev = NULL;
+
+    return err;
 }
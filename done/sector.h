@@ -8,32 +8,206 @@
  * @date summer 2016
  */
 
+#include <stddef.h> // for size_t
 #include <stdint.h>
-#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct unix_filesystem;
+struct ioq_req;
+struct iovec;
+
+/**
+ * @brief the ways the sectors of a mounted virtual disk can be accessed (the
+ *        backends of its block device, see blkdev.h).
+ *        Chosen by the caller in struct unix_filesystem before mountv6().
+ */
+enum sector_backend {
+    SECTOR_BACKEND_FD = 0,      // pread/pwrite on the image (default)
+    SECTOR_BACKEND_MMAP,        // the whole image is mapped in memory at mount time
+    SECTOR_BACKEND_RAM,         // the whole image is read into memory at mount time; written back only when synced
+    SECTOR_BACKEND_DIRECT       // pread/pwrite with O_DIRECT, bypassing the page cache
+};
+
 // Implemented WEEK 4
 /**
  * @brief read one 512-byte sector from the virtual disk
- * @param f open file of the virtual disk
+ * @param u the filesystem (its buffer cache or block device)
  * @param sector the location (in sector units, not bytes) within the virtual disk
  * @param data a pointer to 512-bytes of memory (OUT)
  * @return 0 on success; <0 on error
  */
-int sector_read(FILE *f, uint32_t sector, void *data);
+int sector_read(const struct unix_filesystem *u, uint32_t sector, void *data);
 
 // Implemented WEEK 11
 /**
  * @brief write one 512-byte sector to the virtual disk
- * @param f open file of the virtual disk
+ * @param u the filesystem (its buffer cache or block device)
  * @param sector the location (in sector units, not bytes) within the virtual disk
  * @param data a pointer to 512-bytes of memory (IN)
  * @return 0 on success; <0 on error
  */
-int sector_write(FILE *f, uint32_t sector, const void *data);
+int sector_write(const struct unix_filesystem *u, uint32_t sector, const void *data);
+
+/**
+ * @brief read count consecutive sectors from the virtual disk into one buffer;
+ *        sectors not in the buffer cache are read in as few requests as possible
+ *        (and are not added to the cache)
+ * @param u the filesystem
+ * @param sector the location of the first sector within the virtual disk
+ * @param count the number of sectors
+ * @param data a pointer to count * 512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_read_run(const struct unix_filesystem *u, uint32_t sector, uint32_t count, void *data);
+
+/**
+ * @brief read several runs of consecutive sectors, as sector_read_run() does,
+ *        with the pieces missing from the buffer cache in flight together
+ * @param u the filesystem
+ * @param runs the runs to read (sector, count, data); their result is set (IN-OUT)
+ * @param n the number of runs
+ * @return 0 if they were all read; the first error otherwise
+ */
+int sector_read_runs(const struct unix_filesystem *u, struct ioq_req *runs, size_t n);
+
+/**
+ * @brief write count consecutive sectors from one buffer to the virtual disk
+ *        in one request; the copies in the buffer cache, if any, are updated
+ *        (no sector is added to the cache)
+ * @param u the filesystem
+ * @param sector the location of the first sector within the virtual disk
+ * @param count the number of sectors
+ * @param data a pointer to count * 512 bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sector_write_run(const struct unix_filesystem *u, uint32_t sector, uint32_t count, const void *data);
+
+/**
+ * @brief hint that count consecutive sectors will be read soon: those not
+ *        cached yet are read ahead into the buffer cache (if any)
+ * @param u the filesystem
+ * @param sector the location of the first sector within the virtual disk
+ * @param count the number of sectors
+ * @return 0 on success; <0 on error
+ */
+int sector_prefetch(const struct unix_filesystem *u, uint32_t sector, uint32_t count);
+
+/**
+ * @brief read one 512-byte sector from the backend, bypassing the buffer cache
+ * @param u the filesystem (its block device)
+ * @param sector the location (in sector units, not bytes) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_dev_read(const struct unix_filesystem *u, uint32_t sector, void *data);
+
+/**
+ * @brief write one 512-byte sector to the backend, bypassing the buffer cache
+ * @param u the filesystem (its block device)
+ * @param sector the location (in sector units, not bytes) within the virtual disk
+ * @param data a pointer to 512-bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sector_dev_write(const struct unix_filesystem *u, uint32_t sector, const void *data);
+
+/**
+ * @brief read count consecutive sectors from the backend, bypassing the buffer cache
+ * @param u the filesystem (its block device)
+ * @param sector the location of the first sector within the virtual disk
+ * @param count the number of sectors
+ * @param data a pointer to count * 512 bytes of memory (OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_dev_read_run(const struct unix_filesystem *u, uint32_t sector, uint32_t count, void *data);
+
+/**
+ * @brief write count consecutive sectors to the backend, bypassing the buffer cache
+ * @param u the filesystem (its block device)
+ * @param sector the location of the first sector within the virtual disk
+ * @param count the number of sectors
+ * @param data a pointer to count * 512 bytes of memory (IN)
+ * @return 0 on success; <0 on error
+ */
+int sector_dev_write_run(const struct unix_filesystem *u, uint32_t sector, uint32_t count, const void *data);
+
+/**
+ * @brief read consecutive sectors from the backend into several buffers,
+ *        bypassing the buffer cache
+ * @param u the filesystem (its block device)
+ * @param sector the location of the first sector within the virtual disk
+ * @param iov the buffers, each of a whole number of sectors (OUT)
+ * @param iovcnt the number of buffers
+ * @return 0 on success; <0 on error
+ */
+int sector_dev_readv(const struct unix_filesystem *u, uint32_t sector, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief write consecutive sectors to the backend from several buffers,
+ *        bypassing the buffer cache
+ * @param u the filesystem (its block device)
+ * @param sector the location of the first sector within the virtual disk
+ * @param iov the buffers, each of a whole number of sectors (IN)
+ * @param iovcnt the number of buffers
+ * @return 0 on success; <0 on error
+ */
+int sector_dev_writev(const struct unix_filesystem *u, uint32_t sector, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief carry out one request of a batch synchronously
+ * @param u the filesystem (its block device)
+ * @param r the request; its result is set (IN-OUT)
+ * @return the result of the request
+ */
+int sector_dev_do(const struct unix_filesystem *u, struct ioq_req *r);
+
+/**
+ * @brief carry out a batch of requests on the backend, bypassing the buffer
+ *        cache; they are all in flight at once through u->ioq, if any
+ * @param u the filesystem (its block device)
+ * @param reqs the requests; their result is set (IN-OUT)
+ * @param n the number of requests
+ * @return 0 if they all succeeded; the first error otherwise
+ */
+int sector_dev_batch(const struct unix_filesystem *u, struct ioq_req *reqs, size_t n);
+
+/**
+ * @brief zero-copy access to one sector, from the buffer cache or a block
+ *        device holding the image in memory
+ * @param u the filesystem
+ * @param sector the location (in sector units, not bytes) within the virtual disk
+ * @return a pointer to the 512 bytes of the sector, valid until the next
+ *         sector access on u; NULL if unavailable, e.g. when u->multithreaded
+ *         (the caller shall use sector_read())
+ */
+const void *sector_borrow(const struct unix_filesystem *u, uint32_t sector);
+
+/**
+ * @brief open the image through the backend requested in u->backend, which
+ *        is updated if it falls back to SECTOR_BACKEND_FD
+ * @param u the filesystem; u->dev and u->ioq are set (IN-OUT)
+ * @param filename the image
+ * @return 0 on success; <0 on error
+ */
+int sector_backend_open(struct unix_filesystem *u, const char *filename);
+
+/**
+ * @brief write back to the image what the backend still holds in memory
+ *        (the only way the writes to SECTOR_BACKEND_RAM reach the image)
+ * @param u the filesystem
+ * @return 0 on success; <0 on error
+ */
+int sector_backend_sync(const struct unix_filesystem *u);
+
+/**
+ * @brief release what sector_backend_open() set up; the writes to
+ *        SECTOR_BACKEND_RAM since the last sector_backend_sync() are discarded
+ * @param u the filesystem (IN-OUT)
+ * @return 0 on success; <0 on error
+ */
+int sector_backend_close(struct unix_filesystem *u);
 
 #ifdef __cplusplus
 }
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 #include <string.h>
 #include "unixv6fs.h"
 #include "sha.h"
@@ -8,7 +9,7 @@
 #include "error.h"
 #include "filev6.h"
 
-#define ZERO_CONTENT_SHA (0)
+#define SHA_CHUNK (8 * SECTOR_SIZE) // bytes of a file hashed at once
 
 static void sha_to_string(const unsigned char *SHA, char *sha_string)
 {
@@ -55,38 +56,35 @@ void print_sha_inode(struct unix_filesystem *u, struct inode inode, int inr)
                 printf("no SHA for directories.\n");
             } else {
 
-                int32_t inodeSize = inode_getsize(&inode);
-                char content[inodeSize + 1];
-                memset(content, 0, (size_t) (inodeSize + 1));
-
-                if (inodeSize == 0) {
-                    print_sha_from_content((const unsigned char*) content, ZERO_CONTENT_SHA);
-                } else {
-                    content[0] = '\0';
-                    content[inodeSize] = '\0';
-
-                    unsigned char buffer[SECTOR_SIZE + 1];
-                    memset(buffer, 0, SECTOR_SIZE + 1);
-                    buffer[SECTOR_SIZE] = '\0';
-
-                    for (int32_t offset = 0; offset <= inodeSize / SECTOR_SIZE; ++offset) {
-
-                        int sector = inode_findsector(u, &inode, offset);
-                        if (sector < 0) {
-                            return;
-                        }
-                        memset(buffer, 0, SECTOR_SIZE);
+                // The file is hashed as it is read: it may be far larger than the stack.
+                struct filev6 fv6;
+                memset(&fv6, 0, sizeof(struct filev6));
+                if (filev6_open(u, (uint16_t) inr, &fv6) != 0) {
+                    return;
+                }
 
-                        int j = sector_read(u->f, (uint32_t) sector, buffer);
-                        if (j < 0) {
-                            return;
-                        }
+                EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+                if (ctx == NULL || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1) {
+                    EVP_MD_CTX_free(ctx);
+                    return;
+                }
 
-                        strncat(content, (const char*) buffer, strlen((const char*) buffer));
+                unsigned char buffer[SHA_CHUNK];
+                int read = 0;
+                while ((read = filev6_read(&fv6, buffer, SHA_CHUNK)) > 0) {
+                    if (EVP_DigestUpdate(ctx, buffer, (size_t) read) != 1) {
+                        read = ERR_IO;
+                        break;
                     }
+                }
 
-                    print_sha_from_content((const unsigned char*) content, strlen((const char*) content));
+                unsigned char hash[SHA256_DIGEST_LENGTH];
+                if (read == 0 && EVP_DigestFinal_ex(ctx, hash, NULL) == 1) {
+                    char shaString[2 * SHA256_DIGEST_LENGTH + 1];
+                    sha_to_string(hash, shaString);
+                    printf("%s\n", shaString);
                 }
+                EVP_MD_CTX_free(ctx);
             }
         }
 
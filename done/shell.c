@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <pthread.h>
 #include "unixv6fs.h"
 #include "mount.h"
 #include "inode.h"
@@ -10,8 +11,12 @@
 #include "error.h"
 #include "sector.h"
 #include "sha.h"
+#include "bcache.h"
+#include "itable.h"
+#include "dindex.h"
+#include "dcache.h"
 
-#define NB_CMD (13)                 // Number of commands available.
+#define NB_CMD (17)                 // Number of commands available.
 #define UNUSED(x) (void)(x)         // Because some functions don't use the void parameter they receive.
 #define MAX_INPUT_LENGTH (255)
 #define MAX_PARAM (3)               // Max number of parameter the user can give.
@@ -23,6 +28,8 @@
 #define ENTER '\n'
 #define NB_START_IN_CHAR (48)
 #define BASE (10)
+#define CAT_BUFFER_SIZE (16 * SECTOR_SIZE)
+#define ADD_CHUNK (128 * SECTOR_SIZE)   // bytes read from the host at once by add (whole sectors)
 
 /**
  * @brief the unix filesystem
@@ -109,6 +116,21 @@ int do_mkfs(const char** array);
  * @return 0 on succes, > 0 SHELL error, < 0 on FS error
  */
 int do_mount(const char** array);
+/**
+ * @brief mount the provided filesystem read-only
+ * @return 0 on succes, > 0 SHELL error, < 0 on FS error
+ */
+int do_romount(const char** array);
+/**
+ * @brief mount the provided filesystem in memory: the writes reach the disk only on sync
+ * @return 0 on succes, > 0 SHELL error, < 0 on FS error
+ */
+int do_rammount(const char** array);
+/**
+ * @brief write what the currently mounted filesystem holds in memory to the disk
+ * @return 0 on succes, > 0 SHELL error, < 0 on FS error
+ */
+int do_sync(const char** array);
 /**
  * @brief create a new directory
  * @return 0 on succes, > 0 SHELL error, < 0 on FS error
@@ -149,6 +171,11 @@ int do_sha(const char** array);
  * @return 0 on succes, > 0 SHELL error, < 0 on FS error
  */
 int do_psb(const char** array);
+/**
+ * @brief print the counters of the caches of the currently mounted filesystem
+ * @return 0 on succes, > 0 SHELL error, < 0 on FS error
+ */
+int do_stats(const char** array);
 
 /// ====================================================================
 /// ====================================================================
@@ -163,6 +190,9 @@ struct shell_map shell_cmds[NB_CMD] = {
     { "quit", do_exit, "exit shell.", 0, ""},
     { "mkfs", do_mkfs, "create a new filesystem.", 3, "<diskname> <#inodes> <#blocks>"},
     { "mount", do_mount, "mount the provided filesystem.", 1, "<diskname>"},
+    { "romount", do_romount, "mount the provided filesystem read-only.", 1, "<diskname>"},
+    { "rammount", do_rammount, "mount the provided filesystem in memory (lost on exit unless synced).", 1, "<diskname>"},
+    { "sync", do_sync, "write the changes to the currently mounted filesystem to the disk.", 0, ""},
     { "mkdir", do_mkdir, "create a new directory.", 1, "<dirname>"},
     { "lsall", do_lsall, "list all directories and files contained in the currently mounted filesystem.", 0, ""},
     { "add", do_add, "add a new file.", 2, "<src-fullpath> <dst>"},
@@ -170,7 +200,8 @@ struct shell_map shell_cmds[NB_CMD] = {
     { "istat", do_istat, "display information about the provided inode.", 1, "<inode_nr>"},
     { "inode", do_inode, "display the inode number of a file.", 1, "<pathname>"},
     { "sha", do_sha, "display the SHA of a file.", 1, "<pathname>"},
-    { "psb", do_psb, "Print SuperBlock of the currently mounted filesystem.", 0, ""}
+    { "psb", do_psb, "Print SuperBlock of the currently mounted filesystem.", 0, ""},
+    { "stats", do_stats, "print the counters of the caches of the currently mounted filesystem.", 0, ""}
 };
 
 /// ====================================================================
@@ -192,7 +223,7 @@ int do_exit(const char** array)
 {
     UNUSED(array);
 
-    if (u.f != NULL) {
+    if (u.dev != NULL) {
         int err = umountv6(&u);
         if (!err) {
             exit(0);
@@ -229,18 +260,57 @@ int do_mount(const char** array)
 {
     M_REQUIRE_NON_NULL(array);
 
-    if (u.f != NULL) {
+    if (u.dev != NULL) {
+        umountv6(&u);
+    }
+
+    u.backend = SECTOR_BACKEND_FD;
+    u.readonly = 0;
+    return mountv6(array[0], &u);
+}
+
+int do_romount(const char** array)
+{
+    M_REQUIRE_NON_NULL(array);
+
+    if (u.dev != NULL) {
         umountv6(&u);
     }
 
+    u.backend = SECTOR_BACKEND_FD;
+    u.readonly = 1;
     return mountv6(array[0], &u);
 }
 
+int do_rammount(const char** array)
+{
+    M_REQUIRE_NON_NULL(array);
+
+    if (u.dev != NULL) {
+        umountv6(&u);
+    }
+
+    u.backend = SECTOR_BACKEND_RAM;
+    u.readonly = 0;
+    return mountv6(array[0], &u);
+}
+
+int do_sync(const char** array)
+{
+    UNUSED(array);
+
+    if (u.dev == NULL) {
+        return ERR_MOUNT;
+    }
+
+    return mountv6_sync(&u);
+}
+
 int do_lsall(const char** array)
 {
     UNUSED(array);
 
-    if (u.f == NULL) {
+    if (u.dev == NULL) {
         return ERR_MOUNT;
     }
 
@@ -251,7 +321,7 @@ int do_psb(const char** array)
 {
     UNUSED(array);
 
-    if (u.f == NULL) {
+    if (u.dev == NULL) {
         return ERR_MOUNT;
     }
 
@@ -260,11 +330,27 @@ int do_psb(const char** array)
     return 0;
 }
 
+int do_stats(const char** array)
+{
+    UNUSED(array);
+
+    if (u.dev == NULL) {
+        return ERR_MOUNT;
+    }
+
+    bcache_print(u.cache);
+    itable_print(u.itable);
+    dindex_print(u.dindex);
+    dcache_print(u.dcache);
+
+    return 0;
+}
+
 int do_cat(const char** array)
 {
     M_REQUIRE_NON_NULL(array);
 
-    if (u.f == NULL) {
+    if (u.dev == NULL) {
         return ERR_MOUNT;
     }
 
@@ -274,43 +360,30 @@ int do_cat(const char** array)
         return inr;
     } else {
 
-        struct inode inode;
+        struct filev6 fv6;
+        memset(&fv6, 0, sizeof(fv6));
 
-        unsigned char buffer[SECTOR_SIZE + 1];
-        buffer[0] = '\0';
-
-        int err = inode_read(&u, (uint16_t)inr, &inode);
+        int err = filev6_open(&u, (uint16_t)inr, &fv6);
         if (err < 0) {
             return err;
         }
 
-        if (inode.i_mode & IALLOC) {
-            if (inode.i_mode & IFDIR) {
-
-                return ERR_DIR_CAT;
-            } else {
-
-                for (int offset = 0; offset < (inode_getsize(&inode) - 1)/ SECTOR_SIZE + 1; ++offset) {
-                    int sector = inode_findsector(&u, &inode, offset);
-                    if (sector < 0) {
-                        return sector;
-                    }
-                    memset(buffer, 0, SECTOR_SIZE);
-
-
-                    int j = sector_read(u.f, (uint32_t) sector, buffer);
-                    if (j < 0) {
-                        return j;
-                    }
-
-                    buffer[SECTOR_SIZE] = '\0';
-                    printf("%s", buffer);
-                }
+        if (fv6.i_node.i_mode & IFDIR) {
+            return ERR_DIR_CAT;
+        }
 
-                printf("\n");
-                fflush(stdout);
-            }
+        // Whole runs of sectors at once rather than one sector per read.
+        unsigned char buffer[CAT_BUFFER_SIZE];
+        int nread = 0;
+        while ((nread = filev6_read(&fv6, buffer, CAT_BUFFER_SIZE)) > 0) {
+            fwrite(buffer, 1, (size_t) nread, stdout);
+        }
+        if (nread < 0) {
+            return nread;
         }
+
+        printf("\n");
+        fflush(stdout);
     }
 
     return 0;
@@ -320,7 +393,7 @@ int do_sha(const char** array)
 {
     M_REQUIRE_NON_NULL(array);
 
-    if (u.f == NULL) {
+    if (u.dev == NULL) {
         return ERR_MOUNT;
     }
 
@@ -345,7 +418,7 @@ int do_inode(const char** array)
 {
     M_REQUIRE_NON_NULL(array);
 
-    if (u.f == NULL) {
+    if (u.dev == NULL) {
         return ERR_MOUNT;
     }
 
@@ -364,7 +437,7 @@ int do_istat(const char** array)
 {
     M_REQUIRE_NON_NULL(array);
 
-    if (u.f == NULL) {
+    if (u.dev == NULL) {
         return ERR_MOUNT;
     }
 
@@ -412,6 +485,123 @@ int do_mkdir(const char** array)
     return 0;
 }
 
+/**
+ * @brief the pipeline of add: a thread reads the host file into one buffer
+ *        while the other writes the previous one into the image
+ **/
+struct add_pipeline {
+    FILE* file;                         // the host file
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                // signaled whenever a buffer is filled or emptied
+    int full[2];                        // buffer i holds data not written yet
+    int last[2];                        // buffer i holds the end of the file
+    size_t len[2];                      // number of bytes in buffer i
+    int read_err;                       // error reading the host file
+    int stop;                           // the writer gave up: the reader shall too
+    unsigned char buf[2][ADD_CHUNK];
+};
+
+/**
+ * @brief read a chunk of the host file into a buffer of the pipeline
+ * @return 1 if it was the end of the file, 0 otherwise
+ **/
+static int add_read_chunk(struct add_pipeline* p, int i)
+{
+    size_t n = fread(p->buf[i], sizeof(char), ADD_CHUNK, p->file);
+
+    p->len[i] = n;
+    if (n < ADD_CHUNK && ferror(p->file)) {
+        p->read_err = ERR_IO;
+    }
+
+    return n < ADD_CHUNK;
+}
+
+/**
+ * @brief body of the reader thread: fill the buffers in turn until the end of the file
+ * @return NULL
+ **/
+static void* add_reader(void* arg)
+{
+    struct add_pipeline* p = arg;
+
+    for (int i = 0, last = 0; !last; i ^= 1) {
+        pthread_mutex_lock(&p->lock);
+        while (p->full[i] && !p->stop) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        const int stop = p->stop;
+        pthread_mutex_unlock(&p->lock);
+        if (stop) {
+            break;
+        }
+
+        // The buffer is ours: the writer does not touch it until it is full.
+        last = add_read_chunk(p, i);
+
+        pthread_mutex_lock(&p->lock);
+        p->last[i] = last;
+        p->full[i] = 1;
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief append the whole host file to a file of the image, ADD_CHUNK bytes at
+ *        a time, the next chunk being read meanwhile by another thread
+ * @return 0 on success, < 0 on FS error
+ **/
+static int add_stream(FILE* file, struct filev6* fv6)
+{
+    struct add_pipeline* p = calloc(1, sizeof(struct add_pipeline));
+    if (p == NULL) {
+        return ERR_NOMEM;
+    }
+    p->file = file;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    pthread_t reader;
+    const int threaded = pthread_create(&reader, NULL, add_reader, p) == 0;
+
+    int err = 0;
+    for (int i = 0, last = 0; !last && err == 0; i ^= 1) {
+        if (threaded) {
+            pthread_mutex_lock(&p->lock);
+            while (!p->full[i]) {
+                pthread_cond_wait(&p->cond, &p->lock);
+            }
+            last = p->last[i];
+            pthread_mutex_unlock(&p->lock);
+        } else { // No second thread: we read each chunk ourselves.
+            last = add_read_chunk(p, i);
+        }
+
+        err = p->read_err;
+        if (err == 0 && p->len[i] > 0) {
+            err = filev6_writebytes(&u, fv6, p->buf[i], (int) p->len[i]);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->full[i] = 0;
+        p->stop = err != 0;
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    if (threaded) {
+        pthread_join(reader, NULL);
+    }
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+
+    return err;
+}
+
 int do_add(const char** array)
 {
     M_REQUIRE_NON_NULL(array);
@@ -442,15 +632,22 @@ int do_add(const char** array)
     }
     rewind(file);
 
-    unsigned char data[sizeOfFile];
-    memset(data, 0, (size_t) sizeOfFile);
+    // The content is streamed: only its size is checked beforehand.
+    if (sizeOfFile > SECT_HUGE_LIM) {
+        fclose(file);
+        file = NULL;
 
-    if (fread(data, sizeof(char), (size_t) sizeOfFile, file) != (size_t) sizeOfFile) {
-        return ERR_IO;
+        return ERR_FILE_TOO_LARGE;
     }
 
-    int inr = direntv6_create(&u, array[1], IALLOC);
+    // Large files are written once, sequentially: they are mapped by extents
+    // (on images that know them).
+    const int extents = sizeOfFile > SECT_DOWN_LIM && (u.s.s_features & SUPERBLOCK_FEATURE_EXTENTS);
+    int inr = direntv6_create(&u, array[1], extents ? IALLOC | IEXTENT : IALLOC);
     if (inr < 0) {
+        fclose(file);
+        file = NULL;
+
         return inr;
     }
 
@@ -464,7 +661,13 @@ int do_add(const char** array)
         return feedback;
     }
 
-    feedback = filev6_writebytes(&u, &fileV6, data, (int) sizeOfFile);
+    // The data is allocated on disk, in as few runs as possible, as the
+    // file is flushed and closed.
+    feedback = add_stream(file, &fileV6);
+    int closed = filev6_close(&u, &fileV6);
+    if (feedback == 0) {
+        feedback = closed;
+    }
     if (feedback != 0) {
         fclose(file);
         file = NULL;
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "mount.h"
+#include "sector.h"
+#include "inode.h"
+#include "filev6.h"
+#include "bcache.h"
+#include "itable.h"
+#include "bmblock.h"
+#include "error.h"
+
+#define PASSES (2)
+#define SMALL_NBUFS (4)               // a cache that a few reads fill up
+
+/**
+ * @brief whether the disk (not the cache) holds the given content of a sector
+ */
+static int on_disk(const struct unix_filesystem *u, uint32_t sector, const uint8_t *data)
+{
+    uint8_t disk[SECTOR_SIZE];
+
+    return sector_dev_read(u, sector, disk) == 0 && memcmp(disk, data, SECTOR_SIZE) == 0;
+}
+
+/**
+ * @brief find a sector the checks may write: free in the fbm (so that a
+ *        crash in the middle damages no file) and within the image
+ * @param u the filesystem
+ * @param sector the sector (OUT)
+ * @param old its content (OUT)
+ * @return 0 on success; <0 on error
+ */
+static int scratch_sector(struct unix_filesystem *u, uint32_t *sector, uint8_t *old)
+{
+    int err = mountv6_bitmaps(u);
+    if (err != 0) {
+        return err;
+    }
+
+    for (uint64_t x = u->fbm->min; x <= u->fbm->max; ++x) {
+        if (bm_get(u->fbm, x) == 0 && sector_read(u, (uint32_t) x, old) == 0) {
+            *sector = (uint32_t) x;
+            return 0;
+        }
+    }
+
+    return ERR_BITMAP_FULL;
+}
+
+/**
+ * @brief write a free sector through the cache, then through a cache so
+ *        small that reading other sectors evicts it (first while the disk
+ *        cannot be written), and check when the new content reaches the
+ *        disk; the sector is restored afterwards
+ * @return 0 if it reached it on bcache_flush() and on eviction, and the
+ *         failed write-back stopped no read; <0 on error
+ */
+static int check_writeback(struct unix_filesystem *u)
+{
+    uint32_t scratch = 0;
+    uint8_t old[SECTOR_SIZE];
+    uint8_t data[SECTOR_SIZE];
+    int err = scratch_sector(u, &scratch, old);
+    if (err == ERR_BITMAP_FULL) {
+        printf("written: skipped, no free sector in the image\n");
+        return 0;
+    } else if (err != 0) {
+        return err;
+    }
+    for (size_t i = 0; i < SECTOR_SIZE; ++i) {
+        data[i] = (uint8_t) ~old[i];
+    }
+
+    err = sector_write(u, scratch, data);
+    const int before = on_disk(u, scratch, data);
+    if (err == 0) {
+        err = bcache_flush(u);
+    }
+    const int flushed = on_disk(u, scratch, data);
+    printf("written: on disk before bcache_flush %s, after %s\n", before ? "yes" : "no", flushed ? "yes" : "no");
+
+    // The cache of the mount is clean again, and left alone meanwhile.
+    struct bcache *cache = u->cache;
+    u->cache = bcache_alloc(SMALL_NBUFS);
+    if (u->cache == NULL) {
+        u->cache = cache;
+        return ERR_NOMEM;
+    }
+
+    // A write-back that fails keeps its buffer dirty, and the other buffers
+    // are still recycled; it is written back once the disk can be written.
+    err = err == 0 ? sector_write(u, scratch, old) : err;
+    uint8_t buf[SECTOR_SIZE];
+    const int readonly = u->readonly;
+    u->readonly = 1;
+    int failed = 0;
+    for (uint32_t sector = 0, n = 0; n < 2 * SMALL_NBUFS && err == 0; ++sector) {
+        if (sector != scratch) {
+            failed += sector_read(u, sector, buf) != 0 ? 1 : 0;
+            n += 1;
+        }
+    }
+    const int kept = bcache_flush(u) != 0 && !on_disk(u, scratch, old);
+    u->readonly = readonly;
+    printf("failed write-back: %d of %d reads failed meanwhile, buffer kept dirty %s\n", failed, 2 * SMALL_NBUFS,
+           kept ? "yes" : "no");
+
+    for (uint32_t sector = 0, n = 0; n < SMALL_NBUFS && err == 0; ++sector) {
+        if (sector != scratch) {
+            err = sector_read(u, sector, buf);
+            n += 1;
+        }
+    }
+    const int evicted = on_disk(u, scratch, old);
+    printf("evicted dirty: written back %s (%" PRIu64 " write-backs)\n", evicted ? "yes" : "no", u->cache->writebacks);
+
+    bcache_free(u->cache);
+    u->cache = cache;
+    bcache_update(u->cache, scratch, old);
+    if (err != 0) {
+        return err;
+    }
+
+    return !before && flushed && failed == 0 && kept && evicted ? 0 : ERR_IO;
+}
+
+/**
+ * @brief read the largest file sector by sector through an empty cache: past
+ *        the first one, readahead shall have brought every sector in before
+ *        it is read
+ * @return 0 if so; <0 on error
+ */
+static int check_readahead(struct unix_filesystem *u)
+{
+    uint16_t largest = 0;
+    int32_t largest_size = 0;
+    struct inode inode;
+    for (uint32_t inr = ROOT_INUMBER; inr < (uint32_t) u->s.s_isize * INODES_PER_SECTOR; ++inr) {
+        if (inode_read(u, (uint16_t) inr, &inode) == 0 && (inode.i_mode & IFMT) != IFDIR
+            && inode_getsize(&inode) > largest_size) {
+            largest = (uint16_t) inr;
+            largest_size = inode_getsize(&inode);
+        }
+    }
+    const int32_t sectors = (largest_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (sectors < 2) {
+        printf("readahead: skipped, no file of 2 sectors\n");
+        return 0;
+    }
+
+    // Where the sectors are, found before the cache is emptied.
+    int err = inode_read(u, largest, &inode);
+    int *where = calloc((size_t) sectors, sizeof(int));
+    if (where == NULL) {
+        return ERR_NOMEM;
+    }
+    for (int32_t k = 0; k < sectors && err == 0; ++k) {
+        where[k] = inode_findsector(u, &inode, k);
+        err = where[k] < 0 ? where[k] : 0;
+    }
+
+    struct bcache *cache = u->cache;
+    u->cache = bcache_alloc(BCACHE_DEFAULT_NBUFS);
+    if (u->cache == NULL) {
+        u->cache = cache;
+        free(where);
+        return ERR_NOMEM;
+    }
+
+    struct filev6 fv6;
+    uint8_t buf[SECTOR_SIZE];
+    err = err == 0 ? filev6_open(u, largest, &fv6) : err;
+    int32_t missing = 0;
+    int read = 1;
+    for (int32_t k = 0; k < sectors && err == 0 && read > 0; ++k) {
+        missing += k > 0 && !bcache_peek(u->cache, (uint32_t) where[k], NULL) ? 1 : 0;
+        read = filev6_readblock(&fv6, buf);
+    }
+    err = err == 0 && read < 0 ? read : err;
+
+    const uint64_t used = u->cache->prefetch_hits;
+    printf("readahead: inode %u, %d sectors: %" PRIu64 " read ahead, %" PRIu64 " of them used, %d not cached in time\n",
+           largest, sectors, u->cache->prefetched, used, missing);
+
+    bcache_free(u->cache);
+    u->cache = cache;
+    free(where);
+    if (err != 0) {
+        return err;
+    }
+
+    return missing == 0 && used > 0 ? 0 : ERR_IO;
+}
+
+/**
+ * @brief whether the disk (not the caches) holds the given content of an inode
+ */
+static int inode_on_disk(const struct unix_filesystem *u, uint16_t inr, const struct inode *inode)
+{
+    struct inode disk[INODES_PER_SECTOR];
+    const uint32_t sector = u->s.s_inode_start + inr / (uint32_t) INODES_PER_SECTOR;
+
+    return sector_dev_read(u, sector, disk) == 0
+           && memcmp(&disk[inr % INODES_PER_SECTOR], inode, sizeof(struct inode)) == 0;
+}
+
+/**
+ * @brief change the in-core root inode, and check that it reaches the disk
+ *        on itable_sync() (and bcache_flush()) only; it is restored afterwards
+ * @return 0 if so; <0 on error
+ */
+static int check_itable(struct unix_filesystem *u)
+{
+    struct itable_entry *e = NULL;
+    int err = itable_get(u, ROOT_INUMBER, &e);
+    if (err != 0) {
+        return err;
+    }
+
+    struct inode old;
+    itable_load(u, e, &old);
+    struct inode changed = old;
+    changed.i_atime[0] = (uint16_t) ~old.i_atime[0];
+    itable_store(u, e, &changed);
+
+    const int dirty = e->dirty;
+    const int before = inode_on_disk(u, ROOT_INUMBER, &changed);
+    const uint64_t writebacks = u->itable->writebacks;
+    err = itable_sync(u);
+    err = err == 0 ? bcache_flush(u) : err;
+    const int synced = inode_on_disk(u, ROOT_INUMBER, &changed) && !e->dirty;
+    printf("inode %u stored: dirty %s, on disk before itable_sync %s, after %s (%" PRIu64 " inode sectors written)\n",
+           ROOT_INUMBER, dirty ? "yes" : "no", before ? "yes" : "no", synced ? "yes" : "no",
+           u->itable->writebacks - writebacks);
+
+    itable_store(u, e, &old);
+    itable_put(u, e);
+    err = err == 0 ? itable_sync(u) : err;
+    err = err == 0 ? bcache_flush(u) : err;
+    if (err != 0) {
+        return err;
+    }
+
+    return dirty && !before && synced ? 0 : ERR_IO;
+}
+
+int test(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+
+    bcache_print(u->cache);
+    itable_print(u->itable);
+
+    // Every inode twice: the second pass shall only hit the cache.
+    struct inode inode;
+    for (int pass = 0; pass < PASSES; ++pass) {
+        for (uint16_t inr = ROOT_INUMBER; inr < u->s.s_isize * INODES_PER_SECTOR; ++inr) {
+            memset(&inode, 0, sizeof(struct inode));
+            inode_read(u, inr, &inode);
+        }
+
+        bcache_print(u->cache);
+        itable_print(u->itable);
+    }
+
+    // Every file, sector by sector: the sequential reads shall be read ahead.
+    uint8_t buf[SECTOR_SIZE];
+    for (uint16_t inr = ROOT_INUMBER; inr < u->s.s_isize * INODES_PER_SECTOR; ++inr) {
+        struct filev6 fv6;
+        if (filev6_open(u, inr, &fv6) == 0 && (fv6.i_node.i_mode & IFMT) != IFDIR) {
+            while (filev6_readblock(&fv6, buf) > 0);
+        }
+    }
+
+    bcache_print(u->cache);
+
+    int err = check_writeback(u);
+    if (err == 0) {
+        err = check_readahead(u);
+    }
+    if (err == 0) {
+        err = check_itable(u);
+    }
+
+    return err;
+}
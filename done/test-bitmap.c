@@ -6,6 +6,7 @@
 #define MAX (131)
 #define INCR_3 (3)
 #define INCR_5 (5)
+#define RUN (40)
 
 int main(void)
 {
@@ -35,7 +36,19 @@ int main(void)
     bm_print(bm);
     printf("find_next() = %d\n", bm_find_next(bm));
 
-    free(bm);
+    printf("find_run(2, 0) = %d\n", bm_find_run(bm, 2, 0));
+    printf("find_run(%d, 0) = %d\n", RUN, bm_find_run(bm, RUN, 0));
+
+    bm_clear_range(bm, MIN + RUN, RUN);
+    bm_print(bm);
+    printf("find_run(%d, 0) = %d\n", RUN, bm_find_run(bm, RUN, 0));
+    printf("find_run(%d, %d) = %d\n", RUN, MAX - RUN, bm_find_run(bm, RUN, MAX - RUN));
+
+    bm_set_range(bm, MIN, MAX - MIN + 1);
+    bm_print(bm);
+    printf("find_run(1, 0) = %d\n", bm_find_run(bm, 1, 0));
+
+    bm_free(bm);
 
     return 0;
 }
@@ -1,14 +1,111 @@
 #include <stdio.h>
+#include <inttypes.h>
 #include "mount.h"
 #include "bmblock.h"
+#include "inode.h"
 #include "error.h"
 
+/**
+ * @brief the number of elements two bitmaps of the same range disagree on
+ */
+static uint64_t bm_diff(struct bmblock_array *a, struct bmblock_array *b)
+{
+    uint64_t diff = 0;
+    for (uint64_t x = a->min; x <= a->max; ++x) {
+        diff += bm_get(a, x) != bm_get(b, x) ? 1 : 0;
+    }
+
+    return diff;
+}
+
+/**
+ * @brief compare the bitmaps of u with bitmaps rebuilt from its inodes
+ * @return 0 if they are the same; <0 on error
+ */
+static int check_rebuild(struct unix_filesystem *u)
+{
+    struct bmblock_array *fbm = u->fbm;
+    struct bmblock_array *ibm = u->ibm;
+    u->fbm = bm_alloc(fbm->min, fbm->max);
+    u->ibm = bm_alloc(ibm->min, ibm->max);
+
+    int err = u->fbm != NULL && u->ibm != NULL ? fill_bitmaps(u) : ERR_NOMEM;
+    if (err == 0) {
+        const uint64_t fdiff = bm_diff(fbm, u->fbm);
+        const uint64_t idiff = bm_diff(ibm, u->ibm);
+        printf("fbm vs rebuild: %" PRIu64 " sectors differ\n", fdiff);
+        printf("ibm vs rebuild: %" PRIu64 " inodes differ\n", idiff);
+        err = fdiff == 0 && idiff == 0 ? 0 : ERR_IO;
+    }
+
+    bm_free(u->fbm);
+    bm_free(u->ibm);
+    u->fbm = fbm;
+    u->ibm = ibm;
+
+    return err;
+}
+
+/**
+ * @brief check the bitmaps of u against the files, walked one inode at a time
+ *        (unlike fill_bitmaps()): every allocated inode and every data sector
+ *        of a file shall be marked, and no other inode (the indirect and
+ *        overflow sectors are left to check_rebuild())
+ * @return 0 if nothing is missing; <0 on error
+ */
+static int check_files(struct unix_filesystem *u)
+{
+    uint64_t sectors = 0;
+    uint64_t inodes = 0;
+    uint64_t extra = 0;
+
+    for (uint32_t inr = ROOT_INUMBER; inr < (uint32_t) u->s.s_isize * INODES_PER_SECTOR; ++inr) {
+        struct inode inode;
+        int err = inode_read(u, (uint16_t) inr, &inode);
+        if (err == ERR_UNALLOCATED_INODE) {
+            extra += bm_get(u->ibm, inr) == 1 ? 1 : 0;
+            continue;
+        } else if (err != 0) {
+            return err;
+        }
+
+        inodes += bm_get(u->ibm, inr) == 0 ? 1 : 0;
+        for (int32_t k = 0; k * SECTOR_SIZE < inode_getsize(&inode); ++k) {
+            const int sector = inode_findsector(u, &inode, k);
+            if (sector < 0) {
+                return sector;
+            }
+            sectors += bm_get(u->fbm, (uint64_t) sector) == 0 ? 1 : 0;
+        }
+    }
+
+    printf("files vs bitmaps: %" PRIu64 " sectors, %" PRIu64 " inodes missing; %" PRIu64 " inodes extra\n",
+           sectors, inodes, extra);
+
+    return sectors == 0 && inodes == 0 && extra == 0 ? 0 : ERR_IO;
+}
+
 int test(struct unix_filesystem *u)
 {
     M_REQUIRE_NON_NULL(u);
 
+    // After a clean umount, the bitmaps on disk are loaded instead of rebuilt.
+    const int clean = u->s.s_fmod == SUPERBLOCK_BITMAPS_CLEAN && u->s.s_fbmsize > 0 && u->s.s_ibmsize > 0;
+
+    int err = mountv6_bitmaps(u);
+    if (err != 0) {
+        return err;
+    }
+
     bm_print(u->fbm);
     bm_print(u->ibm);
 
-    return 0;
+    printf("bitmaps: %s\n", clean ? "loaded from disk" : "rebuilt from the inodes");
+
+    err = check_rebuild(u);
+    if (err == 0) {
+        err = check_files(u);
+    }
+
+    return err;
 }
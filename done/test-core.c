@@ -8,12 +8,16 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "mount.h"
 #include "error.h"
 
 #define MIN_ARGS 1
-#define MAX_ARGS 1
-#define USAGE    "test <diskname>"
+#define MAX_ARGS 2
+#define USAGE    "test <diskname> [fd|mmap|ram|direct]"
+
+// The backends, in the order of enum sector_backend.
+static const char *const BACKENDS[] = { "fd", "mmap", "ram", "direct" };
 
 int test(struct unix_filesystem *u);
 
@@ -42,7 +46,24 @@ int main(int argc, char *argv[])
     check_args(argc - 1);
 
     struct unix_filesystem u = {0};
+    if (argc - 1 == MAX_ARGS) {
+        // A test prints the same through every backend. With the whole disk in
+        // memory ("ram"), it measures the filesystem, not the host, and leaves
+        // the disk as it was.
+        size_t b = 0;
+        while (b < sizeof(BACKENDS) / sizeof(BACKENDS[0]) && strcmp(argv[2], BACKENDS[b]) != 0) {
+            ++b;
+        }
+        if (b == sizeof(BACKENDS) / sizeof(BACKENDS[0])) {
+            error("unknown option:");
+        }
+        u.backend = (enum sector_backend) b;
+    }
+    const enum sector_backend wanted = u.backend;
     int error = mountv6(argv[1], &u);
+    if (error == 0 && u.backend != wanted) {
+        printf("backend %s unavailable: %s instead\n", BACKENDS[wanted], BACKENDS[u.backend]);
+    }
     if (error == 0) {
         mountv6_print_superblock(&u);
         error = test(&u);
@@ -52,8 +73,8 @@ int main(int argc, char *argv[])
         printf("mainerr");
     }
     umountv6(&u); /* shall umount even if mount failed,
-                   * for instance fopen could have succeeded
-                   * in mount (thus fclose required).
+                   * for instance the disk could have been opened
+                   * in mount (thus closed here).
                    */
 
     return error;
@@ -15,11 +15,16 @@ int test(struct unix_filesystem *u)
 {
     M_REQUIRE_NON_NULL(u);
 
+    int err = mountv6_bitmaps(u);
+    if (err != 0) {
+        return err;
+    }
+
     fprintf(stderr, "==================================================================\n");
 
     inode_scan_print(u);
 
-    int err = direntv6_print_tree(u, ROOT_INUMBER, EMPTY_STRING);
+    err = direntv6_print_tree(u, ROOT_INUMBER, EMPTY_STRING);
     if (err < 0) {
         fprintf(stderr, "ERROR: direntv6_print_tree %d\n", err);
     }
@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "mount.h"
+#include "sector.h"
+#include "bcache.h"
+#include "blkdev.h"
+#include "ioq.h"
+#include "error.h"
+
+#define RUN_MAX (8)          // requests of 1 to RUN_MAX sectors, in turn
+#define THREADS (4)          // threads sharing one queue
+#define WRITES (16)          // one-sector requests written back through submit/reap
+#define RUN_LONG (BLKDEV_BOUNCE_SECTORS + 5) // longer than an O_DIRECT transfer
+#define IOV_MAX_TEST (16)    // buffers per vectored transfer
+#define SCRATCH BOOTBLOCK_SECTOR // written by check_sync(), then restored
+
+static const char *const ENGINES[] = { "io_uring", "threads" };
+
+/**
+ * @brief a part of the image read through a queue by one thread
+ */
+struct slice {
+    struct ioq *q;
+    uint32_t first;          // the first sector
+    uint32_t count;          // the number of sectors
+    uint8_t *data;           // count sectors (OUT)
+    int err;                 // what ioq_run() returned (OUT)
+};
+
+/**
+ * @brief the number of whole sectors of the image (s_fsize may be larger)
+ */
+static uint32_t image_sectors(const struct unix_filesystem *u)
+{
+    struct stat st;
+    if (fstat(u->dev->fd, &st) != 0) {
+        return 0;
+    }
+
+    return (uint32_t) (st.st_size / SECTOR_SIZE);
+}
+
+/**
+ * @brief read a slice through its queue, in requests of 1 to RUN_MAX sectors
+ */
+static void *read_slice(void *arg)
+{
+    struct slice *s = arg;
+    struct ioq_req *reqs = calloc(s->count > 0 ? s->count : 1, sizeof(struct ioq_req));
+    if (reqs == NULL) {
+        s->err = ERR_NOMEM;
+        return NULL;
+    }
+
+    size_t n = 0;
+    for (uint32_t done = 0; done < s->count; ++n) {
+        const uint32_t count = 1 + (uint32_t) n % RUN_MAX;
+        reqs[n].sector = s->first + done;
+        reqs[n].count = count < s->count - done ? count : s->count - done;
+        reqs[n].data = s->data + (size_t) done * SECTOR_SIZE;
+        done += reqs[n].count;
+    }
+
+    s->err = ioq_run(s->q, reqs, n);
+    free(reqs);
+
+    return NULL;
+}
+
+/**
+ * @brief the number of sectors of data that differ from what the backend reads
+ */
+static uint32_t compare(const struct unix_filesystem *u, uint32_t first, uint32_t count, const uint8_t *data)
+{
+    uint32_t differ = 0;
+    uint8_t buf[SECTOR_SIZE];
+    for (uint32_t i = 0; i < count; ++i) {
+        if (sector_dev_read(u, first + i, buf) != 0
+            || memcmp(buf, data + (size_t) i * SECTOR_SIZE, SECTOR_SIZE) != 0) {
+            differ += 1;
+        }
+    }
+
+    return differ;
+}
+
+/**
+ * @brief read the image through the backend sector by sector, then in runs
+ *        (into a buffer aligned on no boundary), then through scattered
+ *        buffers, write its first sectors back in one run and through
+ *        scattered buffers, and compare with the first reading
+ * @return 0 if nothing differs; <0 on error
+ */
+static int check_backend(const struct unix_filesystem *u)
+{
+    const uint32_t sectors = image_sectors(u);
+    const size_t bytes = (size_t) (sectors > 0 ? sectors : 1) * SECTOR_SIZE;
+    uint8_t *single = malloc(bytes);
+    uint8_t *other = malloc(bytes + 1);
+    if (single == NULL || other == NULL) {
+        free(single);
+        free(other);
+        return ERR_NOMEM;
+    }
+
+    int err = 0;
+    for (uint32_t s = 0; s < sectors && err == 0; ++s) {
+        err = sector_dev_read(u, s, single + (size_t) s * SECTOR_SIZE);
+    }
+
+    // Runs of 1, 3 and RUN_LONG sectors, in turn.
+    uint8_t *unaligned = other + 1;
+    memset(other, 0, bytes + 1);
+    for (uint32_t s = 0, k = 0; s < sectors && err == 0; ++k) {
+        const uint32_t len = k % 3 == 0 ? 1 : (k % 3 == 1 ? 3 : RUN_LONG);
+        const uint32_t count = len < sectors - s ? len : sectors - s;
+        err = sector_dev_read_run(u, s, count, unaligned + (size_t) s * SECTOR_SIZE);
+        s += count;
+    }
+    const int runs = err == 0 ? memcmp(single, unaligned, bytes) != 0 : 0;
+
+    // The sectors of a transfer into buffers in reverse order.
+    struct iovec iov[IOV_MAX_TEST];
+    memset(other, 0, bytes + 1);
+    int vectored = 0;
+    for (uint32_t s = 0; s < sectors && err == 0; s += IOV_MAX_TEST) {
+        const int count = (int) (sectors - s < IOV_MAX_TEST ? sectors - s : IOV_MAX_TEST);
+        for (int i = 0; i < count; ++i) {
+            iov[i].iov_base = unaligned + (size_t) (count - 1 - i) * SECTOR_SIZE;
+            iov[i].iov_len = SECTOR_SIZE;
+        }
+        err = sector_dev_readv(u, s, iov, count);
+        for (int i = 0; i < count && err == 0; ++i) {
+            vectored |= memcmp(single + (size_t) (s + (uint32_t) i) * SECTOR_SIZE, iov[i].iov_base, SECTOR_SIZE) != 0;
+        }
+    }
+
+    // The first sectors, written back with the content they have.
+    const uint32_t back = sectors < RUN_LONG ? sectors : RUN_LONG;
+    memcpy(unaligned, single, (size_t) back * SECTOR_SIZE);
+    err = err == 0 ? sector_dev_write_run(u, 0, back, unaligned) : err;
+    const int vcount = (int) (back < IOV_MAX_TEST ? back : IOV_MAX_TEST);
+    for (int i = 0; i < vcount; ++i) {
+        iov[i].iov_base = unaligned + (size_t) i * SECTOR_SIZE;
+        iov[i].iov_len = SECTOR_SIZE;
+    }
+    err = err == 0 ? sector_dev_writev(u, 0, iov, vcount) : err;
+    for (uint32_t s = 0; s < back && err == 0; ++s) {
+        err = sector_dev_read(u, s, other + (size_t) s * SECTOR_SIZE);
+    }
+    const int written = err == 0 ? memcmp(single, other, (size_t) back * SECTOR_SIZE) != 0 : 0;
+
+    printf("backend %s: %u sectors; in runs %s, through iovecs %s, written back %s\n", u->dev->ops->name, sectors,
+           runs ? "differ" : "same", vectored ? "differ" : "same", written ? "differ" : "same");
+
+    free(single);
+    free(other);
+    if (err != 0) {
+        return err;
+    }
+
+    return !runs && !vectored && !written ? 0 : ERR_IO;
+}
+
+/**
+ * @brief whether the image file (not the cache, nor the memory of an in-RAM
+ *        mount) holds the given content of a sector
+ */
+static int in_image(const struct unix_filesystem *u, uint32_t sector, const uint8_t *data)
+{
+    // Aligned, for a mount through O_DIRECT.
+    void *buf = NULL;
+    if (posix_memalign(&buf, BLKDEV_DIRECT_ALIGN, BLKDEV_DIRECT_ALIGN) != 0) {
+        return 0;
+    }
+
+    const off_t at = (off_t) (sector * SECTOR_SIZE / BLKDEV_DIRECT_ALIGN * BLKDEV_DIRECT_ALIGN);
+    const int same = pread(u->dev->fd, buf, BLKDEV_DIRECT_ALIGN, at) >= (ssize_t) (sector * SECTOR_SIZE - at + SECTOR_SIZE)
+                     && memcmp((uint8_t *) buf + (sector * SECTOR_SIZE - at), data, SECTOR_SIZE) == 0;
+    free(buf);
+
+    return same;
+}
+
+/**
+ * @brief write a sector through the mount and check that it reaches the image
+ *        on mountv6_sync(), not before; with SECTOR_BACKEND_RAM, not even once
+ *        flushed from the cache; the sector is restored afterwards
+ * @return 0 if so; <0 on error
+ */
+static int check_sync(struct unix_filesystem *u)
+{
+    uint8_t old[SECTOR_SIZE];
+    uint8_t data[SECTOR_SIZE];
+    int err = sector_read(u, SCRATCH, old);
+    if (err != 0) {
+        return err;
+    }
+    for (size_t i = 0; i < SECTOR_SIZE; ++i) {
+        data[i] = (uint8_t) ~old[i];
+    }
+
+    err = sector_write(u, SCRATCH, data);
+    const int before = in_image(u, SCRATCH, data);
+    err = err == 0 ? bcache_flush(u) : err;
+    const int flushed = in_image(u, SCRATCH, data);
+    err = err == 0 ? mountv6_sync(u) : err;
+    const int synced = in_image(u, SCRATCH, data);
+    printf("written: in the image before mountv6_sync %s, after %s\n", before ? "yes" : "no", synced ? "yes" : "no");
+
+    err = err == 0 ? sector_write(u, SCRATCH, old) : err;
+    err = err == 0 ? mountv6_sync(u) : err;
+    const int restored = in_image(u, SCRATCH, old);
+    printf("restored: in the image after mountv6_sync %s\n", restored ? "yes" : "no");
+    if (err != 0) {
+        return err;
+    }
+
+    const int kept = u->backend != SECTOR_BACKEND_RAM || !flushed;
+
+    return !before && kept && synced && restored ? 0 : ERR_IO;
+}
+
+/**
+ * @brief write the first n (at most WRITES) sectors back with the content
+ *        they have, one request each, through ioq_submit() and ioq_reap()
+ * @return the number of requests that failed; <0 on error
+ */
+static int write_back(struct ioq *q, size_t n, uint8_t *data)
+{
+    struct ioq_req reqs[WRITES];
+    memset(reqs, 0, sizeof(reqs));
+    for (size_t k = 0; k < n; ++k) {
+        reqs[k].sector = (uint32_t) k;
+        reqs[k].count = 1;
+        reqs[k].data = data + k * SECTOR_SIZE;
+        reqs[k].write = 1;
+    }
+
+    size_t started = 0;
+    size_t reaped = 0;
+    int failed = 0;
+    while (reaped < n) {
+        if (started < n) {
+            int err = ioq_submit(q, &reqs[started], n - started);
+            if (err < 0) {
+                return err;
+            }
+            started += (size_t) err;
+        }
+
+        struct ioq_req *done[WRITES];
+        int count = ioq_reap(q, done, WRITES, started > reaped ? 1 : 0);
+        if (count < 0) {
+            return count;
+        }
+        for (int i = 0; i < count; ++i) {
+            failed += done[i]->result != 0 ? 1 : 0;
+        }
+        reaped += (size_t) count;
+    }
+
+    return failed;
+}
+
+/**
+ * @brief read the whole image through a queue of the given engine, by one
+ *        thread then by THREADS sharing it, write a few sectors back, and
+ *        compare with what the backend reads
+ * @return 0 if nothing differs; <0 on error
+ */
+static int check_engine(const struct unix_filesystem *u, enum ioq_engine engine)
+{
+    struct ioq *q = ioq_alloc_engine(u, IOQ_DEFAULT_DEPTH, engine);
+    if (q == NULL) {
+        return ERR_NOMEM;
+    }
+    if (ioq_engine(q) != engine) {
+        printf("%s: unavailable\n", ENGINES[engine]);
+        ioq_free(q);
+        return 0;
+    }
+
+    const uint32_t sectors = image_sectors(u);
+    uint8_t *data = calloc(sectors > 0 ? sectors : 1, SECTOR_SIZE);
+    if (data == NULL) {
+        ioq_free(q);
+        return ERR_NOMEM;
+    }
+
+    struct slice whole = { q, 0, sectors, data, 0 };
+    read_slice(&whole);
+    int err = whole.err;
+    uint32_t differ = compare(u, 0, sectors, data);
+    printf("%s: %u sectors read, %u differ\n", ENGINES[engine], sectors, differ);
+
+    memset(data, 0, (size_t) sectors * SECTOR_SIZE);
+    struct slice slices[THREADS];
+    pthread_t threads[THREADS];
+    int started[THREADS] = {0};
+    const uint32_t per = (sectors + THREADS - 1) / THREADS;
+    for (int i = 0; i < THREADS; ++i) {
+        const uint32_t first = (uint32_t) i * per < sectors ? (uint32_t) i * per : sectors;
+        slices[i].q = q;
+        slices[i].first = first;
+        slices[i].count = first + per < sectors ? per : sectors - first;
+        slices[i].data = data + (size_t) first * SECTOR_SIZE;
+        slices[i].err = 0;
+        started[i] = pthread_create(&threads[i], NULL, read_slice, &slices[i]) == 0;
+    }
+    // A slice whose thread cannot be started is read by us.
+    for (int i = 0; i < THREADS; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            read_slice(&slices[i]);
+        }
+        err = err == 0 ? slices[i].err : err;
+    }
+    const uint32_t threaded = compare(u, 0, sectors, data);
+    printf("%s, %d threads: %u sectors read, %u differ\n", ENGINES[engine], THREADS, sectors, threaded);
+
+    const uint32_t writes = sectors < WRITES ? sectors : WRITES;
+    const int failed = err == 0 ? write_back(q, writes, data) : 0;
+    err = err == 0 && failed < 0 ? failed : err;
+    const uint32_t written = compare(u, 0, writes, data);
+    printf("%s: %d of %u writes failed, %u sectors differ\n", ENGINES[engine], failed > 0 ? failed : 0, writes, written);
+
+    free(data);
+    ioq_free(q);
+    if (err != 0) {
+        return err;
+    }
+
+    return differ == 0 && threaded == 0 && failed == 0 && written == 0 ? 0 : ERR_IO;
+}
+
+int test(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+
+    int err = check_backend(u);
+    if (err == 0) {
+        err = check_sync(u);
+    }
+    if (err != 0) {
+        return err;
+    }
+
+    // Through O_DIRECT, the buffers of a queue would have to be aligned: the
+    // sector layer never gives such a mount one.
+    if (u->backend == SECTOR_BACKEND_DIRECT) {
+        printf("ioq: not used with O_DIRECT\n");
+        return 0;
+    }
+
+    err = check_engine(u, IOQ_ENGINE_URING);
+    if (err == 0) {
+        err = check_engine(u, IOQ_ENGINE_THREADS);
+    }
+
+    return err;
+}
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "mount.h"
+#include "direntv6.h"
+#include "sector.h"
+#include "inode.h"
+#include "filev6.h"
+#include "bmblock.h"
+#include "error.h"
+
+// Past the 7 indirect sectors: the tail is reached through the double indirect one.
+#define HUGE_PATH "/huge"
+#define HUGE_SIZE (SECT_UP_LIM + 20 * SECTOR_SIZE + 123)
+#define HUGE_SECTORS ((HUGE_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE)
+// Its data, its indirect sectors and the double indirect one.
+#define HUGE_NEEDED (HUGE_SECTORS + (HUGE_SECTORS + ADDRESSES_PER_SECTOR - 1) / ADDRESSES_PER_SECTOR + 1)
+#define CHUNK (3000) // bytes per write and per read: not a multiple of SECTOR_SIZE
+
+// Flushed in turns with a small file: each flush of the first adds an extent.
+#define SPLIT_PATH "/split"
+#define SPLIT_STEP (4 * SECTOR_SIZE + 100)
+#define SPLIT_ROUNDS (EXTENTS_IN_INODE + 3)
+#define GAPS_PATH "/gaps"
+#define GAPS_STEP (SECTOR_SIZE)
+
+/**
+ * @brief the byte of a test file at a given offset: it differs from a sector
+ *        to the next, so that a sector read in the wrong place shows
+ */
+static uint8_t pattern(int32_t seed, int32_t offset)
+{
+    return (uint8_t) (seed + offset * 7 + offset / SECTOR_SIZE);
+}
+
+/**
+ * @brief append len bytes of the pattern to an open file, at its end (done)
+ * @return 0 on success; <0 on error
+ */
+static int append_pattern(struct unix_filesystem *u, struct filev6 *fv6, int32_t seed, int32_t done, int32_t len)
+{
+    uint8_t buf[CHUNK];
+    int err = 0;
+    for (int32_t end = done + len; done < end && err == 0; done += CHUNK) {
+        const int32_t n = end - done < CHUNK ? end - done : CHUNK;
+        for (int32_t i = 0; i < n; ++i) {
+            buf[i] = pattern(seed, done + i);
+        }
+        err = filev6_writebytes(u, fv6, buf, n);
+    }
+
+    return err;
+}
+
+/**
+ * @brief create a file and open it
+ * @return its inode number; <0 on error
+ */
+static int create_file(struct unix_filesystem *u, const char *path, uint16_t mode, struct filev6 *fv6)
+{
+    int inr = direntv6_create(u, path, mode);
+    if (inr < 0) {
+        return inr;
+    }
+
+    memset(fv6, 0, sizeof(struct filev6));
+    int err = filev6_open(u, (uint16_t) inr, fv6);
+
+    return err == 0 ? inr : err;
+}
+
+/**
+ * @brief create a file and fill it with size bytes of the pattern
+ * @return its inode number; <0 on error
+ */
+static int write_file(struct unix_filesystem *u, const char *path, uint16_t mode, int32_t seed, int32_t size)
+{
+    struct filev6 fv6;
+    int inr = create_file(u, path, mode, &fv6);
+    if (inr < 0) {
+        return inr;
+    }
+
+    int err = append_pattern(u, &fv6, seed, 0, size);
+    int closed = filev6_close(u, &fv6);
+    if (err == 0) {
+        err = closed;
+    }
+
+    return err == 0 ? inr : err;
+}
+
+/**
+ * @brief read a file back, through filev6_read() then sector by sector
+ *        through inode_findsector(), and compare it with the pattern
+ * @return the number of bytes that differ; <0 on error
+ */
+static int32_t check_file(struct unix_filesystem *u, uint16_t inr, int32_t seed, int32_t size)
+{
+    struct filev6 fv6;
+    memset(&fv6, 0, sizeof(struct filev6));
+    int err = filev6_open(u, inr, &fv6);
+    if (err != 0) {
+        return err;
+    }
+    if (inode_getsize(&fv6.i_node) != size) {
+        fprintf(stderr, "ERROR: inode %u has size %d, not %d\n", inr, inode_getsize(&fv6.i_node), size);
+        return ERR_IO;
+    }
+
+    int32_t wrong = 0;
+    int32_t offset = 0;
+    uint8_t buf[CHUNK];
+    int read = 0;
+    while ((read = filev6_read(&fv6, buf, CHUNK)) > 0) {
+        for (int i = 0; i < read; ++i) {
+            wrong += buf[i] != pattern(seed, offset + i) ? 1 : 0;
+        }
+        offset += read;
+    }
+    if (read < 0) {
+        return read;
+    }
+    wrong += size - offset;
+
+    for (int32_t k = 0; k * SECTOR_SIZE < size; ++k) {
+        int sector = inode_findsector(u, &fv6.i_node, k);
+        if (sector <= 0) {
+            return sector < 0 ? sector : ERR_IO;
+        }
+        err = sector_read(u, (uint32_t) sector, buf);
+        if (err != 0) {
+            return err;
+        }
+        for (int32_t i = 0; i < SECTOR_SIZE && k * SECTOR_SIZE + i < size; ++i) {
+            wrong += buf[i] != pattern(seed, k * SECTOR_SIZE + i) ? 1 : 0;
+        }
+    }
+
+    return wrong;
+}
+
+/**
+ * @brief write an IEXTENT file in more extents than i_addr holds (the others
+ *        in its overflow sector), then read it back
+ * @return the number of bytes read back wrong; <0 on error
+ */
+static int32_t test_split(struct unix_filesystem *u)
+{
+    if (!(u->s.s_features & SUPERBLOCK_FEATURE_EXTENTS)) {
+        printf("%s: skipped, no extents on this image\n", SPLIT_PATH);
+        return 0;
+    }
+
+    struct filev6 split;
+    struct filev6 gaps;
+    int split_inr = create_file(u, SPLIT_PATH, IALLOC | IEXTENT, &split);
+    int gaps_inr = split_inr < 0 ? split_inr : create_file(u, GAPS_PATH, IALLOC, &gaps);
+    if (split_inr < 0 || gaps_inr < 0) {
+        return split_inr < 0 ? split_inr : gaps_inr;
+    }
+
+    int err = 0;
+    for (int32_t round = 0; round < SPLIT_ROUNDS && err == 0; ++round) {
+        err = append_pattern(u, &split, 2, round * SPLIT_STEP, SPLIT_STEP);
+        if (err == 0) {
+            err = filev6_flush(u, &split);
+        }
+        if (err == 0) {
+            err = append_pattern(u, &gaps, 3, round * GAPS_STEP, GAPS_STEP);
+        }
+        if (err == 0) {
+            err = filev6_flush(u, &gaps);
+        }
+    }
+    int closed = filev6_close(u, &split);
+    err = err == 0 ? closed : err;
+    closed = filev6_close(u, &gaps);
+    err = err == 0 ? closed : err;
+    if (err != 0) {
+        return err;
+    }
+
+    struct inode inode;
+    memset(&inode, 0, sizeof(struct inode));
+    err = inode_read(u, (uint16_t) split_inr, &inode);
+    if (err != 0) {
+        return err;
+    }
+    printf("%s: %d bytes, %s, %u extents\n", SPLIT_PATH, inode_getsize(&inode),
+           inode_has_extents(u, &inode) ? "extents" : "indirect sectors", inode.i_addr[ADDR_EXTENT_COUNT]);
+
+    int32_t wrong = check_file(u, (uint16_t) split_inr, 2, SPLIT_ROUNDS * SPLIT_STEP);
+    int32_t gaps_wrong = check_file(u, (uint16_t) gaps_inr, 3, SPLIT_ROUNDS * GAPS_STEP);
+    if (wrong < 0 || gaps_wrong < 0) {
+        return wrong < 0 ? wrong : gaps_wrong;
+    }
+    printf("%s: %d bytes read back wrong\n", SPLIT_PATH, wrong);
+    printf("%s: %d bytes read back wrong\n", GAPS_PATH, gaps_wrong);
+
+    return wrong + gaps_wrong;
+}
+
+/**
+ * @brief write a file past the indirect sectors (through the double indirect
+ *        one), then read it back; skipped if the image has not enough free
+ *        sectors
+ * @return the number of bytes read back wrong; <0 on error
+ */
+static int32_t test_huge(struct unix_filesystem *u)
+{
+    uint64_t free_sectors = 0;
+    for (uint64_t x = u->fbm->min; x <= u->fbm->max; ++x) {
+        free_sectors += bm_get(u->fbm, x) == 0 ? 1 : 0;
+    }
+    if (free_sectors < HUGE_NEEDED) {
+        printf("%s: skipped, %" PRIu64 " free sectors, %d needed\n", HUGE_PATH, free_sectors, HUGE_NEEDED);
+        return 0;
+    }
+
+    int inr = write_file(u, HUGE_PATH, IALLOC, 1, HUGE_SIZE);
+    if (inr < 0) {
+        fprintf(stderr, "ERROR: writing %s: %s\n", HUGE_PATH, ERR_MESSAGES[inr - ERR_FIRST]);
+        return inr;
+    }
+
+    struct inode inode;
+    memset(&inode, 0, sizeof(struct inode));
+    int err = inode_read(u, (uint16_t) inr, &inode);
+    if (err != 0) {
+        return err;
+    }
+    printf("%s: %d bytes, %s, double indirect sector %s\n", HUGE_PATH, inode_getsize(&inode),
+           inode_has_extents(u, &inode) ? "extents" : "indirect sectors",
+           inode.i_addr[ADDR_DOUBLE] != 0 ? "set" : "missing");
+
+    int32_t wrong = check_file(u, (uint16_t) inr, 1, HUGE_SIZE);
+    if (wrong < 0) {
+        return wrong;
+    }
+    printf("%s: %d bytes read back wrong\n", HUGE_PATH, wrong);
+
+    return wrong;
+}
+
+int test(struct unix_filesystem *u)
+{
+    M_REQUIRE_NON_NULL(u);
+
+    int err = mountv6_bitmaps(u);
+    if (err != 0) {
+        return err;
+    }
+
+    const int32_t huge_wrong = test_huge(u);
+    if (huge_wrong < 0) {
+        return huge_wrong;
+    }
+
+    const int32_t split_wrong = test_split(u);
+    if (split_wrong < 0) {
+        return split_wrong;
+    }
+
+    return huge_wrong == 0 && split_wrong == 0 ? 0 : ERR_IO;
+}
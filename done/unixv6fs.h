@@ -189,7 +189,8 @@ struct superblock {
     uint8_t     s_fmod;         /* super block modified flag */
     uint8_t     s_ronly;        /* mounted read-only flag */
     uint16_t    s_time[2];      /* current date of last update */
-    uint16_t    pad[244];       /* unused entries:
+    uint16_t    s_features;     /* extensions to the v6 format the image uses (0 on v6 images) */
+    uint16_t    pad[243];       /* unused entries:
                                  * padding to ensure sizeof(superblock) == SECTOR_SIZE */
 };
 
@@ -227,6 +228,8 @@ struct inode {
 #define IREAD   0400        /* read    permission */
 #define IWRITE  0200        /* write   permission */
 #define IEXEC   0100        /* execute permission */
+#define IEXTENT ISVTX       /* i_addr holds extents -- only with SUPERBLOCK_FEATURE_EXTENTS:
+                             * UNIX v6 sets ISVTX on shared-text executables */
 
 /*
  * The root directory (/) is at inode 1; inode 0 is never used.